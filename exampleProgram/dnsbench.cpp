@@ -0,0 +1,615 @@
+/*
+* Copyright (c) 2019 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "epc/epctools.h"
+#include "epc/einternal.h"
+#include "epc/egetopt.h"
+#include "epc/dnscache.h"
+#include "epc/dnsparser.h"
+#include "epc/epcdns.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static epctime_t now_us()
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (epctime_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+class LatencyStats
+{
+public:
+   LatencyStats( const char *name ) : m_name( name ), m_start( now_us() ) {}
+
+   Void start() { m_start = now_us(); }
+   Void add( epctime_t us ) { m_samples.push_back( us ); }
+
+   Void report()
+   {
+      epctime_t elapsed = now_us() - m_start;
+
+      if ( m_samples.empty() )
+      {
+         printf( "%-28s no samples\n", m_name.c_str() );
+         return;
+      }
+
+      std::sort( m_samples.begin(), m_samples.end() );
+
+      size_t cnt = m_samples.size();
+      printf( "%-28s n=%-8zu p50=%-8lld p99=%-8lld max=%-8lld us  %.0f ops/sec\n",
+         m_name.c_str(), cnt,
+         m_samples[cnt * 50 / 100],
+         m_samples[std::min( cnt - 1, cnt * 99 / 100 )],
+         m_samples[cnt - 1],
+         elapsed > 0 ? cnt * 1000000.0 / elapsed : 0.0 );
+   }
+
+private:
+   EString m_name;
+   epctime_t m_start;
+   std::vector<epctime_t> m_samples;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// builds the canned response for a question, the answers are derived from
+// the query name so that every name resolves
+class ResponseBuilder
+{
+public:
+   ResponseBuilder( uint16_t id, const std::string &qname, ns_type qtype )
+      : m_qname( qname ),
+        m_qtype( qtype ),
+        m_ancount( 0 ),
+        m_arcount( 0 )
+   {
+      // header, the counts are updated as records are added
+      put16( id );
+      put16( 0x8580 ); // QR AA RD RA
+      put16( 1 );
+      put16( 0 );
+      put16( 0 );
+      put16( 0 );
+
+      putName( qname );
+      put16( qtype );
+      put16( ns_c_in );
+
+      build();
+   }
+
+   std::vector<unsigned char> &getMessage() { return m_msg; }
+
+private:
+   Void build()
+   {
+      std::string pgw( "topon.s5.pgw1." + m_qname );
+      std::string srv( "_diameter._tcp." + m_qname );
+      std::string hss( "hss1." + m_qname );
+
+      switch ( m_qtype )
+      {
+         case ns_t_naptr:
+         {
+            addNAPTR( m_ancount, m_qname, 10, 10, "a", "x-3gpp-pgw:x-s5-gtp:x-s8-gtp", pgw );
+            addNAPTR( m_ancount, m_qname, 10, 20, "s", "aaa+ap16777251:diameter.tcp", srv );
+            addA( m_arcount, pgw, "10.0.0.1" );
+            addAAAA( m_arcount, pgw, "2001:db8::1" );
+            addSRV( m_arcount, srv, 10, 10, 3868, hss );
+            addA( m_arcount, hss, "10.0.0.2" );
+            break;
+         }
+         case ns_t_srv:
+         {
+            addSRV( m_ancount, m_qname, 10, 10, 3868, hss );
+            addA( m_arcount, hss, "10.0.0.2" );
+            break;
+         }
+         case ns_t_a:
+         {
+            addA( m_ancount, m_qname, "10.0.0.1" );
+            break;
+         }
+         case ns_t_aaaa:
+         {
+            addAAAA( m_ancount, m_qname, "2001:db8::1" );
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+
+      set16( 6, m_ancount );
+      set16( 10, m_arcount );
+   }
+
+   Void put8( unsigned char v ) { m_msg.push_back( v ); }
+   Void put16( uint16_t v ) { put8( v >> 8 ); put8( v & 0xff ); }
+   Void put32( uint32_t v ) { put16( v >> 16 ); put16( v & 0xffff ); }
+   Void set16( size_t ofs, uint16_t v ) { m_msg[ofs] = v >> 8; m_msg[ofs + 1] = v & 0xff; }
+
+   Void putString( const std::string &s )
+   {
+      put8( s.size() );
+      m_msg.insert( m_msg.end(), s.begin(), s.end() );
+   }
+
+   Void putName( const std::string &name )
+   {
+      size_t pos = 0;
+      while ( pos < name.size() )
+      {
+         size_t end = name.find( '.', pos );
+         if ( end == std::string::npos )
+            end = name.size();
+         putString( name.substr( pos, end - pos ) );
+         pos = end + 1;
+      }
+      put8( 0 );
+   }
+
+   // writes the record header and returns the offset of the rdata length
+   size_t putRecord( uint16_t &count, const std::string &name, ns_type type )
+   {
+      count++;
+      putName( name );
+      put16( type );
+      put16( ns_c_in );
+      put32( 300 );
+      put16( 0 );
+      return m_msg.size() - 2;
+   }
+
+   Void endRecord( size_t ofs ) { set16( ofs, m_msg.size() - ofs - 2 ); }
+
+   Void addA( uint16_t &count, const std::string &name, const char *addr )
+   {
+      struct in_addr a;
+      inet_pton( AF_INET, addr, &a );
+      size_t ofs = putRecord( count, name, ns_t_a );
+      m_msg.insert( m_msg.end(), (unsigned char *)&a, (unsigned char *)&a + sizeof(a) );
+      endRecord( ofs );
+   }
+
+   Void addAAAA( uint16_t &count, const std::string &name, const char *addr )
+   {
+      struct in6_addr a;
+      inet_pton( AF_INET6, addr, &a );
+      size_t ofs = putRecord( count, name, ns_t_aaaa );
+      m_msg.insert( m_msg.end(), (unsigned char *)&a, (unsigned char *)&a + sizeof(a) );
+      endRecord( ofs );
+   }
+
+   Void addSRV( uint16_t &count, const std::string &name, uint16_t priority, uint16_t weight, uint16_t port, const std::string &target )
+   {
+      size_t ofs = putRecord( count, name, ns_t_srv );
+      put16( priority );
+      put16( weight );
+      put16( port );
+      putName( target );
+      endRecord( ofs );
+   }
+
+   Void addNAPTR( uint16_t &count, const std::string &name, uint16_t order, uint16_t preference,
+      const char *flags, const char *service, const std::string &replacement )
+   {
+      size_t ofs = putRecord( count, name, ns_t_naptr );
+      put16( order );
+      put16( preference );
+      putString( flags );
+      putString( service );
+      putString( "" );
+      putName( replacement );
+      endRecord( ofs );
+   }
+
+   std::string m_qname;
+   ns_type m_qtype;
+   uint16_t m_ancount;
+   uint16_t m_arcount;
+   std::vector<unsigned char> m_msg;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// UDP DNS server answering with canned responses after a configurable
+// delay, a percentage of the requests are dropped
+class StubServer : public EThreadBasic
+{
+public:
+   StubServer( int port, int delayms, int losspct )
+      : m_port( port ),
+        m_delay( delayms * 1000 ),
+        m_loss( losspct ),
+        m_sock( -1 ),
+        m_shutdown( false )
+   {
+   }
+
+   Void start()
+   {
+      struct sockaddr_in addr;
+
+      m_sock = socket( AF_INET, SOCK_DGRAM, 0 );
+      memset( &addr, 0, sizeof(addr) );
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons( m_port );
+      addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+      if ( m_sock == -1 || bind( m_sock, (struct sockaddr *)&addr, sizeof(addr) ) == -1 )
+      {
+         EString msg;
+         msg.format( "StubServer::start() - unable to bind to port %d", m_port );
+         throw EError( EError::Error, msg );
+      }
+
+      init( NULL );
+   }
+
+   Void stop()
+   {
+      m_shutdown = true;
+      join();
+      close( m_sock );
+   }
+
+   virtual Dword threadProc( Void *arg )
+   {
+      while ( !m_shutdown )
+      {
+         // wait for a request or the next delayed response
+         int timeout = 100;
+         if ( !m_pending.empty() )
+            timeout = std::max( 0LL, (m_pending.begin()->first - now_us()) / 1000 );
+
+         struct pollfd pfd = { m_sock, POLLIN, 0 };
+         if ( poll( &pfd, 1, std::min( timeout, 100 ) ) > 0 )
+            receive();
+
+         epctime_t now = now_us();
+         while ( !m_pending.empty() && m_pending.begin()->first <= now )
+         {
+            Pending &p = m_pending.begin()->second;
+            sendto( m_sock, p.msg.data(), p.msg.size(), 0, (struct sockaddr *)&p.addr, sizeof(p.addr) );
+            m_pending.erase( m_pending.begin() );
+         }
+      }
+
+      return 0;
+   }
+
+private:
+   struct Pending
+   {
+      struct sockaddr_in addr;
+      std::vector<unsigned char> msg;
+   };
+
+   Void receive()
+   {
+      unsigned char buf[NS_PACKETSZ];
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof(addr);
+      char qname[NS_MAXDNAME];
+
+      int len = recvfrom( m_sock, buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addrlen );
+      if ( len < NS_HFIXEDSZ )
+         return;
+
+      if ( m_loss > 0 && rand() % 100 < m_loss )
+         return;
+
+      int nlen = dn_expand( buf, buf + len, buf + NS_HFIXEDSZ, qname, sizeof(qname) );
+      if ( nlen < 0 || NS_HFIXEDSZ + nlen + 4 > len )
+         return;
+
+      const unsigned char *q = buf + NS_HFIXEDSZ + nlen;
+      ResponseBuilder rb( (buf[0] << 8) | buf[1], qname, (ns_type)((q[0] << 8) | q[1]) );
+
+      Pending p;
+      p.addr = addr;
+      p.msg.swap( rb.getMessage() );
+
+      if ( p.msg.size() > NS_PACKETSZ )
+         p.msg[2] |= 0x02; // TC
+
+      if ( m_delay == 0 )
+         sendto( m_sock, p.msg.data(), p.msg.size(), 0, (struct sockaddr *)&addr, sizeof(addr) );
+      else
+         m_pending.insert( std::make_pair( now_us() + m_delay, p ) );
+   }
+
+   int m_port;
+   epctime_t m_delay;
+   int m_loss;
+   int m_sock;
+   volatile bool m_shutdown;
+   std::multimap<epctime_t,Pending> m_pending;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+Void benchParser( int iterations )
+{
+   ResponseBuilder rb( 1, "internet.apn.epc.mnc099.mcc310.3gppnetwork.org", ns_t_naptr );
+   std::vector<unsigned char> msg( rb.getMessage() );
+   LatencyStats stats( "Parser::parse" );
+
+   for (int i = 0; i < iterations; i++)
+   {
+      epctime_t start = now_us();
+      DNS::QueryPtr q( new DNS::Query( ns_t_naptr, "internet.apn.epc.mnc099.mcc310.3gppnetwork.org" ) );
+      DNS::Parser p( q, msg.data(), msg.size(), DNS::Cache::getNegativeTTL() );
+      p.parse();
+      stats.add( now_us() - start );
+   }
+
+   stats.report();
+}
+
+Void benchCacheSync( int iterations )
+{
+   DNS::Cache &cache = DNS::Cache::getInstance();
+   LatencyStats miss( "Cache::query sync miss" );
+   LatencyStats hit( "Cache::query sync hit" );
+   EString domain;
+   bool cacheHit;
+
+   for (int i = 0; i < iterations; i++)
+   {
+      domain.format( "sync%d.bench.example", i );
+      epctime_t start = now_us();
+      cache.query( ns_t_a, domain, cacheHit );
+      miss.add( now_us() - start );
+   }
+   miss.report();
+
+   hit.start();
+   for (int i = 0; i < iterations; i++)
+   {
+      domain.format( "sync%d.bench.example", i );
+      epctime_t start = now_us();
+      cache.query( ns_t_a, domain, cacheHit );
+      hit.add( now_us() - start );
+   }
+   hit.report();
+}
+
+struct AsyncBench
+{
+   AsyncBench( int window ) : sem( window ), stats( "Cache::query async miss" ) {}
+
+   ESemaphorePrivate sem;
+   EMutexPrivate mutex;
+   LatencyStats stats;
+};
+
+struct AsyncItem
+{
+   AsyncBench *bench;
+   epctime_t start;
+};
+
+extern "C" Void async_callback( DNS::QueryPtr q, bool cacheHit, const Void *data )
+{
+   AsyncItem *item = (AsyncItem*)data;
+
+   {
+      EMutexLock l( item->bench->mutex );
+      item->bench->stats.add( now_us() - item->start );
+   }
+
+   item->bench->sem.Increment();
+}
+
+Void benchCacheAsync( int iterations, int window )
+{
+   DNS::Cache &cache = DNS::Cache::getInstance();
+   AsyncBench bench( window );
+   std::vector<AsyncItem> items( iterations );
+   EString domain;
+
+   for (int i = 0; i < iterations; i++)
+   {
+      domain.format( "async%d.bench.example", i );
+      items[i].bench = &bench;
+
+      bench.sem.Decrement();
+      items[i].start = now_us();
+      cache.query( ns_t_a, domain, async_callback, &items[i] );
+   }
+
+   // wait for the outstanding queries
+   for (int i = 0; i < window; i++)
+      bench.sem.Decrement();
+
+   bench.stats.report();
+}
+
+Void benchNodeSelector( int iterations )
+{
+   LatencyStats miss( "NodeSelector::process miss" );
+   LatencyStats hit( "NodeSelector::process hit" );
+   EString apn;
+
+   for (int pass = 0; pass < 2; pass++)
+   {
+      LatencyStats &stats = pass == 0 ? miss : hit;
+      stats.start();
+
+      for (int i = 0; i < iterations; i++)
+      {
+         apn.format( "apn%d", i );
+         EPCDNS::PGWNodeSelector s( apn.c_str(), "099", "310" );
+         s.addDesiredProtocol( EPCDNS::pgw_x_s5_gtp );
+
+         epctime_t start = now_us();
+         s.process();
+         stats.add( now_us() - start );
+      }
+
+      stats.report();
+   }
+}
+
+Void benchDiameterSelector( int iterations )
+{
+   LatencyStats miss( "DiameterSelector::process miss" );
+   LatencyStats hit( "DiameterSelector::process hit" );
+   EString realm;
+
+   for (int pass = 0; pass < 2; pass++)
+   {
+      LatencyStats &stats = pass == 0 ? miss : hit;
+      stats.start();
+
+      for (int i = 0; i < iterations; i++)
+      {
+         realm.format( "realm%d.bench.example", i );
+         EPCDNS::DiameterSelector s;
+         s.setRealm( realm.c_str() );
+         s.setApplication( EPCDNS::dia_app_3gpp_s6a );
+         s.setProtocol( EPCDNS::dia_protocol_tcp );
+
+         epctime_t start = now_us();
+         s.process();
+         stats.add( now_us() - start );
+      }
+
+      stats.report();
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+Void usage()
+{
+   const char *msg =
+       "USAGE:  dnsbench [--help] [--file optionfile] [--port port] [--iterations n]\n"
+       "                 [--window n] [--delay ms] [--loss percent]\n";
+
+   cout << msg;
+}
+
+Void run( EGetOpt &opt )
+{
+   int port = opt.getCmdLine( "-p,--port", 15353L );
+   int iterations = opt.getCmdLine( "-n,--iterations", 10000L );
+   int window = opt.getCmdLine( "-w,--window", 100L );
+   int delay = opt.getCmdLine( "-d,--delay", 0L );
+   int loss = opt.getCmdLine( "-l,--loss", 0L );
+
+   printf( "port=%d iterations=%d window=%d delay=%dms loss=%d%%\n", port, iterations, window, delay, loss );
+
+   StubServer server( port, delay, loss );
+   server.start();
+
+   DNS::Cache &cache = DNS::Cache::getInstance();
+   cache.addNamedServer( "127.0.0.1", port, port );
+   cache.applyNamedServers();
+
+   benchParser( iterations );
+   benchCacheSync( iterations );
+   benchCacheAsync( iterations, window );
+   benchNodeSelector( iterations );
+   benchDiameterSelector( iterations );
+
+   DNS::CacheStats cs = cache.getStats();
+   printf( "cache entries=%ld bytes=%ld queries=%ld timeouts=%ld errors=%ld avg_rtt=%ldus\n",
+      cs.getEntries(), cs.getBytes(), cs.getQueries(), cs.getTimeouts(), cs.getErrors(), cs.getAverageLatency() );
+
+   server.stop();
+}
+
+int main(int argc, char *argv[])
+{
+   EGetOpt::Option options[] = {
+       {"-h", "--help", EGetOpt::no_argument, EGetOpt::dtNone},
+       {"-f", "--file", EGetOpt::required_argument, EGetOpt::dtString},
+       {"-p", "--port", EGetOpt::required_argument, EGetOpt::dtInt32},
+       {"-n", "--iterations", EGetOpt::required_argument, EGetOpt::dtInt32},
+       {"-w", "--window", EGetOpt::required_argument, EGetOpt::dtInt32},
+       {"-d", "--delay", EGetOpt::required_argument, EGetOpt::dtInt32},
+       {"-l", "--loss", EGetOpt::required_argument, EGetOpt::dtInt32},
+       {"", "", EGetOpt::no_argument, EGetOpt::dtNone},
+   };
+
+   EGetOpt opt;
+   EString optFile;
+
+   try
+   {
+      opt.loadCmdLine(argc, argv, options);
+      if (opt.getCmdLine("-h,--help", false))
+      {
+         usage();
+         exit(0);
+      }
+
+      optFile.format("%s.json", argv[0]);
+      opt.loadFile(optFile.c_str());
+
+      optFile = opt.getCmdLine("-f,--file", "");
+      if (!optFile.empty())
+         opt.loadFile(optFile.c_str());
+   }
+   catch(const std::exception& e)
+   {
+      std::cerr << e.what() << '\n';
+      exit(0);
+   }
+
+   try
+   {
+      EpcTools::Initialize(opt);
+
+      run(opt);
+
+      EpcTools::UnInitialize();
+   }
+   catch (EError &e)
+   {
+      cout << (cpStr)e << endl;
+   }
+
+   return 0;
+}
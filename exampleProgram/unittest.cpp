@@ -0,0 +1,641 @@
+/*
+* Copyright (c) 2019 Sprint
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/nameser.h>
+
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "epc/epctools.h"
+#include "epc/einternal.h"
+#include "epc/egetopt.h"
+#include "epc/dnscache.h"
+#include "epc/dnsparser.h"
+#include "epc/efd.h"
+#include "epc/efdjson.h"
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static int g_checks = 0;
+static int g_failures = 0;
+
+#define CHECK(c) check( (c), #c, __FILE__, __LINE__ )
+
+static Void check( bool ok, const char *expr, const char *file, int line )
+{
+   g_checks++;
+   if ( !ok )
+   {
+      g_failures++;
+      printf( "%s:%d - FAILED - %s\n", file, line, expr );
+   }
+}
+
+static Void runTest( const char *name, Void (*test)() )
+{
+   int failures = g_failures;
+
+   try
+   {
+      test();
+   }
+   catch ( std::exception &e )
+   {
+      g_failures++;
+      printf( "%s - FAILED - unexpected exception [%s]\n", name, e.what() );
+   }
+
+   printf( "%-36s %s\n", name, failures == g_failures ? "ok" : "FAILED" );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// encodes a DNS response, the counts in the header are supplied by the caller
+class Response
+{
+public:
+   Response( uint16_t flags, uint16_t ancount, uint16_t nscount )
+   {
+      put16( 1 );
+      put16( flags );
+      put16( 1 );
+      put16( ancount );
+      put16( nscount );
+      put16( 0 );
+   }
+
+   Response &question( const char *name, ns_type type )
+   {
+      putName( name );
+      put16( type );
+      put16( ns_c_in );
+      return *this;
+   }
+
+   Response &a( const char *name, uint32_t ttl, uint32_t addr )
+   {
+      record( name, ns_t_a, ttl );
+      put16( 4 );
+      put32( addr );
+      return *this;
+   }
+
+   Response &soa( const char *name, uint32_t ttl, uint32_t minimum )
+   {
+      std::vector<unsigned char> rdata;
+
+      rdata.swap( m_msg );
+      putName( "ns.example.com" );
+      putName( "host.example.com" );
+      put32( 1 );
+      put32( 7200 );
+      put32( 900 );
+      put32( 86400 );
+      put32( minimum );
+      rdata.swap( m_msg );
+
+      record( name, ns_t_soa, ttl );
+      put16( rdata.size() );
+      m_msg.insert( m_msg.end(), rdata.begin(), rdata.end() );
+      return *this;
+   }
+
+   unsigned char *data() { return m_msg.data(); }
+   int size() { return m_msg.size(); }
+
+private:
+   Void put8( unsigned char v ) { m_msg.push_back( v ); }
+   Void put16( uint16_t v ) { put8( v >> 8 ); put8( v & 0xff ); }
+   Void put32( uint32_t v ) { put16( v >> 16 ); put16( v & 0xffff ); }
+
+   Void putName( const char *name )
+   {
+      while ( *name )
+      {
+         const char *dot = strchr( name, '.' );
+         size_t len = dot ? dot - name : strlen( name );
+         put8( len );
+         m_msg.insert( m_msg.end(), name, name + len );
+         name += dot ? len + 1 : len;
+      }
+      put8( 0 );
+   }
+
+   Void record( const char *name, ns_type type, uint32_t ttl )
+   {
+      putName( name );
+      put16( type );
+      put16( ns_c_in );
+      put32( ttl );
+   }
+
+   std::vector<unsigned char> m_msg;
+};
+
+static Void testDnsResponseCodes()
+{
+   // NXDOMAIN, the negative TTL is the lesser of the SOA TTL and minimum
+   {
+      Response r( 0x8183, 0, 1 );
+      r.question( "foo.example.com", ns_t_naptr ).soa( "example.com", 3600, 300 );
+
+      DNS::QueryPtr q( new DNS::Query( ns_t_naptr, "foo.example.com" ) );
+      DNS::Parser p( q, r.data(), r.size(), 60 );
+      p.parse();
+
+      CHECK( q->isNegative() );
+      CHECK( q->getTTL() == 300 );
+      CHECK( q->getAnswers().empty() );
+   }
+
+   // NOERROR without answers or an SOA uses the configured negative TTL
+   {
+      Response r( 0x8180, 0, 0 );
+      r.question( "foo.example.com", ns_t_a );
+
+      DNS::QueryPtr q( new DNS::Query( ns_t_a, "foo.example.com" ) );
+      DNS::Parser p( q, r.data(), r.size(), 60 );
+      p.parse();
+
+      CHECK( q->isNegative() );
+      CHECK( q->getTTL() == 60 );
+   }
+
+   // NOERROR with an answer is a positive response
+   {
+      Response r( 0x8180, 1, 0 );
+      r.question( "foo.example.com", ns_t_a ).a( "foo.example.com", 120, 0x0a000001 );
+
+      DNS::QueryPtr q( new DNS::Query( ns_t_a, "foo.example.com" ) );
+      DNS::Parser p( q, r.data(), r.size(), 60 );
+      p.parse();
+
+      CHECK( !q->isNegative() );
+      CHECK( q->getTTL() == 120 );
+      CHECK( q->getAnswers().size() == 1 );
+   }
+
+   // SERVFAIL is a resolver error rather than a parse failure
+   {
+      Response r( 0x8182, 0, 0 );
+      r.question( "foo.example.com", ns_t_a );
+
+      DNS::QueryPtr q( new DNS::Query( ns_t_a, "foo.example.com" ) );
+      DNS::Parser p( q, r.data(), r.size(), 60 );
+
+      bool thrown = false;
+      try
+      {
+         p.parse();
+      }
+      catch ( DNS::ResolverError &e )
+      {
+         thrown = strstr( e.what(), "SERVFAIL" ) != NULL;
+      }
+      CHECK( thrown );
+      CHECK( !q->isNegative() );
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class TestCache : public DNS::Cache
+{
+public:
+   Void add( const char *domain )
+   {
+      updateCache( DNS::QueryPtr( new DNS::Query( ns_t_a, domain ) ) );
+   }
+
+   Void hit( const char *domain )
+   {
+      bool cacheHit = false;
+      query( ns_t_a, domain, cacheHit );
+   }
+
+   DNS::QueryPtr find( const char *domain )
+   {
+      std::list<DNS::QueryPtr> queries;
+      getCacheQueries( queries );
+
+      for ( auto q : queries )
+      {
+         if ( q->getDomain() == domain )
+            return q;
+      }
+
+      return DNS::QueryPtr();
+   }
+
+   bool contains( const char *domain ) { return find( domain ) ? true : false; }
+};
+
+static Void testDnsCacheEviction()
+{
+   size_t maxentries = DNS::Cache::getMaxEntries();
+   DNS::Cache::setMaxEntries( 3 );
+
+   TestCache cache;
+
+   cache.add( "a.test" );
+   cache.add( "b.test" );
+   cache.add( "c.test" );
+   cache.hit( "a.test" );
+
+   // the sweep passes over the entry that was hit and evicts the next one
+   cache.add( "d.test" );
+
+   CHECK( cache.getEntryCount() == 3 );
+   CHECK( cache.contains( "a.test" ) );
+   CHECK( !cache.contains( "b.test" ) );
+   CHECK( cache.contains( "c.test" ) );
+   CHECK( cache.contains( "d.test" ) );
+   CHECK( cache.getStats().getEvictions() == 1 );
+
+   // a refreshed entry keeps the hits of the entry it replaces
+   cache.hit( "a.test" );
+   DNS::QueryPtr prev = cache.find( "a.test" );
+   cache.add( "a.test" );
+   DNS::QueryPtr next = cache.find( "a.test" );
+
+   CHECK( prev != next );
+   CHECK( next && next->getHits() == 1 );
+
+   // the hand resumes after the entry it last passed
+   cache.add( "e.test" );
+
+   CHECK( cache.getEntryCount() == 3 );
+   CHECK( cache.contains( "a.test" ) );
+   CHECK( !cache.contains( "c.test" ) );
+   CHECK( cache.contains( "d.test" ) );
+   CHECK( cache.contains( "e.test" ) );
+   CHECK( cache.getStats().getEvictions() == 2 );
+
+   DNS::Cache::setMaxEntries( maxentries );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<std::string> g_jsonErrors;
+
+static void jsonError( const char *msg )
+{
+   g_jsonErrors.push_back( msg );
+}
+
+static size_t count( const std::string &s, const char *what )
+{
+   size_t cnt = 0;
+   size_t len = strlen( what );
+
+   for ( size_t pos = s.find( what ); pos != std::string::npos; pos = s.find( what, pos + len ) )
+      cnt++;
+
+   return cnt;
+}
+
+// returns the members of the command object written by fdJsonGetJSON
+static std::string members( const std::string &json, const char *cmd )
+{
+   std::string prefix = EUtility::string_format( "{\"%s\":", cmd );
+
+   if ( json.compare( 0, prefix.size(), prefix ) != 0 || json.size() < prefix.size() + 1 )
+      return "";
+
+   return json.substr( prefix.size(), json.size() - prefix.size() - 1 );
+}
+
+static Void testJsonRoundTrip()
+{
+   FDDictionaryEntryCommand cmd( "Capabilities-Exchange-Request" );
+   FDMessageRequest msg1( &cmd );
+   FDMessageRequest msg2( &cmd );
+   std::string json1;
+   std::string json2;
+
+   g_jsonErrors.clear();
+
+   const char *json =
+      "{"
+         "\"Origin-Host\":\"host1.test\","
+         "\"Origin-Realm\":\"test\","
+         "\"Host-IP-Address\":\"127.0.0.1\","
+         "\"Origin-State-Id\":7,"
+         "\"Proxy-Info\":["
+            "{\"Proxy-Host\":\"proxy1.test\",\"Proxy-State\":\"0x0102\"},"
+            "{\"Proxy-Host\":\"proxy2.test\",\"Proxy-State\":\"0xabcd\"}"
+         "]"
+      "}";
+
+   CHECK( fdJsonAddAvps( json, msg1.getMsg(), jsonError ) == FDJSON_SUCCESS );
+   CHECK( g_jsonErrors.empty() );
+
+   fdJsonGetJSON( msg1.getMsg(), json1, jsonError );
+
+   CHECK( count( json1, "\"Origin-Host\":\"host1.test\"" ) == 1 );
+   CHECK( count( json1, "\"Host-IP-Address\":\"127.0.0.1\"" ) == 1 );
+   CHECK( count( json1, "\"Origin-State-Id\":7" ) == 1 );
+   CHECK( count( json1, "\"Proxy-Info\":{" ) == 2 );
+   CHECK( count( json1, "\"Proxy-State\":\"0x0102\"" ) == 1 );
+   CHECK( count( json1, "\"Proxy-State\":\"0xABCD\"" ) == 1 );
+
+   // the members written for a message can be added to another message
+   std::string inner = members( json1, "Capabilities-Exchange-Request" );
+   CHECK( !inner.empty() );
+   CHECK( fdJsonAddAvps( inner.c_str(), msg2.getMsg(), jsonError ) == FDJSON_SUCCESS );
+
+   fdJsonGetJSON( msg2.getMsg(), json2, jsonError );
+   CHECK( json1 == json2 );
+
+   const char *json3 = fdJsonGetJSON( msg2.getMsg(), jsonError );
+   CHECK( json3 && json1 == json3 );
+   free( (void*)json3 );
+
+   CHECK( g_jsonErrors.empty() );
+}
+
+static Void testJsonErrors()
+{
+   FDDictionaryEntryCommand cmd( "Capabilities-Exchange-Request" );
+   std::string json;
+
+   // the document must be an object
+   {
+      FDMessageRequest msg( &cmd );
+      g_jsonErrors.clear();
+      CHECK( fdJsonAddAvps( "[1,2]", msg.getMsg(), jsonError ) == FDJSON_JSON_PARSING_ERROR );
+      CHECK( fdJsonAddAvps( "\"Origin-Host\"", msg.getMsg(), jsonError ) == FDJSON_JSON_PARSING_ERROR );
+      CHECK( fdJsonAddAvps( "{\"Origin-Host\":", msg.getMsg(), jsonError ) == FDJSON_JSON_PARSING_ERROR );
+      CHECK( fdJsonAddAvps( NULL, msg.getMsg(), jsonError ) == FDJSON_JSON_PARSING_ERROR );
+      CHECK( g_jsonErrors.size() == 4 );
+   }
+
+   // an unknown AVP in an array of grouped values skips the whole array
+   {
+      FDMessageRequest msg( &cmd );
+      g_jsonErrors.clear();
+      CHECK( fdJsonAddAvps(
+         "{\"Origin-Host\":\"host1.test\","
+         "\"Unknown-Avp\":[{\"Proxy-Host\":\"proxy1.test\"},{\"Proxy-Host\":\"proxy2.test\"}],"
+         "\"Origin-Realm\":\"test\"}",
+         msg.getMsg(), jsonError ) == FDJSON_SUCCESS );
+      CHECK( g_jsonErrors.size() == 1 );
+
+      fdJsonGetJSON( msg.getMsg(), json, jsonError );
+      CHECK( count( json, "\"Origin-Host\":\"host1.test\"" ) == 1 );
+      CHECK( count( json, "Proxy-Host" ) == 0 );
+      CHECK( count( json, "\"Origin-Realm\":\"test\"" ) == 1 );
+   }
+
+   // an invalid element skips the remaining elements of the array
+   {
+      FDMessageRequest msg( &cmd );
+      g_jsonErrors.clear();
+      CHECK( fdJsonAddAvps(
+         "{\"Route-Record\":[\"r1.test\",true,\"r2.test\"],\"Origin-Realm\":\"test\"}",
+         msg.getMsg(), jsonError ) == FDJSON_SUCCESS );
+      CHECK( g_jsonErrors.size() == 1 );
+
+      fdJsonGetJSON( msg.getMsg(), json, jsonError );
+      CHECK( count( json, "\"Route-Record\":\"r1.test\"" ) == 1 );
+      CHECK( count( json, "r2.test" ) == 0 );
+      CHECK( count( json, "\"Origin-Realm\":\"test\"" ) == 1 );
+   }
+
+   // an unknown AVP inside a grouped element only skips that member
+   {
+      FDMessageRequest msg( &cmd );
+      g_jsonErrors.clear();
+      CHECK( fdJsonAddAvps(
+         "{\"Proxy-Info\":["
+            "{\"Proxy-Host\":\"proxy1.test\",\"Unknown-Avp\":{\"a\":[1,2]},\"Proxy-State\":\"0x01\"},"
+            "{\"Proxy-Host\":\"proxy2.test\",\"Proxy-State\":\"0x02\"}"
+         "],\"Origin-Realm\":\"test\"}",
+         msg.getMsg(), jsonError ) == FDJSON_SUCCESS );
+      CHECK( g_jsonErrors.size() == 1 );
+
+      fdJsonGetJSON( msg.getMsg(), json, jsonError );
+      CHECK( count( json, "\"Proxy-Info\":{" ) == 2 );
+      CHECK( count( json, "\"Proxy-State\":\"0x01\"" ) == 1 );
+      CHECK( count( json, "\"Proxy-State\":\"0x02\"" ) == 1 );
+      CHECK( count( json, "\"Origin-Realm\":\"test\"" ) == 1 );
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class TestDictionary
+{
+public:
+   TestDictionary()
+      : cer( "Capabilities-Exchange-Request" ),
+        origin_host( "Origin-Host" ),
+        origin_realm( "Origin-Realm" ),
+        origin_state_id( "Origin-State-Id" ),
+        result_code( "Result-Code" ),
+        proxy_info( "Proxy-Info" ),
+        proxy_host( "Proxy-Host" ),
+        proxy_state( "Proxy-State" )
+   {
+   }
+
+   FDDictionaryEntryCommand cer;
+   FDDictionaryEntryAVP origin_host;
+   FDDictionaryEntryAVP origin_realm;
+   FDDictionaryEntryAVP origin_state_id;
+   FDDictionaryEntryAVP result_code;
+   FDDictionaryEntryAVP proxy_info;
+   FDDictionaryEntryAVP proxy_host;
+   FDDictionaryEntryAVP proxy_state;
+};
+
+class TestProxyInfoExtractor : public FDExtractor
+{
+public:
+   TestProxyInfoExtractor( FDExtractor &parent, TestDictionary &dict )
+      : FDExtractor( parent, dict.proxy_info ),
+        proxy_host( *this, dict.proxy_host ),
+        proxy_state( *this, dict.proxy_state )
+   {
+      add( proxy_host );
+      add( proxy_state );
+   }
+
+   FDExtractorAvp proxy_host;
+   FDExtractorAvp proxy_state;
+};
+
+class TestCERExtractor : public FDExtractor
+{
+public:
+   TestCERExtractor( FDMessage &msg, TestDictionary &dict )
+      : FDExtractor( msg ),
+        origin_host( *this, dict.origin_host ),
+        origin_realm( *this, dict.origin_realm ),
+        proxy_info( *this, dict ),
+        result_code( *this, dict.result_code ),
+        origin_state_id( *this, dict.origin_state_id )
+   {
+      add( origin_host );
+      add( origin_realm );
+      add( proxy_info );
+      add( result_code );
+      add( origin_state_id );
+   }
+
+   FDExtractorAvp origin_host;
+   FDExtractorAvp origin_realm;
+   TestProxyInfoExtractor proxy_info;
+   FDExtractorAvp result_code;
+   FDExtractorAvp origin_state_id;
+};
+
+static Void testExtractor()
+{
+   TestDictionary dict;
+   FDMessageRequest msg1( &dict.cer );
+   FDMessageRequest msg2( &dict.cer );
+   std::string s;
+   uint32_t u32 = 0;
+
+   g_jsonErrors.clear();
+   CHECK( fdJsonAddAvps(
+      "{\"Origin-Host\":\"host1.test\",\"Origin-Realm\":\"test\","
+      "\"Proxy-Info\":{\"Proxy-Host\":\"proxy1.test\",\"Proxy-State\":\"0x01\"},"
+      "\"Origin-State-Id\":7}",
+      msg1.getMsg(), jsonError ) == FDJSON_SUCCESS );
+   CHECK( fdJsonAddAvps(
+      "{\"Origin-Host\":\"host2.test\",\"Origin-Realm\":\"test\",\"Origin-State-Id\":8}",
+      msg2.getMsg(), jsonError ) == FDJSON_SUCCESS );
+
+   TestCERExtractor cer( msg1, dict );
+
+   // the message is only browsed as far as the requested AVP
+   CHECK( cer.origin_host.get( s ) && s == "host1.test" );
+   CHECK( !cer.getResolved() );
+   CHECK( !cer.origin_state_id.getResolved() );
+
+   CHECK( cer.proxy_info.proxy_host.get( s ) && s == "proxy1.test" );
+   CHECK( !cer.getResolved() );
+
+   // an absent AVP browses to the end of the message
+   CHECK( !cer.result_code.exists() );
+   CHECK( cer.getResolved() );
+   CHECK( cer.origin_state_id.getResolved() );
+   CHECK( cer.origin_state_id.get( u32 ) && u32 == 7 );
+
+   // the extractor can be reused for another message
+   cer.reset( msg2 );
+   CHECK( !cer.getResolved() );
+   CHECK( cer.origin_host.get( s ) && s == "host2.test" );
+   CHECK( !cer.proxy_info.exists() );
+   CHECK( !cer.proxy_info.proxy_host.exists() );
+   CHECK( cer.origin_state_id.get( u32 ) && u32 == 8 );
+
+   CHECK( g_jsonErrors.empty() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+Void usage()
+{
+   const char *msg =
+       "USAGE:  epcunittest [--help] [--file optionfile]\n";
+
+   cout << msg;
+}
+
+int run( EGetOpt &opt )
+{
+   runTest( "DNS response codes", testDnsResponseCodes );
+   runTest( "DNS cache eviction", testDnsCacheEviction );
+
+   int ret = fd_core_initialize();
+   if ( ret != 0 )
+   {
+      printf( "fd_core_initialize() failed ret=%d\n", ret );
+      return 1;
+   }
+
+   runTest( "JSON AVP round trip", testJsonRoundTrip );
+   runTest( "JSON AVP errors", testJsonErrors );
+   runTest( "FDExtractor resolution", testExtractor );
+
+   printf( "%d checks, %d failures\n", g_checks, g_failures );
+
+   return g_failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+   EGetOpt::Option options[] = {
+       {"-h", "--help", EGetOpt::no_argument, EGetOpt::dtNone},
+       {"-f", "--file", EGetOpt::required_argument, EGetOpt::dtString},
+       {"", "", EGetOpt::no_argument, EGetOpt::dtNone},
+   };
+
+   EGetOpt opt;
+   EString optFile;
+   int ret = 1;
+
+   try
+   {
+      opt.loadCmdLine(argc, argv, options);
+      if (opt.getCmdLine("-h,--help", false))
+      {
+         usage();
+         exit(0);
+      }
+
+      optFile.format("%s.json", argv[0]);
+      opt.loadFile(optFile.c_str());
+
+      optFile = opt.getCmdLine("-f,--file", "");
+      if (!optFile.empty())
+         opt.loadFile(optFile.c_str());
+   }
+   catch(const std::exception& e)
+   {
+      std::cerr << e.what() << '\n';
+      exit(1);
+   }
+
+   try
+   {
+      EpcTools::Initialize(opt);
+
+      ret = run(opt);
+
+      EpcTools::UnInitialize();
+   }
+   catch (EError &e)
+   {
+      cout << (cpStr)e << endl;
+   }
+
+   return ret;
+}
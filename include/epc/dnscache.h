@@ -20,6 +20,7 @@
 
 #include <list>
 #include <map>
+#include <vector>
 #include <ares.h>
 
 #include "dnsquery.h"
@@ -124,6 +125,9 @@ namespace DNS
    #define SAVED_QUERY_TYPE "type"
    #define SAVED_QUERY_DOMAIN "domain"
 
+   const uint32_t SNAPSHOT_MAGIC = 0x534e4445; // "EDNS"
+   const uint16_t SNAPSHOT_VERSION = 1;
+
    const uint16_t CR_SAVEQUERIES = EM_USER + 1;
    const uint16_t CR_FORCEREFRESH = EM_USER + 2;
 
@@ -145,10 +149,13 @@ namespace DNS
 
       Void loadQueries(const char *qfn);
       Void loadQueries(const std::string &qfn) { loadQueries(qfn.c_str()); }
-      Void initSaveQueries(const char *qfn, long qsf);
+      Void initSaveQueries(const char *qfn, long qsf, bool snapshot);
       Void saveQueries() { sendMessage(CR_SAVEQUERIES); }
       Void forceRefresh() { sendMessage(CR_FORCEREFRESH); }
 
+      // queries waiting to be submitted and outstanding refresh queries
+      long getBacklog() { return m_backlog + (m_maxconcur - m_sem.currCount()); }
+
       DECLARE_MESSAGE_MAP()
 
    private:
@@ -157,22 +164,163 @@ namespace DNS
       Void _submitQueries( std::list<QueryCacheKey> &keys );
       Void _refreshQueries();
       Void _saveQueries();
+      Void _saveSnapshot();
+      Void _loadSnapshot(const char *qfn, const unsigned char *data, size_t len);
       Void _forceRefresh();
 
       Cache &m_cache;
       ESemaphorePrivate m_sem;
+      unsigned int m_maxconcur;
+      long m_backlog;
       int m_percent;
       EThreadBase::Timer m_timer;
       long m_interval;
       bool m_running;
       EString m_qfn;
       long m_qsf;
+      bool m_snapshot;
       EThreadBase::Timer m_qst;
    };
 
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   // cache and resolver counters, Cache::getStats() returns a copy
+   class CacheStats
+   {
+      friend Cache;
+      friend QueryProcessor;
+      friend QueryProcessorThread;
+   public:
+      // the upper bound of each latency bucket in milliseconds, the last
+      // bucket counts everything above the previous bound
+      static const int LATENCY_BUCKETS = 12;
+
+      CacheStats() { memset( this, 0, sizeof(*this) ); }
+
+      static long getLatencyBound( int bucket )
+      {
+         static const long bounds[LATENCY_BUCKETS] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000, LONG_MAX };
+         return bounds[bucket];
+      }
+
+      long getHits() const { return m_hits; }
+      long getMisses() const { return m_misses; }
+      long getStaleHits() const { return m_stalehits; }
+      long getZoneHits() const { return m_zonehits; }
+      long getQueries() const { return m_queries; }
+      long getResponses() const { return m_responses; }
+      long getTimeouts() const { return m_timeouts; }
+      long getErrors() const { return m_errors; }
+      long getParseFailures() const { return m_parsefailures; }
+      long getEvictions() const { return m_evictions; }
+
+      long getInFlight() const { return m_inflight; }
+      long getRefreshBacklog() const { return m_refreshbacklog; }
+      long getEntries() const { return m_entries; }
+      long getBytes() const { return m_bytes; }
+
+      long getLatency( int bucket ) const { return m_latency[bucket]; }
+      // the average response time in microseconds
+      long getAverageLatency() const { return m_responses ? m_latencyus / m_responses : 0; }
+
+   private:
+      Void recordLatency( epctime_t us )
+      {
+         int bucket = 0;
+         while ( bucket < LATENCY_BUCKETS - 1 && us > getLatencyBound( bucket ) * 1000 )
+            bucket++;
+         atomic_inc( m_latency[bucket] );
+         atomic_add( m_latencyus, (long)us );
+         atomic_inc( m_responses );
+      }
+
+      long m_hits;
+      long m_misses;
+      long m_stalehits;
+      long m_zonehits;
+      long m_queries;
+      long m_responses;
+      long m_timeouts;
+      long m_errors;
+      long m_parsefailures;
+      long m_evictions;
+      long m_inflight;
+      long m_refreshbacklog;
+      long m_entries;
+      long m_bytes;
+      long m_latency[LATENCY_BUCKETS];
+      long m_latencyus;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   typedef std::vector<std::pair<ns_type,std::string> > PrefetchList;
+
+   // the outcome of each prefetch item and the totals for a Cache::prefetch
+   class PrefetchStats
+   {
+      friend Cache;
+   public:
+      enum Outcome
+      {
+         poPending,
+         poCacheHit,
+         poResolved,
+         poNegative,
+         poError
+      };
+
+      PrefetchStats() : m_cachehits( 0 ), m_resolved( 0 ), m_negative( 0 ), m_errors( 0 ) {}
+
+      const std::vector<Outcome> &getOutcomes() const { return m_outcomes; }
+      const std::vector<EString> &getErrors() const { return m_errmsgs; }
+
+      // a cached negative answer is counted by getNegative(), not getCacheHits()
+      size_t getRequested() const { return m_outcomes.size(); }
+      size_t getCacheHits() const { return m_cachehits; }
+      size_t getResolved() const { return m_resolved; }
+      size_t getNegative() const { return m_negative; }
+      size_t getErrorCount() const { return m_errors; }
+
+   private:
+      std::vector<Outcome> m_outcomes;
+      std::vector<EString> m_errmsgs;
+      size_t m_cachehits;
+      size_t m_resolved;
+      size_t m_negative;
+      size_t m_errors;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   // the A and AAAA answers of Cache::resolveAddresses, a family that did not
+   // answer before resolveAddresses returned is an empty QueryPtr
+   class AddressResult
+   {
+      friend Cache;
+   public:
+      AddressResult() : m_first( AF_UNSPEC ) {}
+
+      QueryPtr &getIPv4() { return m_ipv4; }
+      QueryPtr &getIPv6() { return m_ipv6; }
+
+      // the family of the first answer containing addresses
+      int getFirstFamily() const { return m_first; }
+
+   private:
+      QueryPtr m_ipv4;
+      QueryPtr m_ipv6;
+      int m_first;
+   };
+
+   typedef std::vector<AddressResult> AddressResultList;
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
    class Cache
    {
       friend QueryProcessor;
@@ -196,6 +344,26 @@ namespace DNS
       static long getRefeshInterval() { return m_interval; }
       static long setRefreshInterval(long interval) { return m_interval = interval; }
 
+      static uint32_t getNegativeTTL() { return m_negttl; }
+      static uint32_t setNegativeTTL(uint32_t negttl) { return m_negttl = negttl; }
+
+      // cache budget, 0 is unlimited
+      static size_t getMaxEntries() { return m_maxentries; }
+      static size_t setMaxEntries(size_t maxentries) { return m_maxentries = maxentries; }
+
+      static size_t getMaxBytes() { return m_maxbytes; }
+      static size_t setMaxBytes(size_t maxbytes) { return m_maxbytes = maxbytes; }
+
+      // entries with fewer hits during the previous refresh interval are not
+      // refreshed, 0 refreshes all entries
+      static long getRefreshMinHits() { return m_refreshminhits; }
+      static long setRefreshMinHits(long minhits) { return m_refreshminhits = minhits; }
+
+      // milliseconds resolveAddresses waits for the preferred family after
+      // the other family has answered
+      static int getAddressGrace() { return m_addressgrace; }
+      static int setAddressGrace(int ms) { return m_addressgrace = ms; }
+
       Void addNamedServer(const char *address, int udp_port=53, int tcp_port=53);
       Void removeNamedServer(const char *address);
       Void applyNamedServers();
@@ -203,24 +371,59 @@ namespace DNS
       QueryPtr query( ns_type rtype, const std::string &domain, bool &cacheHit, bool ignorecache=false );
       Void query( ns_type rtype, const std::string &domain, CachedDNSQueryCallback cb, const Void *data=NULL, bool ignorecache=false );
 
+      // resolves each item with at most maxconcur outstanding queries (0 uses
+      // the refresh concurrency) and waits for all of them to complete
+      Void prefetch( const PrefetchList &items, PrefetchStats &stats, unsigned int maxconcur=0, bool ignorecache=false );
+
+      // issues the A and AAAA queries for host in parallel and returns as soon
+      // as the preferred family (AF_INET or AF_INET6) answers with addresses,
+      // or at most the address grace period after the other family does,
+      // AF_UNSPEC waits for both families
+      Void resolveAddresses( const std::string &host, AddressResult &result, int preferred=AF_INET6 );
+
+      // issues the queries of every host before waiting once for all of them,
+      // results[i] holds the answers for hosts[i]
+      Void resolveAddresses( const std::vector<std::string> &hosts, AddressResultList &results, int preferred=AF_INET6 );
+
       Void loadQueries(const char *qfn);
       Void loadQueries(const std::string &qfn) { loadQueries(qfn.c_str()); }
-      Void initSaveQueries(const char *qfn, long qsf);
+      Void initSaveQueries(const char *qfn, long qsf, bool snapshot=false);
       Void saveQueries();
       Void forceRefresh();
 
+      // loads the NAPTR, SRV, A and AAAA records of a zone file as an
+      // authoritative overlay that is consulted before the named servers,
+      // replacing any previously loaded zone
+      Void loadZone(const char *zfn);
+      Void loadZone(const std::string &zfn) { loadZone(zfn.c_str()); }
+      Void clearZone();
+
       namedserverid_t getNamedServerId() { return m_nsid; }
 
       long resetNewQueryCount() { return atomic_swap(m_newquerycnt, 0); }
 
+      CacheStats getStats();
+
+      size_t getEntryCount() { ERDLock l( m_cacherwlock ); return m_cache.size(); }
+      size_t getMemoryUsage() { ERDLock l( m_cacherwlock ); return m_bytes; }
+
    protected:
       Void updateCache( QueryPtr q );
-      QueryPtr lookupQuery( ns_type rtype, const std::string &domain );
-      QueryPtr lookupQuery( QueryCacheKey &qck );
+      QueryPtr lookupQuery( ns_type rtype, const std::string &domain, bool ignorecache = false );
+      QueryPtr lookupQuery( QueryCacheKey &qck, bool ignorecache = false );
+      QueryPtr lookupZone( ns_type rtype, const std::string &domain );
+      Void countLookup( QueryPtr &q, bool cacheHit, bool ignorecache );
 
       Void identifyExpired( std::list<QueryCacheKey> &keys, int percent );
       Void getCacheKeys( std::list<QueryCacheKey> &keys );
+      Void getCacheQueries( std::list<QueryPtr> &queries );
+
+      static Void prefetch_callback( QueryPtr q, bool cacheHit, const Void *data );
+      Void resolveAddresses( const std::string *hosts, AddressResult *results, size_t count, int preferred );
+      static Void address_callback( QueryPtr q, bool cacheHit, const Void *data );
 
+      bool overBudget();
+      Void evictEntries( QueryPtr &keep );
 
    private:
 
@@ -228,6 +431,11 @@ namespace DNS
       static unsigned int m_concur;
       static int m_percent;
       static long m_interval;
+      static uint32_t m_negttl;
+      static size_t m_maxentries;
+      static size_t m_maxbytes;
+      static long m_refreshminhits;
+      static int m_addressgrace;
 
       QueryProcessor m_qp;
       CacheRefresher m_refresher;
@@ -235,6 +443,11 @@ namespace DNS
       namedserverid_t m_nsid;
       ERWLock m_cacherwlock;
       long m_newquerycnt;
+      size_t m_bytes;
+      QueryCacheKey m_hand;
+      QueryCache m_zone;
+      ERWLock m_zonerwlock;
+      CacheStats m_stats;
    };
 }
 
@@ -19,7 +19,9 @@
 #define __DNSPARSER_H
 
 #include "estring.h"
+#include "eerror.h"
 #include "dnsquery.h"
+#include "dnscache.h"
 
 #define LABEL_LENGTH(a) ((int)(((a[0] & 0xc0) == 0) ? a[0] & 0x3f : -1))
 #define LABEL_OFFSET(a) ((int)(((a[0] & 0xc0) == 0xc0) ? ((a[0] & 0x3f) << 8) + a[1] : -1))
@@ -28,6 +30,10 @@
 
 namespace DNS
 {
+   // a response whose RCODE is neither NOERROR nor NXDOMAIN, the packet
+   // itself is well formed
+   DECLARE_ERROR_ADVANCED2(ResolverError);
+
    class MessageBuffer
    {
    public:
@@ -71,7 +77,8 @@ namespace DNS
    class Parser
    {
    public:
-      Parser( QueryPtr &q, unsigned char *rdata, int rlen );
+      // negttl is the TTL of a negative answer that has no SOA record
+      Parser( QueryPtr &q, unsigned char *rdata, int rlen, uint32_t negttl = Cache::getNegativeTTL() );
 
       void parse();
 
@@ -84,31 +91,40 @@ namespace DNS
       ResourceRecord* parseA();
       ResourceRecord* parseNS();
       ResourceRecord* parseCNAME();
+      ResourceRecord* parseSOA();
       ResourceRecord* parseAAAA();
       ResourceRecord* parseSRV();
       ResourceRecord* parseNAPTR();
 
       void parseHeader();
-      void parseDomainName( EString &dn );
-      void parseCharacterString( EString &cs );
+      void parseNegative();
+      void parseDomainName( Name &dn );
+      void parseCharacterString( Name &cs );
 
       QueryPtr m_query;
       MessageBuffer m_data;
 
+      uint32_t m_negttl;
+      int m_rcode;
       int m_qdcount;
       int m_ancount;
       int m_nscount;
       int m_arcount;
 
-      EString m_name;
+      Name m_name;
       ns_type m_type;
       ns_class m_class;
       int m_ttl;
       int m_rdlength;
       unsigned char *m_rdata;
 
+      // arena block size relative to the size of the response
+      static const int ARENA_RATIO          = 4;
+      static const int ARENA_MIN_BLOCK      = 1024;
+
       // RFC 1035
       static const int HDR_FIXED_SIZE       = 12;
+      static const int HDR_RCODE_OFS        = 3;
       static const int HDR_QDCOUNT_OFS      = 4;
       static const int HDR_ANCOUNT_OFS      = 6;
       static const int HDR_NSCOUNT_OFS      = 8;
@@ -131,6 +147,16 @@ namespace DNS
       static const int CNAME_FIXED_SIZE     = 0;
       static const int CNAME_TARGET_OFS     = 0;
 
+      static const int SOA_FIXED_SIZE       = 20;
+      static const int SOA_SERIAL_OFS       = 0;
+      static const int SOA_REFRESH_OFS      = 4;
+      static const int SOA_RETRY_OFS        = 8;
+      static const int SOA_EXPIRE_OFS       = 12;
+      static const int SOA_MINIMUM_OFS      = 16;
+
+      // RFC 2308
+      static const int NEGATIVE_TTL_MAX     = 10800;
+
       // RFC 3596
       static const int AAAA_FIXED_SIZE      = 0;
       static const int AAAA_ADDRESS_OFS     = 0;
@@ -18,14 +18,19 @@
 #ifndef __DNSQUERY_H
 #define __DNSQUERY_H
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <map>
 #include <list>
+#include <unordered_map>
+#include <vector>
 
 #include "estring.h"
+#include "eatomic.h"
 #include "esynch.h"
+#include "etimer.h"
 #include "dnsrecord.h"
 
 namespace DNS
@@ -39,6 +44,31 @@ namespace DNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   // base class for data derived from a query (i.e. parsed NAPTR services)
+   // that is attached to the query and released with it
+   class QueryExtension
+   {
+   public:
+      virtual ~QueryExtension() {}
+   };
+
+   typedef std::shared_ptr<QueryExtension> QueryExtensionPtr;
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   // additional records keyed by the record name in the order they were
+   // added, the keys refer to the names stored in the query arena
+   typedef std::vector<ResourceRecord*,ArenaAllocator<ResourceRecord*> > ResourceRecordVector;
+   typedef std::unordered_map<Name,ResourceRecordVector,NameHash,std::equal_to<Name>,
+      ArenaAllocator<std::pair<const Name,ResourceRecordVector> > > ResourceRecordIndex;
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
    typedef std::shared_ptr<Query> QueryPtr;
    typedef std::map<QueryCacheKey, QueryPtr> QueryCache;
    extern "C" typedef void(*CachedDNSQueryCallback)(QueryPtr q, bool cacheHit, const void *data);
@@ -101,9 +131,18 @@ namespace DNS
            m_data( NULL ),
            m_type( rtype ),
            m_domain( domain ),
+           m_question( m_arena ),
+           m_answer( m_arena ),
+           m_authority( m_arena ),
+           m_additional( m_arena ),
+           m_index( 0, NameHash(), std::equal_to<Name>(),
+              ArenaAllocator<std::pair<const Name,ResourceRecordVector> >(m_arena) ),
            m_ttl( UINT32_MAX ),
            m_expires( LONG_MAX ),
-           m_ignorecache( false )
+           m_ignorecache( false ),
+           m_negative( false ),
+           m_hits( 0 ),
+           m_err( false )
       {
       }
 
@@ -168,6 +207,12 @@ namespace DNS
                }
             }
             m_additional.push_back( a );
+
+            ResourceRecordIndex::iterator it = m_index.find( a->getName() );
+            if ( it == m_index.end() )
+               it = m_index.insert( std::make_pair( a->getName(),
+                  ResourceRecordVector( ArenaAllocator<ResourceRecord*>(m_arena) ) ) ).first;
+            it->second.push_back( a );
          }
       }
 
@@ -178,15 +223,36 @@ namespace DNS
       time_t getExpires() { return m_expires; }
       bool isExpired() { return time(NULL) >= m_expires; }
       bool ignoreCache() { return m_ignorecache; }
+      bool isNegative() { return m_negative; }
 
-      const std::list<Question*> &getQuestions() { return m_question; }
+      void setNegative( uint32_t ttl )
+      {
+         m_negative = true;
+         m_ttl = ttl;
+         m_expires = time(NULL) + ttl;
+      }
+
+      // Question and ResourceRecord objects added to the query must be
+      // allocated from the query arena, i.e. new (q->getArena()) RRecordA(...)
+      Arena &getArena() { return m_arena; }
+
+      const QuestionList &getQuestions() { return m_question; }
       const ResourceRecordList &getAnswers() { return m_answer; }
       const ResourceRecordList &getAuthorities() { return m_authority; }
       const ResourceRecordList &getAdditional() { return m_additional; }
 
+      // the additional records with the specified name in wire order
+      const ResourceRecordVector &findRecords( const std::string &name ) { return findRecords( Name( name ) ); }
+      const ResourceRecordVector &findRecords( const Name &name )
+      {
+         static const ResourceRecordVector none;
+         ResourceRecordIndex::const_iterator it = m_index.find( name );
+         return it == m_index.end() ? none : it->second;
+      }
+
       void dump()
       {
-         std::cout << "QUERY type=" << getType() << " domain=" << getDomain() << std::endl;
+         std::cout << "QUERY type=" << getType() << " domain=" << getDomain() << (m_negative?" negative":"") << std::endl;
          std::cout << "QUESTION:" << std::endl;
          for (QuestionList::const_iterator it = getQuestions().begin();
               it != getQuestions().end();
@@ -220,6 +286,9 @@ namespace DNS
          }
       }
 
+      // started when the query is sent to the named servers
+      ETimer &getTimer() { return m_timer; }
+
       EEvent *getCompletionEvent() { return m_event; }
       EEvent *setCompletionEvent(EEvent *event) { return m_event = event; }
 
@@ -236,6 +305,26 @@ namespace DNS
       bool getIgnoreCache() { return m_ignorecache; }
       bool setIgnoreCache(bool ignorecache) { return m_ignorecache = ignorecache; }
 
+      // the number of cache lookups that found this query
+      long getHits() { return m_hits; }
+      long incHits() { return atomic_inc_fetch( m_hits ); }
+      long resetHits() { return atomic_swap( m_hits, 0 ); }
+      long decayHits() { long hits = m_hits; atomic_cas( m_hits, hits, hits / 2 ); return hits / 2; }
+
+      // approximate memory used by the query and its records
+      size_t getMemoryUsage() { return sizeof(Query) + m_domain.capacity() + m_arena.getAllocated(); }
+
+      QueryExtensionPtr getExtension() { return std::atomic_load( &m_ext ); }
+
+      // the first extension set wins, the extension in place is returned
+      QueryExtensionPtr setExtension(QueryExtensionPtr ext)
+      {
+         QueryExtensionPtr expected;
+         if ( std::atomic_compare_exchange_strong( &m_ext, &expected, ext ) )
+            return ext;
+         return expected;
+      }
+
    protected:
       QueryProcessor *getQueryProcessor() { return m_qp; }
       QueryProcessor *setQueryProcessor(QueryProcessor *qp) { return m_qp = qp; }
@@ -251,16 +340,23 @@ namespace DNS
 
       ns_type m_type;
       EString m_domain;
+      Arena m_arena;
       QuestionList m_question;
       ResourceRecordList m_answer;
       ResourceRecordList m_authority;
       ResourceRecordList m_additional;
+      ResourceRecordIndex m_index;
       uint32_t m_ttl;
       time_t m_expires;
       bool m_ignorecache;
+      bool m_negative;
+      long m_hits;
+      ETimer m_timer;
 
       bool m_err;
       EString m_errmsg;
+
+      QueryExtensionPtr m_ext;
    };
 }
 
@@ -18,8 +18,12 @@
 #ifndef __DNSRECORD_H
 #define __DNSRECORD_H
 
+#include <algorithm>
 #include <list>
+#include <new>
+#include <utility>
 
+#include <stddef.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <arpa/inet.h>
@@ -33,17 +37,208 @@ namespace DNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   class Arena
+   {
+   public:
+      Arena( size_t blocksize = 4096 )
+         : m_head( NULL ),
+           m_blocksize( blocksize ),
+           m_allocated( 0 )
+      {
+      }
+
+      ~Arena()
+      {
+         while ( m_head )
+         {
+            Block *b = m_head;
+            m_head = m_head->next;
+            ::operator delete( b );
+         }
+      }
+
+      size_t getBlockSize() { return m_blocksize; }
+      size_t setBlockSize( size_t blocksize ) { return m_blocksize = blocksize; }
+      size_t getAllocated() const { return m_allocated; }
+
+      void *allocate( size_t size )
+      {
+         return allocate( size, alignof(max_align_t) );
+      }
+
+      // copies a string, followed by a terminating null, into the arena
+      char *copy( const char *str, size_t len )
+      {
+         char *p = (char*)allocate( len + 1, 1 );
+         memcpy( p, str, len );
+         p[len] = '\0';
+         return p;
+      }
+
+   private:
+      void *allocate( size_t size, size_t alignment )
+      {
+         size_t ofs = m_head ? (m_head->used + (alignment - 1)) & ~(alignment - 1) : 0;
+
+         if ( !m_head || ofs + size > m_head->size )
+         {
+            // allocate a new block, anything left in the current block is abandoned
+            size_t bs = std::max( align(size), m_blocksize );
+            Block *b = (Block*)::operator new( align(sizeof(Block)) + bs );
+            b->next = m_head;
+            b->size = bs;
+            b->used = 0;
+            m_head = b;
+            m_allocated += align(sizeof(Block)) + bs;
+            ofs = 0;
+         }
+
+         void *p = (char*)m_head + align(sizeof(Block)) + ofs;
+         m_head->used = ofs + size;
+         return p;
+      }
+
+      Arena( const Arena & );
+      Arena &operator=( const Arena & );
+
+      struct Block
+      {
+         Block *next;
+         size_t size;
+         size_t used;
+      };
+
+      static size_t align( size_t size )
+      {
+         return (size + (alignof(max_align_t) - 1)) & ~(alignof(max_align_t) - 1);
+      }
+
+      Block *m_head;
+      size_t m_blocksize;
+      size_t m_allocated;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   template<class T>
+   class ArenaAllocator
+   {
+   public:
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template<class U> struct rebind { typedef ArenaAllocator<U> other; };
+
+      ArenaAllocator() : m_arena( NULL ) {}
+      ArenaAllocator( Arena &arena ) : m_arena( &arena ) {}
+      template<class U> ArenaAllocator( const ArenaAllocator<U> &other ) : m_arena( other.getArena() ) {}
+
+      Arena *getArena() const { return m_arena; }
+
+      T *allocate( size_t n )
+      {
+         return (T*)( m_arena ? m_arena->allocate( n * sizeof(T) ) : ::operator new( n * sizeof(T) ) );
+      }
+
+      void deallocate( T *p, size_t n )
+      {
+         // memory allocated from an arena is released when the arena is destroyed
+         if ( !m_arena )
+            ::operator delete( p );
+      }
+
+   private:
+      Arena *m_arena;
+   };
+
+   template<class T, class U>
+   bool operator==( const ArenaAllocator<T> &l, const ArenaAllocator<U> &r ) { return l.getArena() == r.getArena(); }
+   template<class T, class U>
+   bool operator!=( const ArenaAllocator<T> &l, const ArenaAllocator<U> &r ) { return l.getArena() != r.getArena(); }
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   // a domain name or character string held by a record, the characters are
+   // stored in the query arena (or in storage that outlives the Name) so
+   // that parsing a response does not allocate each string separately
+   class Name
+   {
+   public:
+      Name() : m_str( "" ), m_len( 0 ) {}
+
+      // refers to str without copying it
+      Name( const char *str, size_t len ) : m_str( str ), m_len( len ) {}
+      explicit Name( const std::string &str ) : m_str( str.c_str() ), m_len( str.size() ) {}
+
+      // copies str into the arena
+      Name( Arena &arena, const char *str, size_t len ) : m_str( arena.copy( str, len ) ), m_len( len ) {}
+      Name( Arena &arena, const std::string &str ) : m_str( arena.copy( str.data(), str.size() ) ), m_len( str.size() ) {}
+
+      const char *c_str() const { return m_str; }
+      const char *data() const { return m_str; }
+      size_t size() const { return m_len; }
+      size_t length() const { return m_len; }
+      bool empty() const { return m_len == 0; }
+
+      std::string str() const { return std::string( m_str, m_len ); }
+      // the record accessors returned EString before names were kept in
+      // the arena, the conversion keeps EString (and std::string) callers
+      operator EString() const { return EString( str() ); }
+
+      bool operator==( const Name &r ) const { return m_len == r.m_len && memcmp( m_str, r.m_str, m_len ) == 0; }
+      bool operator!=( const Name &r ) const { return !operator==( r ); }
+      bool operator==( const std::string &r ) const { return m_len == r.size() && memcmp( m_str, r.data(), m_len ) == 0; }
+      bool operator!=( const std::string &r ) const { return !operator==( r ); }
+      bool operator==( const char *r ) const { return strncmp( m_str, r, m_len ) == 0 && r[m_len] == '\0'; }
+      bool operator!=( const char *r ) const { return !operator==( r ); }
+
+   private:
+      const char *m_str;
+      size_t m_len;
+   };
+
+   inline bool operator==( const std::string &l, const Name &r ) { return r == l; }
+   inline bool operator!=( const std::string &l, const Name &r ) { return r != l; }
+   inline std::ostream &operator<<( std::ostream &os, const Name &n ) { return os.write( n.data(), n.size() ); }
+
+   struct NameHash
+   {
+      // FNV-1a
+      size_t operator()( const Name &n ) const
+      {
+         size_t h = 14695981039346656037ULL;
+         for ( size_t i = 0; i < n.size(); i++ )
+            h = ( h ^ (unsigned char)n.data()[i] ) * 1099511628211ULL;
+         return h;
+      }
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
    class Question
    {
    public:
-      Question( const std::string& qname, ns_type qtype, ns_class qclass )
+      Question( const Name &qname, ns_type qtype, ns_class qclass )
          : m_qname( qname ),
            m_qtype( qtype ),
            m_qclass( qclass )
       {
       }
 
-      EString &getQName() { return m_qname; }
+      static void *operator new( size_t size ) { return ::operator new( size ); }
+      static void *operator new( size_t size, Arena &arena ) { return arena.allocate( size ); }
+      static void operator delete( void *p ) { ::operator delete( p ); }
+      static void operator delete( void *p, Arena &arena ) {}
+
+      const Name &getQName() { return m_qname; }
       ns_type getQType() { return m_qtype; }
       ns_class getQClass() { return m_qclass; }
 
@@ -59,7 +254,7 @@ namespace DNS
    private:
       Question() {}
 
-      EString m_qname;
+      Name m_qname;
       ns_type m_qtype;
       ns_class m_qclass;
    };
@@ -67,17 +262,27 @@ namespace DNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
-   class QuestionList : public std::list<Question*>
+   // when constructed with an arena, the list nodes and the Question objects
+   // must all be allocated from that arena
+   class QuestionList : public std::list<Question*,ArenaAllocator<Question*> >
    {
    public:
       QuestionList() {}
+      QuestionList( Arena &arena )
+         : std::list<Question*,ArenaAllocator<Question*> >( ArenaAllocator<Question*>(arena) )
+      {
+      }
       ~QuestionList()
       {
+         bool arena = get_allocator().getArena() != NULL;
          while ( !empty() )
          {
             Question *q = *begin();
             erase( begin() );
-            delete q;
+            if ( arena )
+               q->~Question();
+            else
+               delete q;
          }
       }
    };
@@ -88,7 +293,7 @@ namespace DNS
    class ResourceRecord
    {
    public:
-      ResourceRecord( const std::string &name,
+      ResourceRecord( const Name &name,
                       ns_type rtype,
                       ns_class rclass,
                       int32_t ttl )
@@ -102,7 +307,12 @@ namespace DNS
 
       virtual ~ResourceRecord() {}
 
-      const EString &getName() { return m_name; }
+      static void *operator new( size_t size ) { return ::operator new( size ); }
+      static void *operator new( size_t size, Arena &arena ) { return arena.allocate( size ); }
+      static void operator delete( void *p ) { ::operator delete( p ); }
+      static void operator delete( void *p, Arena &arena ) {}
+
+      const Name &getName() { return m_name; }
       ns_type getType() { return m_type; }
       ns_class getClass() { return m_class; }
       uint32_t getTTL() { return m_ttl; }
@@ -122,7 +332,7 @@ namespace DNS
       }
    
    private:
-      EString m_name;
+      Name m_name;
       ns_type m_type;
       ns_class m_class;
       int32_t m_ttl;
@@ -132,17 +342,27 @@ namespace DNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
-   class ResourceRecordList : public std::list<ResourceRecord*>
+   // when constructed with an arena, the list nodes and the ResourceRecord
+   // objects must all be allocated from that arena
+   class ResourceRecordList : public std::list<ResourceRecord*,ArenaAllocator<ResourceRecord*> >
    {
    public:
       ResourceRecordList() {}
+      ResourceRecordList( Arena &arena )
+         : std::list<ResourceRecord*,ArenaAllocator<ResourceRecord*> >( ArenaAllocator<ResourceRecord*>(arena) )
+      {
+      }
       ~ResourceRecordList()
       {
+         bool arena = get_allocator().getArena() != NULL;
          while ( !empty() )
          {
             ResourceRecord *rr = *begin();
             erase( begin() );
-            delete rr;
+            if ( arena )
+               rr->~ResourceRecord();
+            else
+               delete rr;
          }
       }
    };
@@ -153,10 +373,10 @@ namespace DNS
    class RRecordA : public ResourceRecord
    {
    public:
-      RRecordA( const std::string &name,
+      RRecordA( const Name &name,
                 int32_t ttl,
                 const struct in_addr &address )
-         : ResourceRecord(name, ns_t_a, ns_c_in, ttl)
+         : ResourceRecord( name, ns_t_a, ns_c_in, ttl)
       {
          memcpy( &m_address, &address, sizeof(m_address) );
       }
@@ -192,15 +412,15 @@ namespace DNS
    class RRecordNS : public ResourceRecord
    {
    public:
-      RRecordNS( const std::string &name,
+      RRecordNS( const Name &name,
                     int32_t ttl,
-                    const std::string &ns )
-         : ResourceRecord( name, ns_t_cname, ns_c_in, ttl ),
+                    const Name &ns )
+         : ResourceRecord( name, ns_t_ns, ns_c_in, ttl ),
            m_namedserver( ns )
       {
       }
 
-      const EString &getNamedServer() { return m_namedserver; }
+      const Name &getNamedServer() { return m_namedserver; }
 
       virtual void dump()
       {
@@ -215,7 +435,69 @@ namespace DNS
       }
    
    private:
-      EString m_namedserver;
+      Name m_namedserver;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   class RRecordSOA : public ResourceRecord
+   {
+   public:
+      RRecordSOA( const Name &name,
+                  int32_t ttl,
+                  const Name &mname,
+                  const Name &rname,
+                  uint32_t serial,
+                  uint32_t refresh,
+                  uint32_t retry,
+                  uint32_t expire,
+                  uint32_t minimum )
+         : ResourceRecord( name, ns_t_soa, ns_c_in, ttl ),
+           m_mname( mname ),
+           m_rname( rname ),
+           m_serial( serial ),
+           m_refresh( refresh ),
+           m_retry( retry ),
+           m_expire( expire ),
+           m_minimum( minimum )
+      {
+      }
+
+      const Name &getMName() { return m_mname; }
+      const Name &getRName() { return m_rname; }
+      uint32_t getSerial() { return m_serial; }
+      uint32_t getRefresh() { return m_refresh; }
+      uint32_t getRetry() { return m_retry; }
+      uint32_t getExpire() { return m_expire; }
+      uint32_t getMinimum() { return m_minimum; }
+
+      virtual void dump()
+      {
+         std::cout << "RRecordSOA:"
+            << " type=" << getType()
+            << " class=" << getClass()
+            << " ttl=" << getTTL()
+            << " expires=" << getExpires()
+            << " mname=" << getMName()
+            << " rname=" << getRName()
+            << " serial=" << getSerial()
+            << " refresh=" << getRefresh()
+            << " retry=" << getRetry()
+            << " expire=" << getExpire()
+            << " minimum=" << getMinimum()
+            << " name=" << getName()
+            << std::endl;
+      }
+   
+   private:
+      Name m_mname;
+      Name m_rname;
+      uint32_t m_serial;
+      uint32_t m_refresh;
+      uint32_t m_retry;
+      uint32_t m_expire;
+      uint32_t m_minimum;
    };
 
    /////////////////////////////////////////////////////////////////////////////
@@ -224,7 +506,7 @@ namespace DNS
    class RRecordAAAA : public ResourceRecord
    {
    public:
-      RRecordAAAA( const std::string &name,
+      RRecordAAAA( const Name &name,
                    int32_t ttl,
                    const struct in6_addr &address )
          : ResourceRecord( name, ns_t_aaaa, ns_c_in, ttl )
@@ -263,15 +545,15 @@ namespace DNS
    class RRecordCNAME : public ResourceRecord
    {
    public:
-      RRecordCNAME( const std::string &name,
+      RRecordCNAME( const Name &name,
                     int32_t ttl,
-                    const std::string &alias )
+                    const Name &alias )
          : ResourceRecord( name, ns_t_cname, ns_c_in, ttl ),
            m_alias( alias )
       {
       }
 
-      const EString &getAlias() { return m_alias; }
+      const Name &getAlias() { return m_alias; }
 
       virtual void dump()
       {
@@ -286,7 +568,7 @@ namespace DNS
       }
    
    private:
-      EString m_alias;
+      Name m_alias;
    };
 
    /////////////////////////////////////////////////////////////////////////////
@@ -295,12 +577,12 @@ namespace DNS
    class RRecordSRV : public ResourceRecord
    {
    public:
-      RRecordSRV( const std::string &name,
+      RRecordSRV( const Name &name,
                   int32_t ttl,
                   uint16_t priority,
                   uint16_t weight,
                   uint16_t port,
-                  const std::string &target)
+                  const Name &target)
          : ResourceRecord( name, ns_t_srv, ns_c_in, ttl ),
            m_priority( priority ),
            m_weight( weight ),
@@ -312,7 +594,7 @@ namespace DNS
       uint16_t getPriority() { return m_priority; }
       uint16_t getWeight() { return m_weight; }
       uint16_t getPort() { return m_port; }
-      const EString &getTarget() { return m_target; }
+      const Name &getTarget() { return m_target; }
 
       virtual void dump()
       {
@@ -333,7 +615,7 @@ namespace DNS
       uint16_t m_priority;
       uint16_t m_weight;
       uint16_t m_port;
-      EString m_target;
+      Name m_target;
    };
 
    /////////////////////////////////////////////////////////////////////////////
@@ -342,14 +624,14 @@ namespace DNS
    class RRecordNAPTR : public ResourceRecord
    {
    public:
-      RRecordNAPTR( const std::string &name,
+      RRecordNAPTR( const Name &name,
                     int32_t ttl,
                     uint16_t order,
                     uint16_t preference,
-                    const std::string &flags,
-                    const std::string &service,
-                    const std::string &regexp,
-                    const std::string &replacement )
+                    const Name &flags,
+                    const Name &service,
+                    const Name &regexp,
+                    const Name &replacement )
          : ResourceRecord( name, ns_t_naptr, ns_c_in, ttl ),
            m_order( order ),
            m_preference( preference ),
@@ -362,10 +644,10 @@ namespace DNS
 
       const uint16_t getOrder() const { return m_order; }
       const uint16_t getPreference() const { return m_preference; }
-      const EString &getFlags() { return m_flags; }
-      const EString &getService() { return m_service; }
-      const EString &getRegexp() { return m_regexp; }
-      const EString &getReplacement() { return m_replacement; }
+      const Name &getFlags() { return m_flags; }
+      const Name &getService() { return m_service; }
+      const Name &getRegexp() { return m_regexp; }
+      const Name &getReplacement() { return m_replacement; }
 
       virtual void dump()
       {
@@ -387,10 +669,10 @@ namespace DNS
    private:
       uint16_t m_order;
       uint16_t m_preference;
-      EString m_flags;
-      EString m_service;
-      EString m_regexp;
-      EString m_replacement;
+      Name m_flags;
+      Name m_service;
+      Name m_regexp;
+      Name m_replacement;
    };
 }
 
@@ -31,6 +31,8 @@
 #define atomic_dec_fetch(a) __sync_sub_and_fetch(&a, 1)
 /// atomic increment - increments a by 1
 #define atomic_inc_fetch(a) __sync_add_and_fetch(&a, 1)
+/// atomic add - adds b to a
+#define atomic_add(a, b) __sync_add_and_fetch(&a, b)
 /// atomic decrement - decrements a by 1
 #define atomic_fetch_dec(a) __sync_fetch_and_sub(&a, 1)
 /// atomic increment - increments a by 1
@@ -22,11 +22,17 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <pthread.h>
 
+#include <atomic>
 #include <stdexcept>
 #include <string>
 #include <list>
 #include <map>
+#include <typeinfo>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
 
 #include "freeDiameter/freeDiameter-host.h"
 #include "freeDiameter/libfdcore.h"
@@ -37,6 +43,8 @@
 #include "etime.h"
 #include "etimer.h"
 #include "eutil.h"
+#include "esynch.h"
+#include "eatomic.h"
 
 class FDException : public std::runtime_error
 {
@@ -48,13 +56,63 @@ public:
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+// Small object allocator with a free list per thread for each size class.
+// Blocks released on a thread are kept for reuse by that thread, up to the
+// limit for each size class, instead of being returned to the heap.
+class FDPool
+{
+public:
+   static void *allocate( size_t size );
+   static void release( void *p, size_t size );
+
+   // the limit may be changed while other threads allocate
+   static size_t getLimit() { return m_limit.load( std::memory_order_relaxed ); }
+   static size_t setLimit( size_t limit ) { m_limit.store( limit, std::memory_order_relaxed ); return limit; }
+
+private:
+   enum { Granularity = 64, Classes = 8 };
+
+   struct Node
+   {
+      Node *next;
+   };
+
+   struct Cache
+   {
+      Cache();
+      ~Cache();
+
+      Node *head[Classes];
+      size_t count[Classes];
+   };
+
+   static Cache *getCache();
+   static void createKey();
+   static void destroyCache( void *p );
+
+   static std::atomic<size_t> m_limit;
+
+   // the cache of a thread is released by the destructor of m_key, the
+   // thread_local members are trivially destructible so they remain usable
+   // by destructors that run after it
+   static pthread_key_t m_key;
+   static pthread_once_t m_once;
+   static thread_local Cache *m_cache;
+   static thread_local bool m_closed;
+};
+
+#define FDPOOL_OPERATORS \
+   static void *operator new( size_t size ) { return FDPool::allocate( size ); } \
+   static void operator delete( void *p, size_t size ) { FDPool::release( p, size ); }
+
 template<class T>
 class FDBuffer
 {
 public:
-   FDBuffer(size_t size) { msize = size; mbuf = new T[msize]; }
-   ~FDBuffer() { if (mbuf) delete [] mbuf; }
+   FDBuffer(size_t size) { msize = size; mbuf = (T*)FDPool::allocate( msize * sizeof(T) ); }
+   ~FDBuffer() { if (mbuf) FDPool::release( mbuf, msize * sizeof(T) ); }
    T *get() { return mbuf; }
+   FDPOOL_OPERATORS
 private:
    FDBuffer();
    size_t msize;
@@ -320,20 +378,35 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+class FDRequestStatsEntry;
+
 class FDDictionaryEntryCommand : public FDDictionaryEntry
 {
 public:
    FDDictionaryEntryCommand( const char *name, struct dictionary *dict = NULL );
    FDDictionaryEntryCommand( command_code_t cmdid, struct dictionary *dict = NULL );
    FDDictionaryEntryCommand( const FDDictionaryEntryCommand &req, struct dictionary *dict = NULL );
+   ~FDDictionaryEntryCommand();
 
    bool isRequest() const { return ( m_data.cmd_flag_val & CMD_FLAG_REQUEST ) ? true : false; } 
    bool isAnswer() const { return ( m_data.cmd_flag_val & CMD_FLAG_REQUEST ) ? false : true; } 
 
    command_code_t getCommandCode() { return m_data.cmd_code; }
 
+   // the request statistics of the application and of this command, the
+   // entries for the first application the command is sent with are cached
+   void getStats( application_id_t app, FDRequestStatsEntry *&appstats, FDRequestStatsEntry *&cmdstats );
+
 private:
+   struct Stats
+   {
+      application_id_t app;
+      FDRequestStatsEntry *appstats;
+      FDRequestStatsEntry *cmdstats;
+   };
+
    struct dict_cmd_data m_data;
+   std::atomic<Stats*> m_stats;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -436,7 +509,7 @@ private:
    struct avp *m_avp;
    struct avp_hdr *m_avphdr;
    union avp_value m_value;
-   FDBuffer<uint8_t> *m_buf;
+   uint8_t m_buf[18];   // encoded Address (family + IPv6 address) or Time value
    bool m_assigned;
    bool m_dedel;
 };
@@ -494,13 +567,15 @@ public:
    FDMessage &addJson( const std::string &json ) { return addJson( json.c_str() ); }
    bool getJson( std::string &json );
 
+   FDPOOL_OPERATORS
+
 protected:
    FDMessage( bool req2ans, FDDictionaryEntryCommand *de, struct msg *pmsg = NULL, bool dedel = false, bool msgdel = true );
    FDMessage( FDDictionaryEntryCommand *de, struct msg *pmsg = NULL, bool dedel = false );
    FDMessage( FDDictionaryEntryApplication *ade, FDDictionaryEntryCommand *cde, struct msg *pmsg = NULL, bool dedel = false );
    ~FDMessage();
 
-   FDMessage &sendRequest( void (*anscb)(void*,struct msg**), FDMessageRequest &req );
+   FDMessage &sendRequest( void (*anscb)(void*,struct msg**), FDMessageRequest &req, void (*expirecb)(void*,DiamId_t,size_t,struct msg**) = NULL );
    FDMessage &sendAnswer();
    
    void setMsgDelete( bool v ) { m_msgdel = v; }
@@ -526,6 +601,7 @@ public:
    FDMessageAnswer &send();
 };
 
+class FDPeer;
 class FDMessageRequest : public FDMessage
 {
    friend FDMessageAnswer;
@@ -539,15 +615,178 @@ public:
    FDMessageRequest &send();
 
    virtual void processAnswer( FDMessageAnswer &ans );
+   virtual void processTimeout();
+
+   // the peer the request is sent to, used to track outstanding requests
+   FDPeer *getPeer() { return m_peer; }
+   FDMessageRequest &setPeer( FDPeer *peer ) { m_peer = peer; return *this; }
+
+   // answer timeout in milliseconds, zero waits for the answer indefinitely
+   long getTimeout() { return m_timeout; }
+   FDMessageRequest &setTimeout( long ms ) { m_timeout = ms; return *this; }
 
 protected:
    ETimer m_timer;
 
 private:
    static void anscb( void * data, struct msg ** pmsg );
+   static void expirecb( void * data, DiamId_t sentto, size_t senttolen, struct msg ** pmsg );
+
+   FDPeer *m_peer;
+   long m_timeout;
+   FDRequestStatsEntry *m_stats[3];   // application, command and peer
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+class FDMessageTemplateValues;
+
+// Records the AVP layout of a message once (ordered AVPs, grouped AVPs,
+// constant values and slots for the values that change per message) and
+// then adds the AVPs to each new message without a temporary FDAvp or
+// dictionary lookup per AVP.  Grouped AVPs without any child AVPs and
+// slots without a value are omitted from the message.
+class FDMessageTemplate
+{
+   friend FDMessageTemplateValues;
 
+public:
+   FDMessageTemplate();
+   ~FDMessageTemplate();
+
+   int addGroup( FDDictionaryEntryAVP &de, int parent = -1 );
+   int addSlot( FDDictionaryEntryAVP &de, int parent = -1 );
+
+   int addConstant( FDDictionaryEntryAVP &de, int32_t v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, int64_t v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, uint32_t v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, uint64_t v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, float v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, double v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, const char *v, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, const std::string &v, int parent = -1 ) { return addConstant( de, v.c_str(), parent ); }
+   int addConstant( FDDictionaryEntryAVP &de, const uint8_t *v, size_t len, int parent = -1 );
+   int addConstant( FDDictionaryEntryAVP &de, const ETime &v, int parent = -1 );
+
+   int getSlotCount() { return (int)m_slots.size(); }
+
+   FDMessage &build( FDMessage &msg );
+   FDMessage &build( FDMessage &msg, FDMessageTemplateValues &values );
+
+private:
+   struct Node
+   {
+      FDDictionaryEntryAVP *de;
+      int parent;
+      int slot;
+      bool octets;
+      union avp_value value;
+      std::string data;
+      std::vector<int> children;
+   };
+
+   int addNode( FDDictionaryEntryAVP &de, int parent, int slot );
+   int addConstantNode( FDDictionaryEntryAVP &de, int parent, const union avp_value &v );
+   int addConstantNode( FDDictionaryEntryAVP &de, int parent, const uint8_t *data, size_t len );
+   FDMessage &build( FDMessage &msg, FDMessageTemplateValues *values );
+   struct avp *buildNode( int idx, FDMessageTemplateValues *values );
+
+   template<class T> static void toValue( FDDictionaryEntryAVP &de, T v, union avp_value &val );
+
+   std::vector<Node> m_nodes;
+   std::vector<int> m_roots;
+   std::vector<int> m_slots;
 };
 
+// The values for the slots of a FDMessageTemplate.  Strings and octet
+// strings are referenced, not copied, and must remain valid until the
+// message has been built.
+class FDMessageTemplateValues
+{
+   friend FDMessageTemplate;
+
+public:
+   FDMessageTemplateValues( FDMessageTemplate &tmpl );
+   ~FDMessageTemplateValues();
+
+   FDMessageTemplateValues &set( int slot, int32_t v )                    { return setNumber( slot, v ); }
+   FDMessageTemplateValues &set( int slot, uint32_t v )                   { return setNumber( slot, v ); }
+   FDMessageTemplateValues &set( int slot, uint64_t v )                   { return setNumber( slot, v ); }
+   FDMessageTemplateValues &set( int slot, float v )                      { return setNumber( slot, v ); }
+   FDMessageTemplateValues &set( int slot, double v )                     { return setNumber( slot, v ); }
+   FDMessageTemplateValues &set( int slot, const char *v )                { return set( slot, v, strlen( v ) ); }
+   FDMessageTemplateValues &set( int slot, const std::string &v )         { return set( slot, v.c_str(), v.size() ); }
+   FDMessageTemplateValues &set( int slot, const uint8_t *v, size_t len );
+   FDMessageTemplateValues &set( int slot, const char *v, size_t len );
+   FDMessageTemplateValues &set( int slot, int64_t v );
+   FDMessageTemplateValues &set( int slot, const ETime &v );
+
+   bool isSet( int slot ) { return slot >= 0 && slot < (int)m_values.size() && m_values[slot].set; }
+
+   void clear();
+
+private:
+   FDMessageTemplateValues();
+
+   struct Value
+   {
+      union avp_value value;
+      uint8_t buf[18];
+      size_t buflen;
+      bool set;
+   };
+
+   union avp_value &value( int slot );
+   template<class T> FDMessageTemplateValues &setNumber( int slot, T v );
+
+   FDMessageTemplate &m_tmpl;
+   std::vector<Value> m_values;
+};
+
+// converts a numeric value to the data type of the AVP
+template<class T>
+void FDMessageTemplate::toValue( FDDictionaryEntryAVP &de, T v, union avp_value &val )
+{
+   memset( &val, 0, sizeof( val ) );
+
+   switch ( de.getDataType() )
+   {
+      case DDTI32:
+      case DDTEnumerated:  val.i32 = (int32_t)v;   break;
+      case DDTI64:         val.i64 = (int64_t)v;   break;
+      case DDTU32:         val.u32 = (uint32_t)v;  break;
+      case DDTU64:         val.u64 = (uint64_t)v;  break;
+      case DDTF32:         val.f32 = (float)v;     break;
+      case DDTF64:         val.f64 = (double)v;    break;
+      default:
+      {
+         throw FDException(
+            EUtility::string_format( "%s:%d - INFO - Unable to assign numeric value to [%s]",
+            __FILE__, __LINE__, de.getName() )
+         );
+      }
+   }
+}
+
+template<class T>
+FDMessageTemplateValues &FDMessageTemplateValues::setNumber( int slot, T v )
+{
+   union avp_value &val = value( slot );
+
+   try
+   {
+      FDMessageTemplate::toValue( *m_tmpl.m_nodes[ m_tmpl.m_slots[slot] ].de, v, val );
+   }
+   catch (...)
+   {
+      m_values[slot].set = false;
+      throw;
+   }
+
+   return *this;
+}
+
 class FDCommand
 {
 public:
@@ -640,8 +879,12 @@ enum FDPeerState
    PSZombie
 };
 
+class FDPeerList;
+
 class FDPeer
 {
+   friend FDPeerList;
+
 public:
    FDPeer();
    FDPeer( DiamId_t diamid, uint16_t port = 3868 );
@@ -664,6 +907,15 @@ public:
 
    bool isOpen() { return getState() == PSOpen; }
 
+   uint32_t getWeight() { return m_weight; }
+   FDPeer &setWeight( uint32_t v ) { m_weight = v; return *this; }
+
+   long getOutstanding() { return m_outstanding; }
+   long incOutstanding() { return atomic_inc_fetch( m_outstanding ); }
+   long decOutstanding() { return atomic_dec_fetch( m_outstanding ); }
+
+   FDRequestStatsEntry *getStats();
+
    void add();
 
 private:
@@ -675,23 +927,198 @@ private:
    EString m_destip;
    uint16_t m_port;
    struct peer_hdr *m_peer;
+   uint32_t m_weight;
+   long m_outstanding;
+   FDPeerList *m_list;
+   FDRequestStatsEntry *m_stats;
+};
+
+enum FDPeerBalance
+{
+   PBFirstOpen,
+   PBRoundRobin,
+   PBLeastOutstanding,
+   PBWeighted
 };
 
 class FDPeerList : public std::list<FDPeer*>
 {
+   friend FDPeer;
+
 public:
-   FDPeerList();
+   FDPeerList( FDPeerBalance balance = PBFirstOpen );
    ~FDPeerList();
 
+   FDPeerList &add( FDPeer *peer );
+
    bool isPeerOpen();
 
    FDPeer *getOpenPeer();
+
+   FDPeerBalance getBalance() { return m_balance; }
+   FDPeerList &setBalance( FDPeerBalance v ) { m_balance = v; return *this; }
+
+   long getRefreshInterval() { return m_refreshms; }
+   FDPeerList &setRefreshInterval( long ms ) { m_refreshms = ms; return *this; }
+
+   size_t getOpenCount();
+
+   void refresh();
+
+private:
+   // called from the freeDiameter threads when a peer changes state
+   void peerStateChanged( FDPeer *peer ) { m_dirty = true; }
+   bool refreshDue() { return m_dirty || ETimer( m_refreshed.load() ).MilliSeconds() >= m_refreshms; }
+   FDPeer *select();
+
+   FDPeerBalance m_balance;
+   ERWLock m_rwlock;
+   std::vector<FDPeer*> m_open;
+   std::vector<int64_t> m_weights;
+   std::vector<int64_t> m_current;
+   EMutexPrivate m_swrr;
+   unsigned long m_next;
+   int64_t m_total;
+   long m_refreshms;
+   std::atomic<epctime_t> m_refreshed;
+   std::atomic<bool> m_dirty;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// REQUEST STATISTICS
+//
+//    Requests sent with FDMessageRequest::send() are counted per
+//    application, per command and per peer (when the request has a peer).
+//    The counters are updated with atomic operations and can be read at
+//    any time with FDRequestStats::snapshot().  reset() clears each counter
+//    with an atomic swap, an update that races with it is counted in either
+//    the old or the new interval and the counters of an entry are not reset
+//    as one consistent set.
+////////////////////////////////////////////////////////////////////////////////
+
+// HDR style histogram of latencies in microseconds, each power of two is
+// divided into 16 buckets (6.25% precision) up to 2^40 microseconds
+class FDLatencyHistogram
+{
+public:
+   enum { SubBuckets = 16, Buckets = 37 * SubBuckets };
+
+   FDLatencyHistogram() { reset(); }
+
+   void record( uint64_t us );
+   void reset();
+
+   uint64_t getCount() const { return m_count; }
+   uint64_t getMin() const { return m_count ? m_min : 0; }
+   uint64_t getMax() const { return m_max; }
+   uint64_t getMean() const { return m_count ? m_sum / m_count : 0; }
+   uint64_t getPercentile( double pct ) const;
+
+private:
+   static int bucket( uint64_t us );
+   static uint64_t bucketHigh( int idx );
+
+   uint64_t m_counts[Buckets];
+   uint64_t m_count;
+   uint64_t m_sum;
+   uint64_t m_min;
+   uint64_t m_max;
+};
+
+enum FDRequestStatsType
+{
+   RSTApplication,
+   RSTCommand,
+   RSTPeer
+};
+
+class FDRequestStatsEntry
+{
+public:
+   enum { ResultCodes = 32 };
+
+   struct ResultCode
+   {
+      uint32_t code;
+      uint64_t count;
+   };
+
+   FDRequestStatsEntry( FDRequestStatsType type, application_id_t app, command_code_t cmd, const std::string &peer );
+
+   FDRequestStatsType getType() const { return m_type; }
+   application_id_t getApplication() const { return m_app; }
+   command_code_t getCommand() const { return m_cmd; }
+   const std::string &getPeer() const { return m_peer; }
+
+   long getInFlight() const { return m_inflight; }
+   uint64_t getSent() const { return m_sent; }
+   uint64_t getAnswered() const { return m_answered; }
+   uint64_t getTimeouts() const { return m_timeouts; }
+   uint64_t getSendErrors() const { return m_senderrors; }
+   const FDLatencyHistogram &getLatency() const { return m_latency; }
+
+   // result codes in the order they were first seen, Experimental-Result-Code
+   // values are included, answers without either are counted in getNoResultCode()
+   int getResultCodeCount() const;
+   const ResultCode &getResultCode( int idx ) const { return m_codes[idx]; }
+   uint64_t getOtherResultCodes() const { return m_othercodes; }
+   uint64_t getNoResultCode() const { return m_nocode; }
+
+   void sending();
+   void sent();
+   void sendFailed();
+   void answered( uint64_t us, uint32_t resultcode );
+   void timedOut();
+
+   void reset();
+
+private:
+   FDRequestStatsEntry();
+
+   FDRequestStatsType m_type;
+   application_id_t m_app;
+   command_code_t m_cmd;
+   std::string m_peer;
+
+   long m_inflight;
+   uint64_t m_sent;
+   uint64_t m_answered;
+   uint64_t m_timeouts;
+   uint64_t m_senderrors;
+   FDLatencyHistogram m_latency;
+   ResultCode m_codes[ResultCodes];
+   uint64_t m_othercodes;
+   uint64_t m_nocode;
+};
+
+class FDRequestStats
+{
+public:
+   static bool getEnabled() { return m_enabled; }
+   static bool setEnabled( bool v ) { return m_enabled = v; }
+
+   static FDRequestStatsEntry *getApplication( application_id_t app );
+   static FDRequestStatsEntry *getCommand( application_id_t app, command_code_t cmd );
+   static FDRequestStatsEntry *getPeer( const std::string &peer );
+
+   static void snapshot( std::vector<FDRequestStatsEntry> &entries );
+   static void reset();
+
+private:
+   static bool m_enabled;
+   static ERWLock m_rwlock;
+   static std::unordered_map<uint64_t,FDRequestStatsEntry*> m_applications;
+   static std::unordered_map<uint64_t,FDRequestStatsEntry*> m_commands;
+   static std::unordered_map<std::string,FDRequestStatsEntry*> m_peers;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 class FDExtractorAvp;
+class FDExtractorSchema;
 
 enum eFDExtractorType
 {
@@ -703,11 +1130,15 @@ enum eFDExtractorType
 
 class FDExtractorBase
 {
+   friend FDExtractor;
+   friend FDExtractorSchema;
+
 public:
    FDExtractorBase( FDDictionaryEntryAVP *de )
       : m_de( de ),
         m_idx( -1 ),
-        m_resolved( false )
+        m_resolved( false ),
+        m_next( NULL )
    {
    }
 
@@ -715,8 +1146,12 @@ public:
    {
    }
 
+   FDPOOL_OPERATORS
+
    virtual eFDExtractorType getExtractorType() = 0;
 
+   virtual void reset() { m_idx = -1; m_resolved = false; }
+
    int getIndex() { return m_idx; }
    int setIndex( int idx ) { return m_idx = idx; }
 
@@ -731,6 +1166,7 @@ private:
    FDDictionaryEntryAVP *m_de;
    int m_idx;
    bool m_resolved;
+   FDExtractorBase *m_next;
 };
 
 class FDExtractorKey
@@ -776,6 +1212,51 @@ private:
    avp_code_t m_avpcode;
 };
 
+// The compiled (vendor id, avp code) lookup table for an extractor.  The
+// schema maps each key to the position of the entry in the order that the
+// entries were added to the extractor.  Schemas are compiled once for each
+// extractor class and shared by all of the instances of that class.
+class FDExtractorSchema
+{
+public:
+   FDExtractorSchema( FDExtractorBase *head, int count );
+
+   int find( vendor_id_t v, avp_code_t a ) const
+   {
+      uint64_t key = makeKey( v, a );
+      size_t lo = 0;
+      size_t hi = m_keys.size();
+
+      while ( lo < hi )
+      {
+         size_t mid = ( lo + hi ) >> 1;
+         if ( m_keys[mid] < key )
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+
+      return lo < m_keys.size() && m_keys[lo] == key ? m_slots[lo] : -1;
+   }
+
+   int getCount() const { return (int)m_order.size(); }
+
+   bool matches( FDExtractorBase *head, int count ) const;
+
+   static const FDExtractorSchema *getSchema( const std::type_info &ti, FDExtractorBase *head, int count );
+
+private:
+   static uint64_t makeKey( vendor_id_t v, avp_code_t a ) { return ( (uint64_t)v << 32 ) | a; }
+   static uint64_t makeKey( FDExtractorBase *base );
+
+   std::vector<uint64_t> m_keys;
+   std::vector<int> m_slots;
+   std::vector<uint64_t> m_order;
+
+   static ERWLock m_rwlock;
+   static std::unordered_map<std::type_index,FDExtractorSchema*> m_schemas;
+};
+
 class FDExtractor : public FDExtractorBase
 {
    friend FDExtractorList;
@@ -802,17 +1283,32 @@ public:
 
    bool exists( bool skipResolve = false );
 
+   void reset();
+   void reset( FDMessage &msg ) { reset(); setReference( msg ); }
+   void reset( msg_or_avp *m )  { reset(); setReference( m ); }
+
    void dump();
 
    bool getJson( std::string &json );
 
 protected:
    void resolve();
+   void resolve( FDExtractorBase *target );
 
 private:
+   bool locate();
+   const FDExtractorSchema &getSchema();
+
    FDExtractor *m_parent;
    msg_or_avp *m_reference;
-   std::map<FDExtractorKey,FDExtractorBase*> m_entries;
+   FDExtractorBase *m_head;
+   FDExtractorBase *m_tail;
+   int m_count;
+   const FDExtractorSchema *m_schema;
+   FDExtractorSchema *m_private;
+   std::vector<FDExtractorBase*> m_entries;
+   msg_or_avp *m_cursor;
+   bool m_started;
    int m_index;
 };
 
@@ -836,6 +1332,8 @@ public:
 
    bool exists();
 
+   void reset();
+
    void dump();
 
 protected:
@@ -844,8 +1342,11 @@ protected:
 private:
    FDExtractorList();
 
+   FDExtractor *nextExtractor();
+
    FDExtractor *m_parent;
    std::list<FDExtractor*> m_list;
+   std::list<FDExtractor*> m_spare;
 };
 
 class FDExtractorAvp : public FDExtractorBase
@@ -862,6 +1363,8 @@ public:
 
    bool exists();
 
+   void reset() { FDExtractorBase::reset(); setAvp( NULL ); }
+
    bool get( int32_t &v )                    { if ( !exists() ) return false; return m_avp.get( v ); }
    bool get( uint32_t &v )                   { if ( !exists() ) return false; return m_avp.get( v ); }
    bool get( uint64_t &v )                   { if ( !exists() ) return false; return m_avp.get( v ); }
@@ -885,6 +1388,8 @@ private:
 
 class FDExtractorAvpList : public FDExtractorBase
 {
+   friend FDExtractor;
+
 public:
    FDExtractorAvpList( FDExtractor &extractor, FDDictionaryEntryAVP &de );
    virtual ~FDExtractorAvpList();
@@ -895,13 +1400,18 @@ public:
 
    bool exists();
 
+   void reset();
+
    void dump();
 
 private:
    FDExtractorAvpList();
 
+   FDExtractorAvp *nextAvp();
+
    FDExtractor *m_parent;
    std::list<FDExtractorAvp*> m_list;
+   std::list<FDExtractorAvp*> m_spare;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -30,6 +30,8 @@ extern "C" {
 #endif
 
 int fdJsonAddAvps( const char *json, msg_or_avp *msg, void (*errfunc)(const char *) );
+/* parses json in place, the contents of json are modified */
+int fdJsonAddAvpsInsitu( char *json, msg_or_avp *msg, void (*errfunc)(const char *) );
 const char *fdJsonGetJSON( msg_or_avp *msg, void (*errfunc)(const char *) );
 
 #define FDJSON_SUCCESS             0
@@ -18,14 +18,18 @@
 #define __EPCDNS_H
 
 #include <stdio.h>
+#include <string.h>
 
 #include <algorithm>
+#include <deque>
 #include <string>
 #include <sstream>
 #include <list>
+#include <unordered_map>
 #include <vector>
 
 #include "estring.h"
+#include "esynch.h"
 #include "dnscache.h"
 
 /*
@@ -305,55 +309,150 @@ namespace EPCDNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   // fixed size domain name buffer used to build a FQDN without allocating
+   class FQDN
+   {
+   public:
+      FQDN() : m_len( 0 ) { m_buf[0] = '\0'; }
+
+      const char *c_str() const { return m_buf; }
+      size_t length() const { return m_len; }
+      operator EString() const { return EString( std::string( m_buf, m_len ) ); }
+
+      FQDN &clear() { m_len = 0; m_buf[0] = '\0'; return *this; }
+
+      FQDN &append( const char *s, size_t len )
+      {
+         if ( m_len + len >= sizeof(m_buf) )
+            throw EError( EError::Warning, "FQDN exceeds the maximum domain name length" );
+         memcpy( &m_buf[m_len], s, len );
+         m_len += len;
+         m_buf[m_len] = '\0';
+         return *this;
+      }
+      FQDN &append( const char *s ) { return append( s, strlen(s) ); }
+      FQDN &append( const std::string &s ) { return append( s.c_str(), s.length() ); }
+
+   private:
+      char m_buf[NS_MAXDNAME];
+      size_t m_len;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
+   // the PLMN specific domain name suffixes
+   class PlmnSuffix
+   {
+   public:
+      PlmnSuffix( const unsigned char *plmnid );
+
+      // mnc<MNC>.mcc<MCC>.3gppnetwork.org
+      const std::string &getHomeNetwork() const { return m_home; }
+      // mnc<MNC>.mcc<MCC>.gprs
+      const std::string &getGprs() const { return m_gprs; }
+      // mnc<MNC>.mcc<MCC>.pub.3gppnetwork.org
+      const std::string &getPublic() const { return m_pub; }
+      // mcc<MCC>.visited-country.pub.3gppnetwork.org
+      const std::string &getVisitedCountry() const { return m_visited; }
+
+   private:
+      std::string m_home;
+      std::string m_gprs;
+      std::string m_pub;
+      std::string m_visited;
+   };
+
+   // the suffixes for each PLMN ID are built once and never removed
+   class PlmnSuffixCache
+   {
+   public:
+      static PlmnSuffixCache &getInstance();
+
+      const PlmnSuffix &getSuffix( const unsigned char *plmnid );
+
+   private:
+      PlmnSuffixCache() {}
+
+      ERWLock m_rwlock;
+      std::unordered_map<uint32_t,PlmnSuffix*> m_suffixes;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
    class Utility
    {
    public:
       static EString home_network( const char *mnc, const char *mcc );
       static EString home_network( const unsigned char *plmnid );
+      static FQDN &home_network( FQDN &fqdn, const unsigned char *plmnid );
       static EString home_network_gprs( const char *mnc, const char *mcc );
       static EString home_network_gprs( const unsigned char *plmnid );
+      static FQDN &home_network_gprs( FQDN &fqdn, const unsigned char *plmnid );
       static EString tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc );
       static EString tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid );
+      static FQDN &tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid );
       static EString mme_fqdn( const char *mmec, const char *mmegi, const char *mnc, const char *mcc );
       static EString mme_fqdn( const char *mmec, const char *mmegi, const unsigned char *plmnid );
+      static FQDN &mme_fqdn( FQDN &fqdn, const char *mmec, const char *mmegi, const unsigned char *plmnid );
       static EString mme_pool_fqdn( const char *mmegi, const char *mnc, const char *mcc );
       static EString mme_pool_fqdn( const char *mmegi, const unsigned char *plmnid );
+      static FQDN &mme_pool_fqdn( FQDN &fqdn, const char *mmegi, const unsigned char *plmnid );
       static EString rai_fqdn( const char *rac, const char *lac, const char *mnc, const char *mcc );
       static EString rai_fqdn( const char *rac, const char *lac, const unsigned char *plmnid );
+      static FQDN &rai_fqdn( FQDN &fqdn, const char *rac, const char *lac, const unsigned char *plmnid );
       static EString rnc_fqdn( const char *rnc, const char *mnc, const char *mcc );
       static EString rnc_fqdn( const char *rnc, const unsigned char *plmnid );
+      static FQDN &rnc_fqdn( FQDN &fqdn, const char *rnc, const unsigned char *plmnid );
       static EString sgsn_fqdn( const char *nri, const char *rac, const char *lac, const char *mnc, const char *mcc );
       static EString sgsn_fqdn( const char *nri, const char *rac, const char *lac, const unsigned char *plmnid );
+      static FQDN &sgsn_fqdn( FQDN &fqdn, const char *nri, const char *rac, const char *lac, const unsigned char *plmnid );
       static EString epc_nodes_domain_fqdn( const char *mnc, const char *mcc );
       static EString epc_nodes_domain_fqdn( const unsigned char *plmnid );
+      static FQDN &epc_nodes_domain_fqdn( FQDN &fqdn, const unsigned char *plmnid );
       static EString epc_node_fqdn( const char *node, const char *mnc, const char *mcc );
       static EString epc_node_fqdn( const char *node, const unsigned char *plmnid );
+      static FQDN &epc_node_fqdn( FQDN &fqdn, const char *node, const unsigned char *plmnid );
       static EString nonemergency_epdg_oi_fqdn( const char *mnc, const char *mcc );
       static EString nonemergency_epdg_oi_fqdn( const unsigned char *plmnid );
+      static FQDN &nonemergency_epdg_oi_fqdn( FQDN &fqdn, const unsigned char *plmnid );
       static EString nonemergency_epdg_tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc );
       static EString nonemergency_epdg_tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid );
+      static FQDN &nonemergency_epdg_tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid );
       static EString nonemergency_epdg_lac_fqdn( const char *lac, const char *mnc, const char *mcc );
       static EString nonemergency_epdg_lac_fqdn( const char *lac, const unsigned char *plmnid );
+      static FQDN &nonemergency_epdg_lac_fqdn( FQDN &fqdn, const char *lac, const unsigned char *plmnid );
       static EString nonemergency_epdg_visitedcountry_fqdn( const char *mcc );
       static EString nonemergency_epdg_visitedcountry_fqdn( const unsigned char *plmnid );
+      static FQDN &nonemergency_epdg_visitedcountry_fqdn( FQDN &fqdn, const unsigned char *plmnid );
       static EString emergency_epdg_oi_fqdn( const char *mnc, const char *mcc );
       static EString emergency_epdg_oi_fqdn( const unsigned char *plmnid );
+      static FQDN &emergency_epdg_oi_fqdn( FQDN &fqdn, const unsigned char *plmnid );
       static EString emergency_epdg_tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc );
       static EString emergency_epdg_tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid );
+      static FQDN &emergency_epdg_tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid );
       static EString emergency_epdg_lac_fqdn( const char *lac, const char *mnc, const char *mcc );
       static EString emergency_epdg_lac_fqdn( const char *lac, const unsigned char *plmnid );
+      static FQDN &emergency_epdg_lac_fqdn( FQDN &fqdn, const char *lac, const unsigned char *plmnid );
       static EString emergency_epdg_visitedcountry_fqdn( const char *mcc );
       static EString emergency_epdg_visitedcountry_fqdn( const unsigned char *plmnid );
+      static FQDN &emergency_epdg_visitedcountry_fqdn( FQDN &fqdn, const unsigned char *plmnid );
       static EString global_enodeb_id_fqdn( const char *enb, const char *mnc, const char *mcc );
       static EString global_enodeb_id_fqdn( const char *enb, const unsigned char *plmnid );
+      static FQDN &global_enodeb_id_fqdn( FQDN &fqdn, const char *enb, const unsigned char *plmnid );
       static EString local_homenetwork_fqdn( const char *lhn, const char *mcc );
       static EString local_homenetwork_fqdn( const char *lhn, const unsigned char *plmnid );
+      static FQDN &local_homenetwork_fqdn( FQDN &fqdn, const char *lhn, const unsigned char *plmnid );
       static EString epc( const char *mnc, const char *mcc );
       static EString epc( const unsigned char *plmnid );
+      static FQDN &epc( FQDN &fqdn, const unsigned char *plmnid );
       static EString apn_fqdn( const char *apnoi, const char *mnc, const char *mcc );
       static EString apn_fqdn( const char *apnoi, const unsigned char *plmnid );
+      static FQDN &apn_fqdn( FQDN &fqdn, const char *apnoi, const unsigned char *plmnid );
       static EString apn( const char *apnoi, const char *mnc, const char *mcc );
       static EString apn( const char *apnoi, const unsigned char *plmnid );
+      static FQDN &apn( FQDN &fqdn, const char *apnoi, const unsigned char *plmnid );
    
       static AppServiceEnum getAppService( const std::string &s );
       static AppProtocolEnum getAppProtocol( const std::string &p );
@@ -372,6 +471,7 @@ namespace EPCDNS
    
       static EString diameter_fqdn( const char *mnc, const char *mcc );
       static EString diameter_fqdn( const unsigned char *plmnid );
+      static FQDN &diameter_fqdn( FQDN &fqdn, const unsigned char *plmnid );
 
       static uint32_t getDiameterApplication( DiameterApplicationEnum app );
       static const char *getDiameterProtocol( DiameterProtocolEnum protocol );
@@ -385,7 +485,56 @@ namespace EPCDNS
    ////////////////////////////////////////////////////////////////////////////////
    ////////////////////////////////////////////////////////////////////////////////
    
-   class CanonicalNodeName : public std::list<std::string>
+   typedef uint32_t LabelId;
+
+   // global table of interned domain name labels, each distinct label is
+   // assigned a LabelId once and is never removed
+   class LabelTable
+   {
+   public:
+      static LabelTable &getInstance();
+
+      LabelId intern( const char *label, size_t len );
+      const std::string &getLabel( LabelId id );
+
+      size_t size() { ERDLock l( m_rwlock ); return m_labels.size(); }
+
+   private:
+      struct Key
+      {
+         const char *m_label;
+         size_t m_len;
+      };
+
+      struct KeyHash
+      {
+         size_t operator()( const Key &k ) const
+         {
+            size_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < k.m_len; i++)
+               h = (h ^ (unsigned char)k.m_label[i]) * 1099511628211ULL;
+            return h;
+         }
+      };
+
+      struct KeyEqual
+      {
+         bool operator()( const Key &l, const Key &r ) const
+         {
+            return l.m_len == r.m_len && memcmp( l.m_label, r.m_label, l.m_len ) == 0;
+         }
+      };
+
+      LabelTable() {}
+
+      ERWLock m_rwlock;
+      std::deque<std::string> m_labels;
+      std::unordered_map<Key,LabelId,KeyHash,KeyEqual> m_ids;
+   };
+
+   // the labels of a topon canonical node name are stored in reverse order
+   // as interned label ids
+   class CanonicalNodeName : public std::vector<LabelId>
    {
    public:
       CanonicalNodeName();
@@ -405,7 +554,7 @@ namespace EPCDNS
 
          std::cout << prefix << "Labels" << std::endl;
          for ( CanonicalNodeName::const_iterator it = begin(); it != end(); ++it )
-            std::cout << prefix << "  " << *it << std::endl;
+            std::cout << prefix << "  " << LabelTable::getInstance().getLabel( *it ) << std::endl;
       }
 
    private:
@@ -568,7 +717,7 @@ namespace EPCDNS
    {
    public:
       AppService() { m_service = x_3gpp_unknown; }
-      AppService( const std::string &ds ) { parse( ds ); }
+      AppService( const std::string &ds ) { m_service = x_3gpp_unknown; parse( ds ); }
       ~AppService()
       {
          while ( !m_protocols.empty() )
@@ -620,17 +769,31 @@ namespace EPCDNS
    {
    public:
       NodeSelectorResult()
+         : m_supported_protocols( new AppProtocolList() )
       {
          m_order = 0;
          m_preference = 0;
          m_port = 0;
       }
 
+      // the copy has its own host lists, the supported protocols are shared
+      // with the original and can not be modified through either of them
+      NodeSelectorResult( const NodeSelectorResult &other )
+         : m_hostname( other.m_hostname ),
+           m_order( other.m_order ),
+           m_preference( other.m_preference ),
+           m_port( other.m_port ),
+           m_supported_protocols( other.m_supported_protocols ),
+           m_ipv4_hosts( other.m_ipv4_hosts ),
+           m_ipv6_hosts( other.m_ipv6_hosts )
+      {
+      }
+
       const EString &getHostname() { return m_hostname; }
       uint16_t getOrder() { return m_order; }
       uint16_t getPreference() { return m_preference; }
       uint16_t getPort() { return m_port; }
-      AppProtocolList &getSupportedProtocols() { return m_supported_protocols; }
+      const AppProtocolList &getSupportedProtocols() { return *m_supported_protocols; }
       StringVector &getIPv4Hosts() { return m_ipv4_hosts; }
       StringVector &getIPv6Hosts() { return m_ipv6_hosts; }
 
@@ -638,7 +801,8 @@ namespace EPCDNS
       uint16_t setPreference( uint16_t preference ) { return m_preference = preference; }
       uint16_t setPort( uint16_t port ) { return m_port = port; }
       const EString &setHostname( const std::string &hostname ) { m_hostname = hostname; return m_hostname; }
-      void addSupportedProtocol( AppProtocol *ap ) { m_supported_protocols.push_back( ap ); }
+      // only called while the result is built, before it is copied
+      void addSupportedProtocol( AppProtocol *ap ) { m_supported_protocols->push_back( ap ); }
       void addIPv4Host( const std::string &host ) { m_ipv4_hosts.push_back( host ); }
       void addIPv6Host( const std::string &host ) { m_ipv6_hosts.push_back( host ); }
 
@@ -652,7 +816,7 @@ namespace EPCDNS
          EString pfx( prefix );
          std::cout << prefix << "  supported protocols" << std::endl;
          pfx.append( "    " );
-         m_supported_protocols.dump( pfx.c_str() );
+         m_supported_protocols->dump( pfx.c_str() );
 
          std::cout << prefix << "  IPv4 HOSTS" << std::endl;
          m_ipv4_hosts.dump( pfx.c_str() );
@@ -665,11 +829,13 @@ namespace EPCDNS
       }
 
    private:
+      NodeSelectorResult &operator=( const NodeSelectorResult &other );
+
       EString m_hostname;
       uint16_t m_order;
       uint16_t m_preference;
       uint16_t m_port;
-      AppProtocolList m_supported_protocols;
+      std::shared_ptr<AppProtocolList> m_supported_protocols;
       StringVector m_ipv4_hosts;
       StringVector m_ipv6_hosts;
    };
@@ -707,6 +873,38 @@ namespace EPCDNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   // NAPTR services parsed once per DNS query and the NodeSelector results
+   // for each set of selection criteria, attached to the DNS::Query so that
+   // they are discarded when the query is refreshed
+   class NodeSelectorCache : public DNS::QueryExtension
+   {
+   public:
+      typedef std::pair<DNS::RRecordNAPTR*,AppService*> NaptrService;
+      typedef std::vector<NaptrService> NaptrServiceVector;
+
+      NodeSelectorCache( DNS::QueryPtr &q );
+      ~NodeSelectorCache();
+
+      static std::shared_ptr<NodeSelectorCache> getInstance( DNS::QueryPtr &q );
+
+      const NaptrServiceVector &getServices() { return m_services; }
+
+      std::shared_ptr<const NodeSelectorResultList> findResults( const std::string &key );
+      // takes ownership of results, if results were already saved for the
+      // key those are returned and results is deleted
+      std::shared_ptr<const NodeSelectorResultList> saveResults( const std::string &key, NodeSelectorResultList *results );
+
+   private:
+      NodeSelectorCache();
+
+      NaptrServiceVector m_services;
+      ERWLock m_rwlock;
+      std::unordered_map<std::string,std::shared_ptr<const NodeSelectorResultList> > m_results;
+   };
+
+   /////////////////////////////////////////////////////////////////////////////
+   /////////////////////////////////////////////////////////////////////////////
+
    class NodeSelector
    {
    public:
@@ -724,6 +922,16 @@ namespace EPCDNS
 
       NodeSelectorResultList &process();
 
+      // performs the selection without blocking the calling thread, when the
+      // selection is complete message is sent to thread with a pointer to this
+      // NodeSelector which must remain valid until the message is received.
+      // Neither the resolver thread nor the calling thread waits for a free
+      // slot in the message queue of thread, if the queue is full the message
+      // is sent by a notifier thread and counted by getDeferredMessages().
+      void process( EThreadBase *thread, UInt message );
+
+      static long getDeferredMessages() { return m_deferred; }
+
       void dump()
       {
          std::cout << "NodeSelector REQUEST" << std::endl;
@@ -749,7 +957,11 @@ namespace EPCDNS
    
    private:
       AppServiceEnum parseService( const std::string &service, std::list<AppProtocolEnum> &protocols ) const;
+      EString getSelectionKey();
+      NodeSelectorResultList &evaluate();
       static bool naptr_compare( DNS::RRecordNAPTR*& first, DNS::RRecordNAPTR*& second );
+      void copyResults( const NodeSelectorResultList &saved );
+      static void async_callback( DNS::QueryPtr q, bool cacheHit, const void *data );
    
       DNS::namedserverid_t m_nsid;
       EString m_domain;
@@ -760,6 +972,11 @@ namespace EPCDNS
 
       NodeSelectorResultList m_results;
       DNS::QueryPtr m_query;
+
+      EThreadBase *m_thread;
+      UInt m_message;
+
+      static long m_deferred;
    };
    
    ////////////////////////////////////////////////////////////////////////////////
@@ -767,6 +984,7 @@ namespace EPCDNS
    
    class ColocatedCandidate
    {
+      friend class ColocatedCandidateList;
    public:
       enum PairType
       {
@@ -780,8 +998,8 @@ namespace EPCDNS
 
       NodeSelectorResult &getCandidate1() { return m_candidate1; }
       NodeSelectorResult &getCandidate2() { return m_candidate2; }
-      CanonicalNodeName &getCanonicalNodeName1() { return m_cnn1; }
-      CanonicalNodeName &getCanonicalNodeName2() { return m_cnn2; }
+      CanonicalNodeName &getCanonicalNodeName1() { return *m_cnn1; }
+      CanonicalNodeName &getCanonicalNodeName2() { return *m_cnn2; }
       PairType getPairType() { return m_pairtype; }
       int getTopologicalMatches() { return m_topologicalMatches; }
 
@@ -790,9 +1008,9 @@ namespace EPCDNS
          EString pfx( prefix );
          pfx.append( "  " );
 
-         std::cout << prefix << "canonical name 1 - " << m_cnn1.getName() << std::endl;
+         std::cout << prefix << "canonical name 1 - " << m_cnn1->getName() << std::endl;
          m_candidate1.dump( pfx.c_str() );
-         std::cout << prefix << "canonical name 2 - " << m_cnn2.getName() << std::endl;
+         std::cout << prefix << "canonical name 2 - " << m_cnn2->getName() << std::endl;
          m_candidate2.dump( pfx .c_str());
          std::cout << prefix << "pair type - " << (
             m_pairtype == ptColocated ? "colocated" :
@@ -803,11 +1021,14 @@ namespace EPCDNS
 
    private:
       ColocatedCandidate();
+      ColocatedCandidate( NodeSelectorResult &candidate1, NodeSelectorResult &candidate2,
+         std::shared_ptr<CanonicalNodeName> &cnn1, std::shared_ptr<CanonicalNodeName> &cnn2,
+         PairType pairtype, int topologicalMatches );
 
       NodeSelectorResult &m_candidate1;
       NodeSelectorResult &m_candidate2;
-      CanonicalNodeName m_cnn1;
-      CanonicalNodeName m_cnn2;
+      std::shared_ptr<CanonicalNodeName> m_cnn1;
+      std::shared_ptr<CanonicalNodeName> m_cnn2;
       PairType m_pairtype;
       int m_topologicalMatches;
    };
@@ -815,10 +1036,16 @@ namespace EPCDNS
    /////////////////////////////////////////////////////////////////////////////
    /////////////////////////////////////////////////////////////////////////////
 
+   // The candidate pairs are ordered by pair type (colocated, topological
+   // distance, DNS priority), then by the number of matching labels for
+   // topological pairs, then by the order and preference of candidate 1.
+   // Limiting the list to the best maxCandidates pairs avoids creating
+   // every nodelist1 x nodelist2 pair.
    class ColocatedCandidateList : public std::list<ColocatedCandidate*>
    {
    public:
       ColocatedCandidateList( NodeSelectorResultList &nodelist1, NodeSelectorResultList &nodelist2 );
+      ColocatedCandidateList( NodeSelectorResultList &nodelist1, NodeSelectorResultList &nodelist2, size_t maxCandidates );
       ~ColocatedCandidateList();
 
       void dump( const char *prefix = "" )
@@ -840,7 +1067,7 @@ namespace EPCDNS
    private:
       ColocatedCandidateList();
 
-      static bool sort_compare( ColocatedCandidate*& first, ColocatedCandidate*& second );
+      void build( size_t maxCandidates );
 
       NodeSelectorResultList &m_nodelist1;
       NodeSelectorResultList &m_nodelist2;
@@ -1375,15 +1602,47 @@ namespace EPCDNS
       DiameterProtocolEnum getProtocol() { return m_protocol; }
       DiameterProtocolEnum setProtocol( DiameterProtocolEnum proto ) { return m_protocol = proto; }
 
+      // when enabled (disabled by default) hosts without A/AAAA additional
+      // records are resolved by process() with parallel A and AAAA queries,
+      // the preferred family is AF_INET, AF_INET6 or AF_UNSPEC (the default)
+      // to wait for the answers of both families
+      bool getResolveAddresses() { return m_resolve; }
+      bool setResolveAddresses( bool resolve ) { return m_resolve = resolve; }
+
+      int getPreferredFamily() { return m_family; }
+      int setPreferredFamily( int family ) { return m_family = family; }
+
       DiameterNaptrList &process();
 
+      // performs the selection without blocking the calling thread, when the
+      // selection is complete message is sent to thread with a pointer to this
+      // DiameterSelector which must remain valid until the message is received,
+      // hosts without additional records are not resolved. As with
+      // NodeSelector, a message that does not fit in the message queue of
+      // thread is sent by a notifier thread and counted.
+      void process( EThreadBase *thread, UInt message );
+
+      static long getDeferredMessages() { return m_deferred; }
+
    private:
+      bool validate();
+      DiameterNaptrList &evaluate( bool resolve );
+      void resolveHosts( std::vector<DiameterHost*> &hosts );
+      static void async_callback( DNS::QueryPtr q, bool cacheHit, const void *data );
+
       EString m_realm;
       DiameterApplicationEnum m_application;
       DiameterProtocolEnum m_protocol;
+      bool m_resolve;
+      int m_family;
 
       DNS::QueryPtr m_query;
       DiameterNaptrList m_results;
+
+      EThreadBase *m_thread;
+      UInt m_message;
+
+      static long m_deferred;
    };
 
 } // namespace EPCDNS
@@ -28,7 +28,8 @@ class EString : public std::string
 public:
    EString() {}
    EString(cpStr s) : std::string(s) {}
-   EString(const std::string s) : std::string(s) {}
+   EString(const std::string &s) : std::string(s) {}
+   EString(std::string &&s) : std::string(std::move(s)) {}
    EString &format(cpChar pszFormat, ...);
    EString &tolower();
    EString &toupper();
@@ -39,11 +40,16 @@ public:
       *(std::string *)this = s;
       return *this;
    }
-   EString &operator=(const std::string s)
+   EString &operator=(const std::string &s)
    {
       *(std::string *)this = s;
       return *this;
    }
+   EString &operator=(std::string &&s)
+   {
+      *(std::string *)this = std::move(s);
+      return *this;
+   }
    Int icompare(EString &str)
    {
       return epc_strnicmp(c_str(), str.c_str(), length() > str.length() ? length() : str.length());
@@ -16,12 +16,20 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <errno.h>
 #include <memory.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <list>
+#include <map>
+#include <vector>
 
 #include "epctools.h"
 #include "eerror.h"
@@ -184,15 +192,39 @@ namespace DNS
       {
          qp->endQuery();
 
-         try
+         CacheStats &stats = qp->getCache().m_stats;
+
+         if ( abuf && alen > 0 )
          {
-            Parser p( *qq, abuf, alen );
-            p.parse();
+            stats.recordLatency( (*qq)->getTimer().MicroSeconds() );
+
+            try
+            {
+               Parser p( *qq, abuf, alen );
+               p.parse();
+            }
+            catch (ResolverError &ex)
+            {
+               (*qq)->setError( true );
+               (*qq)->setErrorMsg( ex.what() );
+               atomic_inc( stats.m_errors );
+            }
+            catch (std::exception &ex)
+            {
+               (*qq)->setError( true );
+               (*qq)->setErrorMsg( ex.what() );
+               atomic_inc( stats.m_parsefailures );
+            }
          }
-         catch (std::exception &ex)
+         else
          {
+            // no response from the server (timeout, connection refused, etc.)
             (*qq)->setError( true );
-            (*qq)->setErrorMsg( ex.what() );
+            (*qq)->setErrorMsg( ares_strerror(status) );
+            if ( status == ARES_ETIMEOUT )
+               atomic_inc( stats.m_timeouts );
+            else
+               atomic_inc( stats.m_errors );
          }
 
          if ( !(*qq)->getError() )
@@ -331,6 +363,8 @@ namespace DNS
       m_qpt.incActiveQueries();
       q->setQueryProcessor( this );
       q->setError( false );
+      q->getTimer().Start();
+      atomic_inc( m_cache.m_stats.m_queries );
 
       QueryPtr *qq = new QueryPtr(q);
 
@@ -364,10 +398,17 @@ namespace DNS
    unsigned int Cache::m_concur = 10;
    int Cache::m_percent = 80;
    long Cache::m_interval = 60;
+   uint32_t Cache::m_negttl = 60;
+   size_t Cache::m_maxentries = 0;
+   size_t Cache::m_maxbytes = 0;
+   long Cache::m_refreshminhits = 0;
+   int Cache::m_addressgrace = 50;
 
    Cache::Cache()
       : m_qp( *this ),
-        m_refresher( *this, m_concur, m_percent, m_interval )
+        m_refresher( *this, m_concur, m_percent, m_interval ),
+        m_bytes( 0 ),
+        m_hand( ns_t_invalid, "" )
    {
       if (m_ref == 0)
       {
@@ -461,9 +502,19 @@ namespace DNS
 
    QueryPtr Cache::query( ns_type rtype, const std::string & domain, bool &cacheHit, bool ignorecache )
    {
-      QueryPtr q = lookupQuery( rtype, domain );
+      QueryPtr q = lookupZone( rtype, domain );
+
+      if ( q )
+      {
+         atomic_inc( m_stats.m_zonehits );
+         cacheHit = true;
+         return q;
+      }
+
+      q = lookupQuery( rtype, domain, ignorecache );
 
       cacheHit = !( !q || q->isExpired() );
+      countLookup( q, cacheHit, ignorecache );
 
       if ( !cacheHit || ignorecache ) // query not found or expired
       {
@@ -478,9 +529,20 @@ namespace DNS
 
    Void Cache::query( ns_type rtype, const std::string &domain, CachedDNSQueryCallback cb, const Void *data, bool ignorecache )
    {
-      QueryPtr q = lookupQuery( rtype, domain );
+      QueryPtr q = lookupZone( rtype, domain );
+
+      if ( q )
+      {
+         atomic_inc( m_stats.m_zonehits );
+         if ( cb )
+            cb( q, true, data );
+         return;
+      }
+
+      q = lookupQuery( rtype, domain, ignorecache );
 
       bool cacheHit = !( !q || q->isExpired() );
+      countLookup( q, cacheHit, ignorecache );
 
       if ( cacheHit && !ignorecache )
       {
@@ -496,14 +558,257 @@ namespace DNS
       }
    }
 
+   // the state shared by the outstanding queries of a prefetch
+   struct PrefetchContext
+   {
+      PrefetchContext( PrefetchStats &s, unsigned int maxconcur )
+         : stats( s ), sem( maxconcur )
+      {
+      }
+
+      PrefetchStats &stats;
+      ESemaphorePrivate sem;
+   };
+
+   struct PrefetchItem
+   {
+      PrefetchContext *ctx;
+      size_t idx;
+   };
+
+   Void Cache::prefetch( const PrefetchList &items, PrefetchStats &stats, unsigned int maxconcur, bool ignorecache )
+   {
+      if ( maxconcur == 0 )
+         maxconcur = m_concur;
+
+      PrefetchContext ctx( stats, maxconcur );
+      std::vector<PrefetchItem> pis( items.size() );
+
+      stats.m_outcomes.assign( items.size(), PrefetchStats::poPending );
+      stats.m_errmsgs.assign( items.size(), EString() );
+
+      for (size_t idx = 0; idx < items.size(); idx++)
+      {
+         pis[idx].ctx = &ctx;
+         pis[idx].idx = idx;
+
+         // wait for an open slot, the callback releases it
+         ctx.sem.Decrement();
+         query( items[idx].first, items[idx].second, prefetch_callback, &pis[idx], ignorecache );
+      }
+
+      // wait for the outstanding queries to complete
+      for (unsigned int i = 0; i < maxconcur; i++)
+         ctx.sem.Decrement();
+
+      stats.m_cachehits = stats.m_resolved = stats.m_negative = stats.m_errors = 0;
+      for (std::vector<PrefetchStats::Outcome>::const_iterator it = stats.m_outcomes.begin(); it != stats.m_outcomes.end(); ++it)
+      {
+         switch ( *it )
+         {
+            case PrefetchStats::poCacheHit:  stats.m_cachehits++; break;
+            case PrefetchStats::poResolved:  stats.m_resolved++;  break;
+            case PrefetchStats::poNegative:  stats.m_negative++;  break;
+            case PrefetchStats::poError:     stats.m_errors++;    break;
+            default:                                              break;
+         }
+      }
+   }
+
+   Void Cache::prefetch_callback( QueryPtr q, bool cacheHit, const Void *data )
+   {
+      const PrefetchItem *pi = (const PrefetchItem*)data;
+      PrefetchStats &stats = pi->ctx->stats;
+
+      if ( q->getError() )
+      {
+         stats.m_outcomes[pi->idx] = PrefetchStats::poError;
+         stats.m_errmsgs[pi->idx] = q->getErrorMsg();
+      }
+      else if ( q->isNegative() )
+      {
+         // negative whether it was cached or resolved
+         stats.m_outcomes[pi->idx] = PrefetchStats::poNegative;
+      }
+      else if ( cacheHit )
+      {
+         stats.m_outcomes[pi->idx] = PrefetchStats::poCacheHit;
+      }
+      else
+      {
+         stats.m_outcomes[pi->idx] = PrefetchStats::poResolved;
+      }
+
+      pi->ctx->sem.Increment();
+   }
+
+   struct AddressBatch;
+
+   // the answers for one host of a resolveAddresses batch
+   struct AddressSlot
+   {
+      AddressSlot() : batch( NULL ), done4( false ), done6( false ), first( AF_UNSPEC ), graceStarted( false ) {}
+
+      AddressBatch *batch;
+      QueryPtr ipv4;
+      QueryPtr ipv6;
+      bool done4;
+      bool done6;
+      int first;
+      ETimer grace;
+      bool graceStarted;
+   };
+
+   // the state shared by the caller and the queries of resolveAddresses, one
+   // allocation and one event serve the whole batch, the last one to finish
+   // deletes it since a query can complete after resolveAddresses has returned
+   struct AddressBatch
+   {
+      AddressBatch( size_t count ) : slots( count ), ref( count * 2 + 1 )
+      {
+         for (size_t i = 0; i < count; i++)
+            slots[i].batch = this;
+      }
+
+      Void release()
+      {
+         if ( atomic_dec_fetch( ref ) == 0 )
+            delete this;
+      }
+
+      EMutexPrivate mutex;
+      EEvent event;
+      std::vector<AddressSlot> slots;
+      long ref;
+   };
+
+   Void Cache::resolveAddresses( const std::string &host, AddressResult &result, int preferred )
+   {
+      resolveAddresses( &host, &result, 1, preferred );
+   }
+
+   Void Cache::resolveAddresses( const std::vector<std::string> &hosts, AddressResultList &results, int preferred )
+   {
+      results.clear();
+      results.resize( hosts.size() );
+      if ( !hosts.empty() )
+         resolveAddresses( &hosts[0], &results[0], hosts.size(), preferred );
+   }
+
+   Void Cache::resolveAddresses( const std::string *hosts, AddressResult *results, size_t count, int preferred )
+   {
+      AddressBatch *batch = new AddressBatch( count );
+
+      // issue every query before waiting, the callbacks are called
+      // immediately for cache hits
+      for (size_t i = 0; i < count; i++)
+      {
+         query( ns_t_a, hosts[i], address_callback, &batch->slots[i] );
+         query( ns_t_aaaa, hosts[i], address_callback, &batch->slots[i] );
+      }
+
+      while ( true )
+      {
+         int timeout = -1;
+         bool waiting = false;
+         {
+            EMutexLock l( batch->mutex );
+
+            for (std::vector<AddressSlot>::iterator it = batch->slots.begin(); it != batch->slots.end(); ++it)
+            {
+               // without a preferred family both have to answer
+               if ( preferred == AF_UNSPEC )
+               {
+                  if ( !it->done4 || !it->done6 )
+                     waiting = true;
+                  continue;
+               }
+
+               bool prefDone = preferred == AF_INET ? it->done4 : it->done6;
+               bool otherDone = preferred == AF_INET ? it->done6 : it->done4;
+
+               // the preferred family has addresses or both have answered
+               if ( prefDone && ( it->first == preferred || otherDone ) )
+                  continue;
+
+               // only the other family has addresses, wait for the grace period
+               if ( !prefDone && it->first != AF_UNSPEC )
+               {
+                  if ( !it->graceStarted )
+                  {
+                     it->grace.Start();
+                     it->graceStarted = true;
+                  }
+                  int remaining = m_addressgrace - it->grace.MilliSeconds();
+                  if ( remaining <= 0 )
+                     continue;
+                  if ( timeout < 0 || remaining < timeout )
+                     timeout = remaining;
+               }
+
+               waiting = true;
+            }
+
+            if ( !waiting )
+               break;
+
+            batch->event.reset();
+         }
+
+         batch->event.wait( timeout );
+      }
+
+      {
+         EMutexLock l( batch->mutex );
+         for (size_t i = 0; i < count; i++)
+         {
+            results[i].m_ipv4 = batch->slots[i].ipv4;
+            results[i].m_ipv6 = batch->slots[i].ipv6;
+            results[i].m_first = batch->slots[i].first;
+         }
+      }
+
+      batch->release();
+   }
+
+   Void Cache::address_callback( QueryPtr q, bool cacheHit, const Void *data )
+   {
+      AddressSlot *slot = (AddressSlot*)data;
+      AddressBatch *batch = slot->batch;
+
+      {
+         EMutexLock l( batch->mutex );
+
+         bool hasAddresses = !q->getError() && !q->getAnswers().empty();
+         if ( q->getType() == ns_t_a )
+         {
+            slot->ipv4 = q;
+            slot->done4 = true;
+            if ( hasAddresses && slot->first == AF_UNSPEC )
+               slot->first = AF_INET;
+         }
+         else
+         {
+            slot->ipv6 = q;
+            slot->done6 = true;
+            if ( hasAddresses && slot->first == AF_UNSPEC )
+               slot->first = AF_INET6;
+         }
+
+         batch->event.set();
+      }
+
+      batch->release();
+   }
+
    Void Cache::loadQueries(const char *qfn)
    {
       m_refresher.loadQueries( qfn );
    }
 
-   Void Cache::initSaveQueries(const char *qfn, long qsf)
+   Void Cache::initSaveQueries(const char *qfn, long qsf, bool snapshot)
    {
-      m_refresher.initSaveQueries( qfn, qsf );
+      m_refresher.initSaveQueries( qfn, qsf, snapshot );
    }
 
    Void Cache::saveQueries()
@@ -516,17 +821,60 @@ namespace DNS
       m_refresher.forceRefresh();
    }
 
-   QueryPtr Cache::lookupQuery( ns_type rtype, const std::string &domain )
+   QueryPtr Cache::lookupQuery( ns_type rtype, const std::string &domain, bool ignorecache )
    {
       QueryCacheKey qck( rtype, domain );
-      return lookupQuery( qck );
+      return lookupQuery( qck, ignorecache );
    }
 
-   QueryPtr Cache::lookupQuery( QueryCacheKey &qck )
+   QueryPtr Cache::lookupQuery( QueryCacheKey &qck, bool ignorecache )
    {
       ERDLock l( m_cacherwlock );
       QueryCache::const_iterator it = m_cache.find( qck );
-      return it != m_cache.end() ? it->second : QueryPtr();
+      if ( it == m_cache.end() )
+         return QueryPtr();
+      // refreshes are not hits
+      if ( !ignorecache )
+         it->second->incHits();
+      return it->second;
+   }
+
+   Void Cache::countLookup( QueryPtr &q, bool cacheHit, bool ignorecache )
+   {
+      // refreshes are not lookups
+      if ( ignorecache )
+         return;
+
+      if ( cacheHit )
+         atomic_inc( m_stats.m_hits );
+      else if ( q )
+         atomic_inc( m_stats.m_stalehits );
+      else
+         atomic_inc( m_stats.m_misses );
+   }
+
+   CacheStats Cache::getStats()
+   {
+      CacheStats stats( m_stats );
+
+      stats.m_inflight = m_qp.getQueryProcessorThread()->getActiveQueries();
+      stats.m_refreshbacklog = m_refresher.getBacklog();
+
+      ERDLock l( m_cacherwlock );
+      stats.m_entries = m_cache.size();
+      stats.m_bytes = m_bytes;
+
+      return stats;
+   }
+
+   QueryPtr Cache::lookupZone( ns_type rtype, const std::string &domain )
+   {
+      QueryCacheKey qck( rtype, domain );
+      ERDLock l( m_zonerwlock );
+      if ( m_zone.empty() )
+         return QueryPtr();
+      QueryCache::const_iterator it = m_zone.find( qck );
+      return it != m_zone.end() ? it->second : QueryPtr();
    }
 
    Void Cache::updateCache( QueryPtr q )
@@ -538,12 +886,62 @@ namespace DNS
       {
          QueryCacheKey qck( q->getType(), q->getDomain() );
          EWRLock l( m_cacherwlock );
-         if ( m_cache.find(qck) == m_cache.end() )
+         QueryCache::iterator it = m_cache.find( qck );
+         if ( it == m_cache.end() )
+         {
             atomic_inc_fetch( m_newquerycnt );
-         m_cache[qck] = q;
+            m_cache[qck] = q;
+         }
+         else
+         {
+            // the refreshed entry keeps the hits of the entry it replaces
+            // so that CLOCK and the refresh threshold still see it as in use
+            q->m_hits = it->second->getHits();
+            m_bytes -= it->second->getMemoryUsage();
+            it->second = q;
+         }
+         m_bytes += q->getMemoryUsage();
+
+         if ( overBudget() )
+            evictEntries( q );
       }
    }
 
+   bool Cache::overBudget()
+   {
+      return
+         ( m_maxentries > 0 && m_cache.size() > m_maxentries ) ||
+         ( m_maxbytes > 0 && m_bytes > m_maxbytes );
+   }
+
+   Void Cache::evictEntries( QueryPtr &keep )
+   {
+      // CLOCK sweep resuming at the hand, called with the write lock held.
+      // Expired entries and entries without hits since the hand last passed
+      // are evicted, the hits of the remaining entries are halved.
+      QueryCache::iterator it = m_cache.lower_bound( m_hand );
+
+      while ( overBudget() && m_cache.size() > 1 )
+      {
+         if ( it == m_cache.end() )
+            it = m_cache.begin();
+
+         if ( it->second != keep && ( it->second->isExpired() || it->second->getHits() == 0 ) )
+         {
+            m_bytes -= it->second->getMemoryUsage();
+            it = m_cache.erase( it );
+            atomic_inc( m_stats.m_evictions );
+         }
+         else
+         {
+            it->second->decayHits();
+            ++it;
+         }
+      }
+
+      m_hand = it != m_cache.end() ? it->first : QueryCacheKey( ns_t_invalid, "" );
+   }
+
    Void Cache::identifyExpired( std::list<QueryCacheKey> &keys, int percent )
    {
       ERDLock l( m_cacherwlock );
@@ -553,6 +951,11 @@ namespace DNS
          QueryPtr q = val.second;
          if ( q )
          {
+            // only refresh the entries that were used since the previous
+            // check, the hits are counted again for the next interval
+            if ( m_refreshminhits > 0 && q->resetHits() < m_refreshminhits )
+               continue;
+
             if ( !q->isExpired() )
             {
                time_t diff = (q->getTTL() - (q->getExpires() - time(NULL))) * 100;
@@ -573,6 +976,664 @@ namespace DNS
          keys.push_back( val.first );
    }
 
+   Void Cache::getCacheQueries( std::list<QueryPtr> &queries )
+   {
+      ERDLock l( m_cacherwlock );
+
+      for (auto val : m_cache )
+         queries.push_back( val.second );
+   }
+
+   ////////////////////////////////////////////////////////////////////////////////
+   ////////////////////////////////////////////////////////////////////////////////
+
+   // parses a master file subset: $ORIGIN, $TTL and single line NAPTR, SRV,
+   // A and AAAA records with an optional TTL and class
+   class ZoneLoader
+   {
+   public:
+      ZoneLoader( const char *zfn )
+         : m_zfn( zfn ),
+           m_line( 0 ),
+           m_ttl( 3600 )
+      {
+      }
+
+      Void load();
+      Void buildQueries( QueryCache &zone );
+
+   private:
+      struct ZoneRecord
+      {
+         EString name;
+         ns_type type;
+         int32_t ttl;
+         std::vector<EString> rdata;
+         // the SRV priority, weight and port or the NAPTR order and preference
+         uint16_t values[3];
+         union
+         {
+            struct in_addr v4;
+            struct in6_addr v6;
+         } address;
+      };
+
+      typedef std::multimap<EString,ZoneRecord*> ZoneRecordMap;
+
+      Void parseLine( const std::string &line );
+      Void tokenize( const std::string &line, std::vector<EString> &tokens );
+      EString absoluteName( const EString &name );
+      long toNumber( const EString &val, long max, const char *what );
+      ResourceRecord *createRecord( Arena &arena, const ZoneRecord &zr );
+      Void addAdditional( QueryPtr &q, const std::string &name, ns_type rtype );
+      Void error( const char *msg );
+
+      EString m_zfn;
+      int m_line;
+      int32_t m_ttl;
+      EString m_origin;
+      EString m_owner;
+      std::list<ZoneRecord> m_records;
+      ZoneRecordMap m_names;
+   };
+
+   Void ZoneLoader::error( const char *msg )
+   {
+      EString err;
+      err.format( "ZoneLoader::load() - %s at line %d [%s]", msg, m_line, m_zfn.c_str() );
+      throw EError( EError::Warning, err );
+   }
+
+   Void ZoneLoader::load()
+   {
+      std::ifstream zf( m_zfn );
+      std::string line;
+
+      if ( !zf.is_open() )
+      {
+         EString msg;
+         msg.format( "ZoneLoader::load() - unable to open [%s]", m_zfn.c_str() );
+         throw EError( EError::Warning, msg );
+      }
+
+      while ( std::getline( zf, line ) )
+      {
+         m_line++;
+         parseLine( line );
+      }
+
+      for (std::list<ZoneRecord>::iterator it = m_records.begin(); it != m_records.end(); ++it)
+         m_names.insert( std::make_pair( it->name, &*it ) );
+   }
+
+   Void ZoneLoader::tokenize( const std::string &line, std::vector<EString> &tokens )
+   {
+      size_t pos = 0;
+
+      while ( pos < line.size() )
+      {
+         if ( isspace( line[pos] ) )
+         {
+            pos++;
+         }
+         else if ( line[pos] == ';' )
+         {
+            break;
+         }
+         else if ( line[pos] == '"' )
+         {
+            size_t end = line.find( '"', pos + 1 );
+            if ( end == std::string::npos )
+               error( "unterminated quoted string" );
+            tokens.push_back( line.substr( pos + 1, end - pos - 1 ) );
+            pos = end + 1;
+         }
+         else
+         {
+            size_t end = pos;
+            while ( end < line.size() && !isspace( line[end] ) && line[end] != ';' )
+               end++;
+            tokens.push_back( line.substr( pos, end - pos ) );
+            pos = end;
+         }
+      }
+   }
+
+   EString ZoneLoader::absoluteName( const EString &name )
+   {
+      if ( name == "@" )
+         return m_origin;
+      if ( !name.empty() && name[name.size() - 1] == '.' )
+         return name.substr( 0, name.size() - 1 );
+      if ( m_origin.empty() )
+         return name;
+      return name + "." + m_origin;
+   }
+
+   long ZoneLoader::toNumber( const EString &val, long max, const char *what )
+   {
+      char *end;
+      errno = 0;
+      long num = strtol( val.c_str(), &end, 10 );
+
+      if ( val.empty() || *end != '\0' || errno == ERANGE || num < 0 || num > max )
+      {
+         EString msg;
+         msg.format( "invalid %s [%s]", what, val.c_str() );
+         error( msg.c_str() );
+      }
+
+      return num;
+   }
+
+   Void ZoneLoader::parseLine( const std::string &line )
+   {
+      std::vector<EString> tokens;
+      size_t idx = 0;
+
+      tokenize( line, tokens );
+      if ( tokens.empty() )
+         return;
+
+      if ( tokens[0] == "$ORIGIN" )
+      {
+         if ( tokens.size() < 2 )
+            error( "missing $ORIGIN value" );
+         m_origin = "";
+         m_origin = absoluteName( tokens[1] );
+         return;
+      }
+
+      if ( tokens[0] == "$TTL" )
+      {
+         if ( tokens.size() < 2 )
+            error( "missing $TTL value" );
+         m_ttl = toNumber( tokens[1], INT32_MAX, "$TTL" );
+         return;
+      }
+
+      ZoneRecord zr;
+
+      // a line starting with whitespace belongs to the previous owner
+      if ( !isspace( line[0] ) )
+         m_owner = absoluteName( tokens[idx++] );
+      else if ( m_owner.empty() )
+         error( "missing owner name" );
+
+      zr.name = m_owner;
+      zr.ttl = m_ttl;
+
+      if ( idx < tokens.size() && isdigit( tokens[idx][0] ) )
+         zr.ttl = toNumber( tokens[idx++], INT32_MAX, "TTL" );
+      if ( idx < tokens.size() && strcasecmp( tokens[idx].c_str(), "IN" ) == 0 )
+         idx++;
+      if ( idx >= tokens.size() )
+         error( "missing record type" );
+
+      const char *type = tokens[idx++].c_str();
+
+      zr.type =
+         strcasecmp( type, "A" ) == 0     ? ns_t_a     :
+         strcasecmp( type, "AAAA" ) == 0  ? ns_t_aaaa  :
+         strcasecmp( type, "SRV" ) == 0   ? ns_t_srv   :
+         strcasecmp( type, "NAPTR" ) == 0 ? ns_t_naptr : ns_t_invalid;
+
+      // other record types are not served from the zone
+      if ( zr.type == ns_t_invalid )
+         return;
+
+      size_t rdcnt =
+         zr.type == ns_t_srv   ? 4 :
+         zr.type == ns_t_naptr ? 6 : 1;
+
+      if ( tokens.size() - idx != rdcnt )
+         error( "invalid record data" );
+
+      zr.rdata.assign( tokens.begin() + idx, tokens.end() );
+
+      switch ( zr.type )
+      {
+         case ns_t_a:
+         {
+            if ( inet_pton( AF_INET, zr.rdata[0].c_str(), &zr.address.v4 ) != 1 )
+               error( "invalid IPv4 address" );
+            break;
+         }
+         case ns_t_aaaa:
+         {
+            if ( inet_pton( AF_INET6, zr.rdata[0].c_str(), &zr.address.v6 ) != 1 )
+               error( "invalid IPv6 address" );
+            break;
+         }
+         case ns_t_srv:
+         {
+            zr.values[0] = toNumber( zr.rdata[0], UINT16_MAX, "SRV priority" );
+            zr.values[1] = toNumber( zr.rdata[1], UINT16_MAX, "SRV weight" );
+            zr.values[2] = toNumber( zr.rdata[2], UINT16_MAX, "SRV port" );
+            // the SRV target is a domain name
+            zr.rdata[3] = absoluteName( zr.rdata[3] );
+            break;
+         }
+         case ns_t_naptr:
+         {
+            zr.values[0] = toNumber( zr.rdata[0], UINT16_MAX, "NAPTR order" );
+            zr.values[1] = toNumber( zr.rdata[1], UINT16_MAX, "NAPTR preference" );
+            // the NAPTR replacement is a domain name
+            if ( zr.rdata[5] != "." )
+               zr.rdata[5] = absoluteName( zr.rdata[5] );
+            break;
+         }
+         default:
+         {
+            break;
+         }
+      }
+
+      m_records.push_back( zr );
+   }
+
+   ResourceRecord *ZoneLoader::createRecord( Arena &arena, const ZoneRecord &zr )
+   {
+      switch ( zr.type )
+      {
+         case ns_t_a:
+         {
+            return new (arena) RRecordA( Name( arena, zr.name ), zr.ttl, zr.address.v4 );
+         }
+         case ns_t_aaaa:
+         {
+            return new (arena) RRecordAAAA( Name( arena, zr.name ), zr.ttl, zr.address.v6 );
+         }
+         case ns_t_srv:
+         {
+            return new (arena) RRecordSRV( Name( arena, zr.name ), zr.ttl,
+               zr.values[0], zr.values[1], zr.values[2], Name( arena, zr.rdata[3] ) );
+         }
+         case ns_t_naptr:
+         {
+            return new (arena) RRecordNAPTR( Name( arena, zr.name ), zr.ttl, zr.values[0], zr.values[1],
+               Name( arena, zr.rdata[2] ), Name( arena, zr.rdata[3] ), Name( arena, zr.rdata[4] ), Name( arena, zr.rdata[5] ) );
+         }
+         default:
+         {
+            return NULL;
+         }
+      }
+   }
+
+   Void ZoneLoader::addAdditional( QueryPtr &q, const std::string &name, ns_type rtype )
+   {
+      std::pair<ZoneRecordMap::const_iterator,ZoneRecordMap::const_iterator> range = m_names.equal_range( name );
+
+      for (ZoneRecordMap::const_iterator it = range.first; it != range.second; ++it)
+      {
+         const ZoneRecord &zr = *it->second;
+
+         if ( zr.type == ns_t_srv && rtype == ns_t_srv )
+         {
+            q->addAdditional( createRecord( q->getArena(), zr ) );
+            addAdditional( q, zr.rdata[3], ns_t_a );
+         }
+         else if ( (zr.type == ns_t_a || zr.type == ns_t_aaaa) && rtype == ns_t_a )
+         {
+            q->addAdditional( createRecord( q->getArena(), zr ) );
+         }
+      }
+   }
+
+   Void ZoneLoader::buildQueries( QueryCache &zone )
+   {
+      for (std::list<ZoneRecord>::const_iterator it = m_records.begin(); it != m_records.end(); ++it)
+      {
+         QueryCacheKey qck( it->type, it->name );
+         if ( zone.find( qck ) != zone.end() )
+            continue;
+
+         QueryPtr q( new Query( it->type, it->name ) );
+         q->addQuestion( new (q->getArena()) Question( Name( q->getArena(), it->name ), it->type, ns_c_in ) );
+
+         // the answers are all of the records with the same name and type
+         std::pair<ZoneRecordMap::const_iterator,ZoneRecordMap::const_iterator> range = m_names.equal_range( it->name );
+         for (ZoneRecordMap::const_iterator rit = range.first; rit != range.second; ++rit)
+         {
+            if ( rit->second->type == it->type )
+               q->addAnswer( createRecord( q->getArena(), *rit->second ) );
+         }
+
+         // add the records that a server would return as additional records
+         for (ResourceRecordList::const_iterator rit = q->getAnswers().begin(); rit != q->getAnswers().end(); ++rit)
+         {
+            if ( (*rit)->getType() == ns_t_naptr )
+            {
+               RRecordNAPTR *naptr = (RRecordNAPTR*)*rit;
+               addAdditional( q, naptr->getReplacement(),
+                  strcasecmp( naptr->getFlags().c_str(), "s" ) == 0 ? ns_t_srv : ns_t_a );
+            }
+            else if ( (*rit)->getType() == ns_t_srv )
+            {
+               addAdditional( q, ((RRecordSRV*)*rit)->getTarget(), ns_t_a );
+            }
+         }
+
+         zone[qck] = q;
+      }
+   }
+
+   Void Cache::loadZone( const char *zfn )
+   {
+      ZoneLoader zl( zfn );
+      QueryCache zone;
+
+      zl.load();
+      zl.buildQueries( zone );
+
+      EWRLock l( m_zonerwlock );
+      m_zone.swap( zone );
+   }
+
+   Void Cache::clearZone()
+   {
+      QueryCache zone;
+      EWRLock l( m_zonerwlock );
+      m_zone.swap( zone );
+   }
+
+   ////////////////////////////////////////////////////////////////////////////////
+   ////////////////////////////////////////////////////////////////////////////////
+
+   class SnapshotWriter
+   {
+   public:
+      SnapshotWriter() {}
+
+      std::string &getData() { return m_data; }
+
+      Void putUInt8( uint8_t val ) { m_data.append( (const char *)&val, sizeof(val) ); }
+      Void putUInt16( uint16_t val ) { m_data.append( (const char *)&val, sizeof(val) ); }
+      Void putUInt32( uint32_t val ) { m_data.append( (const char *)&val, sizeof(val) ); }
+      Void putInt64( int64_t val ) { m_data.append( (const char *)&val, sizeof(val) ); }
+      Void putBytes( const Void *val, size_t len ) { m_data.append( (const char *)val, len ); }
+
+      Void putString( const std::string &val )
+      {
+         putUInt16( (uint16_t)val.size() );
+         m_data.append( val );
+      }
+
+      Void putString( const Name &val )
+      {
+         putUInt16( (uint16_t)val.size() );
+         m_data.append( val.data(), val.size() );
+      }
+
+      Void putRecord( ResourceRecord *rr )
+      {
+         putUInt16( (uint16_t)rr->getType() );
+         putUInt16( (uint16_t)rr->getClass() );
+         putInt64( (int64_t)rr->getExpires() );
+         putString( rr->getName() );
+
+         switch ( rr->getType() )
+         {
+            case ns_t_a:
+            {
+               putBytes( &((RRecordA*)rr)->getAddress(), sizeof(struct in_addr) );
+               break;
+            }
+            case ns_t_aaaa:
+            {
+               putBytes( &((RRecordAAAA*)rr)->getAddress(), sizeof(struct in6_addr) );
+               break;
+            }
+            case ns_t_ns:
+            {
+               putString( ((RRecordNS*)rr)->getNamedServer() );
+               break;
+            }
+            case ns_t_cname:
+            {
+               putString( ((RRecordCNAME*)rr)->getAlias() );
+               break;
+            }
+            case ns_t_soa:
+            {
+               RRecordSOA *soa = (RRecordSOA*)rr;
+               putString( soa->getMName() );
+               putString( soa->getRName() );
+               putUInt32( soa->getSerial() );
+               putUInt32( soa->getRefresh() );
+               putUInt32( soa->getRetry() );
+               putUInt32( soa->getExpire() );
+               putUInt32( soa->getMinimum() );
+               break;
+            }
+            case ns_t_srv:
+            {
+               RRecordSRV *srv = (RRecordSRV*)rr;
+               putUInt16( srv->getPriority() );
+               putUInt16( srv->getWeight() );
+               putUInt16( srv->getPort() );
+               putString( srv->getTarget() );
+               break;
+            }
+            case ns_t_naptr:
+            {
+               RRecordNAPTR *naptr = (RRecordNAPTR*)rr;
+               putUInt16( naptr->getOrder() );
+               putUInt16( naptr->getPreference() );
+               putString( naptr->getFlags() );
+               putString( naptr->getService() );
+               putString( naptr->getRegexp() );
+               putString( naptr->getReplacement() );
+               break;
+            }
+            default:
+            {
+               break;
+            }
+         }
+      }
+
+      Void putRecords( const ResourceRecordList &rrl )
+      {
+         putUInt16( (uint16_t)rrl.size() );
+         for (auto rr : rrl)
+            putRecord( rr );
+      }
+
+      Void putQuery( QueryPtr &q )
+      {
+         putUInt16( (uint16_t)q->getType() );
+         putUInt8( q->isNegative() ? 1 : 0 );
+         putInt64( (int64_t)q->getExpires() );
+         putString( q->getDomain() );
+
+         putUInt16( (uint16_t)q->getQuestions().size() );
+         for (auto qu : q->getQuestions())
+         {
+            putString( qu->getQName() );
+            putUInt16( (uint16_t)qu->getQType() );
+            putUInt16( (uint16_t)qu->getQClass() );
+         }
+
+         putRecords( q->getAnswers() );
+         putRecords( q->getAuthorities() );
+         putRecords( q->getAdditional() );
+      }
+
+   private:
+      std::string m_data;
+   };
+
+   class SnapshotReader
+   {
+   public:
+      SnapshotReader( const unsigned char *data, size_t len, time_t now )
+         : m_data( data ),
+           m_len( len ),
+           m_ofs( 0 ),
+           m_now( now )
+      {
+      }
+
+      bool isEOF() { return m_ofs >= m_len; }
+
+      uint8_t getUInt8() { uint8_t val; getBytes( &val, sizeof(val) ); return val; }
+      uint16_t getUInt16() { uint16_t val; getBytes( &val, sizeof(val) ); return val; }
+      uint32_t getUInt32() { uint32_t val; getBytes( &val, sizeof(val) ); return val; }
+      int64_t getInt64() { int64_t val; getBytes( &val, sizeof(val) ); return val; }
+
+      Void getBytes( Void *val, size_t len )
+      {
+         memcpy( val, advance(len), len );
+      }
+
+      Void getString( EString &val )
+      {
+         uint16_t len = getUInt16();
+         val.assign( (const char *)advance(len), len );
+      }
+
+      Void getString( Arena &arena, Name &val )
+      {
+         uint16_t len = getUInt16();
+         val = Name( arena, (const char *)advance(len), len );
+      }
+
+      ResourceRecord *getRecord( Arena &arena )
+      {
+         Name name;
+         ns_type rtype = (ns_type)getUInt16();
+         ns_class rclass = (ns_class)getUInt16();
+         int32_t ttl = remaining( getInt64() );
+         getString( arena, name );
+
+         switch ( rtype )
+         {
+            case ns_t_a:
+            {
+               struct in_addr address;
+               getBytes( &address, sizeof(address) );
+               return new (arena) RRecordA( name, ttl, address );
+            }
+            case ns_t_aaaa:
+            {
+               struct in6_addr address;
+               getBytes( &address, sizeof(address) );
+               return new (arena) RRecordAAAA( name, ttl, address );
+            }
+            case ns_t_ns:
+            {
+               Name ns;
+               getString( arena, ns );
+               return new (arena) RRecordNS( name, ttl, ns );
+            }
+            case ns_t_cname:
+            {
+               Name alias;
+               getString( arena, alias );
+               return new (arena) RRecordCNAME( name, ttl, alias );
+            }
+            case ns_t_soa:
+            {
+               Name mname, rname;
+               getString( arena, mname );
+               getString( arena, rname );
+               uint32_t serial = getUInt32();
+               uint32_t refresh = getUInt32();
+               uint32_t retry = getUInt32();
+               uint32_t expire = getUInt32();
+               uint32_t minimum = getUInt32();
+               return new (arena) RRecordSOA( name, ttl, mname, rname, serial, refresh, retry, expire, minimum );
+            }
+            case ns_t_srv:
+            {
+               Name target;
+               uint16_t priority = getUInt16();
+               uint16_t weight = getUInt16();
+               uint16_t port = getUInt16();
+               getString( arena, target );
+               return new (arena) RRecordSRV( name, ttl, priority, weight, port, target );
+            }
+            case ns_t_naptr:
+            {
+               Name flags, service, regexp, replacement;
+               uint16_t order = getUInt16();
+               uint16_t preference = getUInt16();
+               getString( arena, flags );
+               getString( arena, service );
+               getString( arena, regexp );
+               getString( arena, replacement );
+               return new (arena) RRecordNAPTR( name, ttl, order, preference, flags, service, regexp, replacement );
+            }
+            default:
+            {
+               return new (arena) ResourceRecord( name, rtype, rclass, ttl );
+            }
+         }
+      }
+
+      QueryPtr getQuery( bool &expired )
+      {
+         EString domain;
+         ns_type rtype = (ns_type)getUInt16();
+         bool negative = getUInt8() != 0;
+         int64_t expires = getInt64();
+         getString( domain );
+
+         QueryPtr q( new Query( rtype, domain ) );
+
+         uint16_t cnt = getUInt16();
+         for (uint16_t i = 0; i < cnt; i++)
+         {
+            Name qname;
+            getString( q->getArena(), qname );
+            ns_type qtype = (ns_type)getUInt16();
+            ns_class qclass = (ns_class)getUInt16();
+            q->addQuestion( new (q->getArena()) Question( qname, qtype, qclass ) );
+         }
+
+         cnt = getUInt16();
+         for (uint16_t i = 0; i < cnt; i++)
+            q->addAnswer( getRecord(q->getArena()) );
+         cnt = getUInt16();
+         for (uint16_t i = 0; i < cnt; i++)
+            q->addAuthority( getRecord(q->getArena()) );
+         cnt = getUInt16();
+         for (uint16_t i = 0; i < cnt; i++)
+            q->addAdditional( getRecord(q->getArena()) );
+
+         if ( negative )
+            q->setNegative( remaining(expires) );
+
+         expired = expires <= m_now;
+
+         return q;
+      }
+
+   private:
+      SnapshotReader();
+
+      const unsigned char *advance( size_t len )
+      {
+         if ( len > m_len - m_ofs )
+            throw EError( EError::Warning, "SnapshotReader::advance() - snapshot is truncated" );
+         const unsigned char *p = m_data + m_ofs;
+         m_ofs += len;
+         return p;
+      }
+
+      int32_t remaining( int64_t expires )
+      {
+         return expires > m_now ? (int32_t)std::min( expires - m_now, (int64_t)INT32_MAX ) : 0;
+      }
+
+      const unsigned char *m_data;
+      size_t m_len;
+      size_t m_ofs;
+      time_t m_now;
+   };
+
    ////////////////////////////////////////////////////////////////////////////////
    ////////////////////////////////////////////////////////////////////////////////
 
@@ -584,11 +1645,14 @@ namespace DNS
    CacheRefresher::CacheRefresher(Cache &cache, unsigned int maxconcur, int percent, long interval)
       : m_cache( cache ),
         m_sem( maxconcur ),
+        m_maxconcur( maxconcur ),
+        m_backlog( 0 ),
         m_percent( percent ),
         m_interval( interval ),
         m_running( false ),
         m_qfn( "" ),
-        m_qsf( 0 )
+        m_qsf( 0 ),
+        m_snapshot( false )
    {
    }
 
@@ -619,10 +1683,11 @@ namespace DNS
       ths->m_sem.Increment();
    }
 
-   Void CacheRefresher::initSaveQueries(const char *qfn, long qsf)
+   Void CacheRefresher::initSaveQueries(const char *qfn, long qsf, bool snapshot)
    {
       m_qfn = qfn;
       m_qsf = qsf;
+      m_snapshot = snapshot;
 
       if (querySaveFrequency() > 0 && !queryFileName().empty())
       {
@@ -655,11 +1720,13 @@ namespace DNS
    Void CacheRefresher::_submitQueries( std::list<QueryCacheKey> &keys )
    {
       m_running = true;
+      m_backlog = keys.size();
 
       for (auto qck : keys)
       {
          m_sem.Decrement();
          m_cache.query( qck.getType(), qck.getDomain(), callback, this, true );
+         atomic_dec( m_backlog );
       }
 
       m_running = false;
@@ -679,6 +1746,14 @@ namespace DNS
 
    Void CacheRefresher::_saveQueries()
    {
+      if ( m_snapshot )
+      {
+         // the remaining TTL's change even if no new queries were added
+         m_cache.resetNewQueryCount();
+         _saveSnapshot();
+         return;
+      }
+
       long nqc = m_cache.resetNewQueryCount();
       if ( nqc == 0 )
       {
@@ -714,12 +1789,138 @@ namespace DNS
       }
    }
 
+   Void CacheRefresher::_saveSnapshot()
+   {
+      std::list<QueryPtr> queries;
+      SnapshotWriter sw;
+
+      m_cache.getCacheQueries( queries );
+
+      sw.putUInt32( SNAPSHOT_MAGIC );
+      sw.putUInt16( SNAPSHOT_VERSION );
+      sw.putUInt16( 0 );
+      sw.putInt64( (int64_t)time(NULL) );
+      sw.putUInt32( (uint32_t)queries.size() );
+
+      for (auto q : queries)
+         sw.putQuery( q );
+
+      // write to a temporary file and rename it so that readers never see a partial snapshot
+      EString tmp;
+      tmp.format( "%s.tmp", queryFileName().c_str() );
+
+      int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+      if ( fd == -1 )
+         return;
+
+      const char *p = sw.getData().data();
+      size_t len = sw.getData().size();
+      while ( len > 0 )
+      {
+         ssize_t written = write( fd, p, len );
+         if ( written < 0 )
+         {
+            if ( errno == EINTR )
+               continue;
+            break;
+         }
+         p += written;
+         len -= written;
+      }
+
+      bool ok = len == 0 && fsync( fd ) == 0;
+      close( fd );
+
+      if ( ok )
+         rename( tmp.c_str(), queryFileName().c_str() );
+      else
+         unlink( tmp.c_str() );
+   }
+
+   Void CacheRefresher::_loadSnapshot(const char *qfn, const unsigned char *data, size_t len)
+   {
+      SnapshotReader sr( data, len, time(NULL) );
+
+      if ( sr.getUInt32() != SNAPSHOT_MAGIC )
+      {
+         EString msg;
+         msg.format( "CacheRefresher::loadQueries() - invalid snapshot header [%s]", qfn );
+         throw EError( EError::Warning, msg );
+      }
+
+      uint16_t version = sr.getUInt16();
+      if ( version != SNAPSHOT_VERSION )
+      {
+         EString msg;
+         msg.format( "CacheRefresher::loadQueries() - unsupported snapshot version %u [%s]", version, qfn );
+         throw EError( EError::Warning, msg );
+      }
+
+      sr.getUInt16(); // reserved
+      sr.getInt64();  // created
+      uint32_t cnt = sr.getUInt32();
+
+      for (uint32_t i = 0; i < cnt; i++)
+      {
+         bool expired = false;
+         QueryPtr q = sr.getQuery( expired );
+
+         if ( expired )
+         {
+            // the saved answer is stale, so resolve it again
+            m_sem.Decrement();
+            m_cache.query( q->getType(), q->getDomain(), callback, this );
+         }
+         else
+         {
+            m_cache.updateCache( q );
+         }
+      }
+   }
+
    Void CacheRefresher::loadQueries(const char *qfn)
    {
       Document doc;
       FILE *fp;
       char buf[65536];
 
+      // check for a binary snapshot
+      int fd = open( qfn, O_RDONLY );
+      if ( fd != -1 )
+      {
+         struct stat st;
+         uint32_t magic = 0;
+
+         if ( fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(magic) &&
+              read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == SNAPSHOT_MAGIC )
+         {
+            Void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            close( fd );
+
+            if ( data == MAP_FAILED )
+            {
+               EString msg;
+               msg.format( "CacheRefresher::loadQueries() - unable to map [%s]", qfn );
+               throw EError( EError::Warning, msg );
+            }
+
+            try
+            {
+               _loadSnapshot( qfn, (const unsigned char *)data, st.st_size );
+            }
+            catch (...)
+            {
+               munmap( data, st.st_size );
+               throw;
+            }
+
+            munmap( data, st.st_size );
+            return;
+         }
+
+         close( fd );
+      }
+
       fp = fopen(qfn, "r");
       if ( fp )
       {
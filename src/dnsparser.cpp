@@ -24,10 +24,32 @@
 
 using namespace DNS;
 
-Parser::Parser( QueryPtr &q, unsigned char *rdata, int rlen )
-   : m_query( q )
+static const char *rcodeName( int rcode )
+{
+   switch ( rcode )
+   {
+      case ns_r_formerr:   return "FORMERR";
+      case ns_r_servfail:  return "SERVFAIL";
+      case ns_r_notimpl:   return "NOTIMP";
+      case ns_r_refused:   return "REFUSED";
+      default:             return "UNKNOWN";
+   }
+}
+
+ResolverError::ResolverError( Int rcode )
+{
+   setWarning();
+   setTextf( "resolver error - response code %s (%d)", rcodeName( rcode ), rcode );
+}
+
+Parser::Parser( QueryPtr &q, unsigned char *rdata, int rlen, uint32_t negttl )
+   : m_query( q ),
+     m_negttl( negttl )
 {
    m_data.setData( rdata, rlen );
+
+   // size the arena so that a typical response fits in a single block
+   m_query->getArena().setBlockSize( std::max( rlen * ARENA_RATIO, (int)ARENA_MIN_BLOCK ) );
 }
 
 void Parser::parse()
@@ -49,6 +71,33 @@ void Parser::parse()
    // prase additional record section
    for ( int i = 0; i < m_arcount; i++ )
       m_query->addAdditional( parseResourceRecord() );
+
+   // NXDOMAIN or NOERROR with an empty answer section is a negative response
+   if ( m_rcode == ns_r_nxdomain || (m_rcode == ns_r_noerror && m_ancount == 0) )
+      parseNegative();
+}
+
+void Parser::parseNegative()
+{
+   uint32_t ttl = m_negttl;
+
+   // RFC 2308 - the negative TTL is the lesser of the SOA TTL and the SOA minimum
+   for ( ResourceRecordList::const_iterator it = m_query->getAuthorities().begin();
+         it != m_query->getAuthorities().end();
+         ++it )
+   {
+      if ( (*it)->getType() == ns_t_soa )
+      {
+         RRecordSOA *soa = (RRecordSOA*)*it;
+         ttl = std::min( soa->getTTL(), soa->getMinimum() );
+         break;
+      }
+   }
+
+   if ( ttl > NEGATIVE_TTL_MAX )
+      ttl = NEGATIVE_TTL_MAX;
+
+   m_query->setNegative( ttl );
 }
 
 void Parser::parseHeader()
@@ -56,6 +105,7 @@ void Parser::parseHeader()
    if ( !m_data.isValid() )
       throw EError( EError::Warning, "Parser::parseHeader() - data is invalid" );
 
+   m_rcode = m_data.getPointer()[HDR_RCODE_OFS] & 0x0f;
    m_qdcount = GET_INT16( m_data.getPointer(), HDR_QDCOUNT_OFS );
    m_ancount = GET_INT16( m_data.getPointer(), HDR_ANCOUNT_OFS );
    m_nscount = GET_INT16( m_data.getPointer(), HDR_NSCOUNT_OFS );
@@ -63,6 +113,11 @@ void Parser::parseHeader()
 
    m_data.incrementOffset( HDR_FIXED_SIZE );
 
+   // only NOERROR and NXDOMAIN responses are usable, anything else is
+   // reported as a resolver failure rather than a malformed packet
+   if ( m_rcode != ns_r_noerror && m_rcode != ns_r_nxdomain )
+      throw ResolverError( m_rcode );
+
    //std::cout << "m_qdcount = " << m_qdcount << std::endl;
    //std::cout << "m_ancount = " << m_ancount << std::endl;
    //std::cout << "m_nscount = " << m_nscount << std::endl;
@@ -71,7 +126,7 @@ void Parser::parseHeader()
 
 Question* Parser::parseQuestion()
 {
-   EString qname;
+   Name qname;
    ns_type qtype;
    ns_class qclass;
 
@@ -80,7 +135,7 @@ Question* Parser::parseQuestion()
    qclass = (ns_class)GET_INT16( m_data.getPointer(), Q_QCLASS_OFS );
    m_data.incrementOffset( Q_FIXED_SIZE );
 
-   return new Question( qname, qtype, qclass );
+   return new (m_query->getArena()) Question( qname, qtype, qclass );
 }
 
 ResourceRecord* Parser::parseResourceRecord()
@@ -105,6 +160,8 @@ ResourceRecord* Parser::parseResourceRecord()
       rr = parseNS();
    else if ( m_class == ns_c_in && m_type == ns_t_cname )
       rr = parseCNAME();
+   else if ( m_class == ns_c_in && m_type == ns_t_soa )
+      rr = parseSOA();
    else if ( m_class == ns_c_in && m_type == ns_t_aaaa )
       rr = parseAAAA();
    else if ( m_class == ns_c_in && m_type == ns_t_srv )
@@ -125,7 +182,7 @@ ResourceRecord* Parser::parseRR()
    // increment the  m_data pointer
    m_data.incrementOffset( m_rdlength );
 
-   return new ResourceRecord( m_name, m_type, m_class, m_ttl );
+   return new (m_query->getArena()) ResourceRecord( m_name, m_type, m_class, m_ttl );
 }
 
 ResourceRecord* Parser::parseA()
@@ -145,29 +202,54 @@ ResourceRecord* Parser::parseA()
    // increment the pointer past RDATA
    m_data.incrementOffset( m_rdlength );
 
-   return new RRecordA( m_name, m_ttl, address );
+   return new (m_query->getArena()) RRecordA( m_name, m_ttl, address );
 }
 
 ResourceRecord* Parser::parseNS()
 {
-   EString ns;
+   Name ns;
 
    parseDomainName( ns );
 
    // the m_data pointer since it was incremented in parseDomainname()
 
-   return new RRecordNS( m_name, m_ttl, ns );
+   return new (m_query->getArena()) RRecordNS( m_name, m_ttl, ns );
 }
 
 ResourceRecord* Parser::parseCNAME()
 {
-   EString alias;
+   Name alias;
 
    parseDomainName( alias );
 
    // the m_data pointer since it was incremented in parseDomainname()
 
-   return new RRecordCNAME( m_name, m_ttl, alias );
+   return new (m_query->getArena()) RRecordCNAME( m_name, m_ttl, alias );
+}
+
+ResourceRecord* Parser::parseSOA()
+{
+   Name mname;
+   Name rname;
+
+   parseDomainName( mname );
+   parseDomainName( rname );
+
+   unsigned char *ptr = m_data.getPointer();
+
+   if ( !ptr || !m_data.validateLength( m_data.getOffset(), SOA_FIXED_SIZE - 1 ) )
+      throw EError( EError::Warning, "Parser::parseSOA() - SOA data extends beyond end of message" );
+
+   uint32_t serial = (uint32_t)GET_INT32( ptr, SOA_SERIAL_OFS );
+   uint32_t refresh = (uint32_t)GET_INT32( ptr, SOA_REFRESH_OFS );
+   uint32_t retry = (uint32_t)GET_INT32( ptr, SOA_RETRY_OFS );
+   uint32_t expire = (uint32_t)GET_INT32( ptr, SOA_EXPIRE_OFS );
+   uint32_t minimum = (uint32_t)GET_INT32( ptr, SOA_MINIMUM_OFS );
+
+   // increment the pointer past the fixed SOA data
+   m_data.incrementOffset( SOA_FIXED_SIZE );
+
+   return new (m_query->getArena()) RRecordSOA( m_name, m_ttl, mname, rname, serial, refresh, retry, expire, minimum );
 }
 
 ResourceRecord* Parser::parseAAAA()
@@ -187,7 +269,7 @@ ResourceRecord* Parser::parseAAAA()
    // increment the pointer past RDATA
    m_data.incrementOffset( m_rdlength );
 
-   return new RRecordAAAA( m_name, m_ttl, address );
+   return new (m_query->getArena()) RRecordAAAA( m_name, m_ttl, address );
 }
 
 ResourceRecord* Parser::parseSRV()
@@ -195,24 +277,24 @@ ResourceRecord* Parser::parseSRV()
    int priority = GET_INT16( m_rdata, SRV_PRIORITY_OFS );
    int weight = GET_INT16( m_rdata, SRV_WEIGHT_OFS );
    int port = GET_INT16( m_rdata, SRV_PORT_OFS );
-   EString target;
+   Name target;
 
    // increment the pointer past the fixed SRV data
    m_data.incrementOffset( SRV_FIXED_SIZE );
 
    parseDomainName( target );
    
-   return new RRecordSRV( m_name, m_ttl, priority, weight, port, target );
+   return new (m_query->getArena()) RRecordSRV( m_name, m_ttl, priority, weight, port, target );
 }
 
 ResourceRecord* Parser::parseNAPTR()
 {
    int order = GET_INT16( m_rdata, NAPTR_ORDER_OFS );
    int preference = GET_INT16( m_rdata, NAPTR_PREFERENCE_OFS );
-   EString flags;
-   EString service;
-   EString regexp;
-   EString replacement;
+   Name flags;
+   Name service;
+   Name regexp;
+   Name replacement;
 
    // increment the pointer past the fixed NAPTR data
    m_data.incrementOffset( NAPTR_FIXED_SIZE );
@@ -222,10 +304,11 @@ ResourceRecord* Parser::parseNAPTR()
    parseCharacterString( regexp );
    parseDomainName( replacement );
 
-   return new RRecordNAPTR( m_name, m_ttl, order, preference, flags, service, regexp, replacement );
+   return new (m_query->getArena()) RRecordNAPTR( m_name, m_ttl, order, preference,
+      flags, service, regexp, replacement );
 }
 
-void Parser::parseDomainName( EString &dn )
+void Parser::parseDomainName( Name &dn )
 {
    int compressedLength = 0;
    int currOfs = m_data.getOffset();
@@ -234,7 +317,9 @@ void Parser::parseDomainName( EString &dn )
    int val;
    unsigned char *ptr = m_data.getPointer();
 
-   dn = "";
+   // decode into a local buffer and copy the result into the query arena
+   char name[ NS_MAXDNAME ];
+   int namelen = 0;
 
    while ( *ptr )
    {
@@ -248,8 +333,13 @@ void Parser::parseDomainName( EString &dn )
          if ( !m_data.validateLength(currOfs,val) )
             throw EError( EError::Warning, "label extends beyond end of message" );
 
+         // ensure that the label (and the ".") fits in the name buffer
+         if ( namelen + val + 1 >= (int)sizeof(name) )
+            throw EError( EError::Warning, "domain name exceeds maximum length" );
+
          ptr++; // increment ptr to skip length
-         dn.append( (const char *)ptr, val );
+         for ( int i = 0; i < val; i++ )
+            name[namelen++] = ::tolower( ptr[i] );
          ptr += val; // skip to next label/offset
 
          // increment the compressedLength if an offset is not active
@@ -259,7 +349,7 @@ void Parser::parseDomainName( EString &dn )
 
          // check for another label and append "." as appropriate
          if ( *ptr )
-            dn.append( "." );
+            name[namelen++] = '.';
       }
       else if ( (val = LABEL_OFFSET(ptr)) != -1 )
       {
@@ -291,24 +381,25 @@ void Parser::parseDomainName( EString &dn )
       compressedLength++; // increment length for final null label
 
    if ( compressedLength == 1 )
-      dn = ".";
+      dn = Name( ".", 1 );
+   else
+      dn = Name( m_query->getArena(), name, namelen );
   
    m_data.incrementOffset( compressedLength );
-
-   // force the string to lower case
-   std::transform( dn.begin(), dn.end(), dn.begin(), ::tolower );
 }
 
-void Parser::parseCharacterString( EString &cs )
+void Parser::parseCharacterString( Name &cs )
 {
    // 1 octet length, followed by [length] octets as the character string
    int len = *m_data.getPointer();
    m_data.incrementOffset( 1 );
 
-   // assign the character string
-   cs.assign( (const char*)m_data.getPointer(), len );
+   // copy the character string into the query arena
+   char *str = m_query->getArena().copy( (const char*)m_data.getPointer(), len );
    m_data.incrementOffset( len );
 
    // force the string to lower case
-   std::transform( cs.begin(), cs.end(), cs.begin(), ::tolower );
+   std::transform( str, str + len, str, ::tolower );
+
+   cs = Name( str, len );
 }
@@ -17,6 +17,8 @@
 
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 #include "efd.h"
 #include "efdjson.h"
@@ -25,6 +27,110 @@
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+std::atomic<size_t> FDPool::m_limit( 1024 );
+pthread_key_t FDPool::m_key;
+pthread_once_t FDPool::m_once = PTHREAD_ONCE_INIT;
+thread_local FDPool::Cache *FDPool::m_cache = NULL;
+thread_local bool FDPool::m_closed = false;
+
+FDPool::Cache::Cache()
+{
+   for ( int i = 0; i < Classes; i++ )
+   {
+      head[i] = NULL;
+      count[i] = 0;
+   }
+}
+
+FDPool::Cache::~Cache()
+{
+   for ( int i = 0; i < Classes; i++ )
+   {
+      while ( head[i] )
+      {
+         Node *n = head[i];
+         head[i] = n->next;
+         ::operator delete( n );
+      }
+      count[i] = 0;
+   }
+}
+
+void FDPool::createKey()
+{
+   if ( pthread_key_create( &m_key, destroyCache ) != 0 )
+      throw FDException( EUtility::string_format( "%s:%d - ERROR - pthread_key_create() failed", __FILE__, __LINE__ ) );
+}
+
+void FDPool::destroyCache( void *p )
+{
+   // blocks released after the thread cache is gone go back to the heap
+   m_cache = NULL;
+   m_closed = true;
+   delete (Cache*)p;
+}
+
+FDPool::Cache *FDPool::getCache()
+{
+   if ( !m_cache && !m_closed )
+   {
+      pthread_once( &m_once, createKey );
+      m_cache = new Cache();
+      pthread_setspecific( m_key, m_cache );
+   }
+
+   return m_cache;
+}
+
+void *FDPool::allocate( size_t size )
+{
+   size_t cls = ( size + Granularity - 1 ) / Granularity;
+
+   if ( cls == 0 || cls > Classes )
+      return ::operator new( size );
+
+   Cache *c = getCache();
+   Node *n = c ? c->head[cls - 1] : NULL;
+
+   if ( !n )
+      return ::operator new( cls * Granularity );
+
+   c->head[cls - 1] = n->next;
+   c->count[cls - 1]--;
+
+   return n;
+}
+
+void FDPool::release( void *p, size_t size )
+{
+   if ( !p )
+      return;
+
+   size_t cls = ( size + Granularity - 1 ) / Granularity;
+
+   if ( cls == 0 || cls > Classes )
+   {
+      ::operator delete( p );
+      return;
+   }
+
+   Cache *c = getCache();
+
+   if ( !c || c->count[cls - 1] >= getLimit() )
+   {
+      ::operator delete( p );
+      return;
+   }
+
+   Node *n = (Node*)p;
+   n->next = c->head[cls - 1];
+   c->head[cls - 1] = n;
+   c->count[cls - 1]++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 static void copyall( msg_or_avp *from, msg_or_avp *to );
 
 static void copy( struct avp *from, msg_or_avp *to )
@@ -464,7 +570,8 @@ void FDDictionaryEntryAVP::getTypeInfo()
 ////////////////////////////////////////////////////////////////////////////////
 
 FDDictionaryEntryCommand::FDDictionaryEntryCommand( const char *name, struct dictionary *dict )
-   : FDDictionaryEntry( name, DICT_COMMAND, CMD_BY_NAME, dict )
+   : FDDictionaryEntry( name, DICT_COMMAND, CMD_BY_NAME, dict ),
+     m_stats( NULL )
 {
    if ( !isValid() )
       throw FDException(
@@ -481,7 +588,8 @@ FDDictionaryEntryCommand::FDDictionaryEntryCommand( const char *name, struct dic
 }
 
 FDDictionaryEntryCommand::FDDictionaryEntryCommand( command_code_t cmdid, struct dictionary *dict )
-   : FDDictionaryEntry( (const void *)&cmdid, DICT_COMMAND, CMD_BY_CODE_R, dict )
+   : FDDictionaryEntry( (const void *)&cmdid, DICT_COMMAND, CMD_BY_CODE_R, dict ),
+     m_stats( NULL )
 {
    if ( !isValid() )
       throw FDException(
@@ -498,7 +606,8 @@ FDDictionaryEntryCommand::FDDictionaryEntryCommand( command_code_t cmdid, struct
 }
 
 FDDictionaryEntryCommand::FDDictionaryEntryCommand( const FDDictionaryEntryCommand &req, struct dictionary *dict )
-   : FDDictionaryEntry( req.getEntry(), DICT_COMMAND, CMD_ANSWER, dict != NULL ? dict : (struct dictionary *)req.getDictionary() )
+   : FDDictionaryEntry( req.getEntry(), DICT_COMMAND, CMD_ANSWER, dict != NULL ? dict : (struct dictionary *)req.getDictionary() ),
+     m_stats( NULL )
 {
    if ( !isValid() )
       throw FDException(
@@ -514,6 +623,40 @@ FDDictionaryEntryCommand::FDDictionaryEntryCommand( const FDDictionaryEntryComma
       );
 }
 
+FDDictionaryEntryCommand::~FDDictionaryEntryCommand()
+{
+   delete m_stats.load();
+}
+
+void FDDictionaryEntryCommand::getStats( application_id_t app, FDRequestStatsEntry *&appstats, FDRequestStatsEntry *&cmdstats )
+{
+   Stats *stats = m_stats.load();
+
+   if ( !stats )
+   {
+      Stats *s = new Stats();
+      s->app = app;
+      s->appstats = FDRequestStats::getApplication( app );
+      s->cmdstats = FDRequestStats::getCommand( app, getCommandCode() );
+
+      if ( m_stats.compare_exchange_strong( stats, s ) )
+         stats = s;
+      else
+         delete s;
+   }
+
+   if ( stats->app == app )
+   {
+      appstats = stats->appstats;
+      cmdstats = stats->cmdstats;
+   }
+   else
+   {
+      appstats = FDRequestStats::getApplication( app );
+      cmdstats = FDRequestStats::getCommand( app, getCommandCode() );
+   }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -524,7 +667,6 @@ FDDictionaryEntryCommand::FDDictionaryEntryCommand( const FDDictionaryEntryComma
 
 FDAvp::FDAvp( FDDictionaryEntryAVP &de, bool dedel )
    : m_de( &de ),
-     m_buf( NULL ),
      m_assigned( false ),
      m_avp( NULL ),
      m_avphdr( NULL ),
@@ -535,7 +677,6 @@ FDAvp::FDAvp( FDDictionaryEntryAVP &de, bool dedel )
 
 FDAvp::FDAvp( FDDictionaryEntryAVP &de, struct avp *a, bool dedel )
    : m_de( &de ),
-     m_buf( NULL ),
      m_assigned( true ),
      m_avp( a ),
      m_avphdr( NULL ),
@@ -556,9 +697,6 @@ FDAvp::FDAvp( FDDictionaryEntryAVP &de, struct avp *a, bool dedel )
 
 FDAvp::~FDAvp()
 {
-   if ( m_buf )
-      delete m_buf;
-
    if ( !m_assigned && m_avp )
       fd_msg_free( m_avp );
 
@@ -804,25 +942,53 @@ bool FDAvp::get( ETime &v )
    return true;
 }
 
-FDAvp &FDAvp::set( int64_t v )
+// encodes the NTP seconds of a Time value, returns the encoded length
+static size_t encodeTime( uint32_t ntpseconds, uint8_t *buf )
 {
-   if ( m_de->getDataType() == DDTTime )
-   {
-      m_buf = new FDBuffer<uint8_t>( sizeof( uint32_t ) );
+   union {
+      uint32_t u;
+      uint8_t u8[ sizeof( uint32_t ) ];
+   } val;
 
-      union {
-         uint32_t u;
-         uint8_t u8[ sizeof( uint32_t ) ];
-      } val;
-
-      val.u = (uint32_t)v + 2208988800UL;
+   val.u = ntpseconds;
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-      uint8_t u8;
-      u8 = val.u8[0]; val.u8[0] = val.u8[3]; val.u8[3] = u8;
-      u8 = val.u8[1]; val.u8[1] = val.u8[2]; val.u8[2] = u8;
+   uint8_t u8;
+   u8 = val.u8[0]; val.u8[0] = val.u8[3]; val.u8[3] = u8;
+   u8 = val.u8[1]; val.u8[1] = val.u8[2]; val.u8[2] = u8;
 #endif
-      set( val.u8, sizeof(uint32_t) );
-      //*((uint32_t*)m_buf->get()) = val.u;
+   memcpy( buf, val.u8, sizeof(uint32_t) );
+
+   return sizeof(uint32_t);
+}
+
+// encodes an IPv4 or IPv6 address string as an Address value (18 bytes
+// max), returns the encoded length or 0 if the string is not an address
+static size_t encodeAddress( const char *v, uint8_t *buf )
+{
+   sSS ss;
+
+   if ( inet_pton( AF_INET, v, &((sSA4*)&ss)->sin_addr ) == 1 )
+   {
+      *(uint16_t *)buf = htons(1);
+      memcpy( buf + 2, &((sSA4*)&ss)->sin_addr.s_addr, 4 );
+      return 6;
+   }
+
+   if ( inet_pton( AF_INET6, v, &((sSA6*)&ss)->sin6_addr ) == 1 )
+   {
+      *(uint16_t *)buf = htons(2);
+      memcpy( buf + 2, &((sSA6*)&ss)->sin6_addr.s6_addr, 16 );
+      return 18;
+   }
+
+   return 0;
+}
+
+FDAvp &FDAvp::set( int64_t v )
+{
+   if ( m_de->getDataType() == DDTTime )
+   {
+      set( m_buf, encodeTime( (uint32_t)v + 2208988800UL, m_buf ) );
    }
    else
    {
@@ -837,28 +1003,14 @@ FDAvp &FDAvp::set( int64_t v )
 FDAvp &FDAvp::set( const char *v, size_t len )
 {
    size_t rawlen = len;
-   sSS ss;
+   size_t enclen;
 
    if ( m_de->getDataType() == DDTAddress )
    {
-      if ( inet_pton( AF_INET, v, &((sSA4*)&ss)->sin_addr ) == 1 )
-      {
-         m_buf = new FDBuffer<uint8_t>( 18 );
-         *(uint16_t *)m_buf->get() = htons(1);
-         memcpy( m_buf->get() + 2, &((sSA4*)&ss)->sin_addr.s_addr, 4 );
-         set( m_buf->get(), 6 );
-      }
-      else if ( inet_pton( AF_INET6, v, &((sSA6*)&ss)->sin6_addr ) == 1 )
-      {
-         m_buf = new FDBuffer<uint8_t>( 18 );
-         *(uint16_t *)m_buf->get() = htons(2);
-         memcpy( m_buf->get() + 2, &((sSA6*)&ss)->sin6_addr.s6_addr, 16 );
-         set( m_buf->get(), 18 );
-      }
+      if ( ( enclen = encodeAddress( v, m_buf ) ) != 0 )
+         set( m_buf, enclen );
       else
-      {
          set( (uint8_t*)v, rawlen );
-      }
    }
    else
    {
@@ -874,26 +1026,11 @@ FDAvp &FDAvp::set( const ETime &v )
 {
    if ( m_de->getDataType() == DDTTime )
    {
-      m_buf = new FDBuffer<uint8_t>( sizeof( uint32_t ) );
-
-      union {
-         uint32_t u;
-         uint8_t u8[ sizeof( uint32_t ) ];
-      } val;
-
       ntp_time_t ntp;
 
       v.getNTPTime( ntp );
 
-      val.u = ntp.second; // + 2208988800UL;
-
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-      uint8_t u8;
-      u8 = val.u8[0]; val.u8[0] = val.u8[3]; val.u8[3] = u8;
-      u8 = val.u8[1]; val.u8[1] = val.u8[2]; val.u8[2] = u8;
-#endif
-
-      set( val.u8, sizeof(uint32_t) );
+      set( m_buf, encodeTime( ntp.second, m_buf ) );
    }
    else
    {
@@ -1262,12 +1399,30 @@ void FDMessage::dump()
    free(buf);
 }
 
-FDMessage &FDMessage::sendRequest( void (*anscb)(void*,struct msg**), FDMessageRequest &req )
+FDMessage &FDMessage::sendRequest( void (*anscb)(void*,struct msg**), FDMessageRequest &req, void (*expirecb)(void*,DiamId_t,size_t,struct msg**) )
 {
    int ret;
 
    // send the message
-   ret = fd_msg_send( &m_msg, anscb, &req );
+   if ( expirecb && req.getTimeout() > 0 )
+   {
+      struct timespec ts;
+
+      clock_gettime( CLOCK_REALTIME, &ts );
+      ts.tv_sec += req.getTimeout() / 1000;
+      ts.tv_nsec += ( req.getTimeout() % 1000 ) * 1000000;
+      if ( ts.tv_nsec >= 1000000000 )
+      {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+
+      ret = fd_msg_send_timeout( &m_msg, anscb, &req, expirecb, &ts );
+   }
+   else
+   {
+      ret = fd_msg_send( &m_msg, anscb, &req );
+   }
    if ( ret != 0 )
       throw FDException(
          EUtility::string_format("%s:%d - INFO - error attempting to send request message ret=%d",
@@ -1385,7 +1540,10 @@ FDMessageAnswer &FDMessageAnswer::send()
 ////////////////////////////////////////////////////////////////////////////////
 
 FDMessageRequest::FDMessageRequest( FDDictionaryEntryCommand *cde )
-   : FDMessage( cde )
+   : FDMessage( cde ),
+     m_peer( NULL ),
+     m_timeout( 0 ),
+     m_stats()
 {
    if ( cde->isAnswer() )
       throw FDException(
@@ -1395,7 +1553,10 @@ FDMessageRequest::FDMessageRequest( FDDictionaryEntryCommand *cde )
 }
 
 FDMessageRequest::FDMessageRequest( FDDictionaryEntryCommand *cde, struct msg *pmsg )
-   : FDMessage( cde, pmsg )
+   : FDMessage( cde, pmsg ),
+     m_peer( NULL ),
+     m_timeout( 0 ),
+     m_stats()
 {
    if ( cde->isAnswer() )
       throw FDException(
@@ -1405,7 +1566,10 @@ FDMessageRequest::FDMessageRequest( FDDictionaryEntryCommand *cde, struct msg *p
 }
 
 FDMessageRequest::FDMessageRequest( FDDictionaryEntryApplication *ade, FDDictionaryEntryCommand *cde )
-   : FDMessage( ade, cde )
+   : FDMessage( ade, cde ),
+     m_peer( NULL ),
+     m_timeout( 0 ),
+     m_stats()
 {
    if ( cde->isAnswer() )
       throw FDException(
@@ -1420,8 +1584,52 @@ FDMessageRequest::~FDMessageRequest()
 
 FDMessageRequest &FDMessageRequest::send()
 {
+   // the answer can arrive and delete this request before sendRequest()
+   // returns, so only the local copies are used after the send
+   FDRequestStatsEntry *stats[3] = { NULL, NULL, NULL };
+   FDPeer *peer = m_peer;
+
    m_timer.Start();
-   sendRequest( anscb, *this );
+
+   if ( FDRequestStats::getEnabled() )
+   {
+      struct msg_hdr *hdr;
+
+      // the application id is read from the header since it can be set
+      // after the message was created
+      if ( fd_msg_hdr( getMsg(), &hdr ) == 0 )
+         getCommand()->getStats( hdr->msg_appl, m_stats[0], m_stats[1] );
+      m_stats[2] = peer ? peer->getStats() : NULL;
+
+      for ( int i = 0; i < 3; i++ )
+      {
+         stats[i] = m_stats[i];
+         if ( stats[i] )
+            stats[i]->sending();
+      }
+   }
+
+   if ( peer )
+      peer->incOutstanding();
+
+   try
+   {
+      sendRequest( anscb, *this, expirecb );
+   }
+   catch (...)
+   {
+      if ( peer )
+         peer->decOutstanding();
+      for ( int i = 0; i < 3; i++ )
+         if ( stats[i] )
+            stats[i]->sendFailed();
+      throw;
+   }
+
+   for ( int i = 0; i < 3; i++ )
+      if ( stats[i] )
+         stats[i]->sent();
+
    return *this;
 }
 
@@ -1429,11 +1637,72 @@ void FDMessageRequest::processAnswer( FDMessageAnswer &ans )
 {
 }
 
+void FDMessageRequest::processTimeout()
+{
+}
+
+// returns the Result-Code or Experimental-Result-Code of an answer, 0 if
+// the answer contains neither
+static uint32_t getResultCode( struct msg *m )
+{
+   msg_or_avp *a;
+   msg_or_avp *c;
+   struct avp_hdr *ah;
+
+   if ( !m || fd_msg_browse_internal( m, MSG_BRW_FIRST_CHILD, &a, NULL ) != 0 )
+      return 0;
+
+   while ( a )
+   {
+      if ( fd_msg_avp_hdr( (struct avp *)a, &ah ) != 0 )
+         return 0;
+
+      if ( ah->avp_vendor == 0 && ah->avp_code == 268 && ah->avp_value )
+         return ah->avp_value->u32;
+
+      // Experimental-Result
+      if ( ah->avp_vendor == 0 && ah->avp_code == 297 &&
+           fd_msg_browse_internal( a, MSG_BRW_FIRST_CHILD, &c, NULL ) == 0 )
+      {
+         while ( c )
+         {
+            if ( fd_msg_avp_hdr( (struct avp *)c, &ah ) != 0 )
+               return 0;
+
+            // Experimental-Result-Code
+            if ( ah->avp_vendor == 0 && ah->avp_code == 298 && ah->avp_value )
+               return ah->avp_value->u32;
+
+            if ( fd_msg_browse_internal( c, MSG_BRW_NEXT, &c, NULL ) != 0 )
+               return 0;
+         }
+      }
+
+      if ( fd_msg_browse_internal( a, MSG_BRW_NEXT, &a, NULL ) != 0 )
+         return 0;
+   }
+
+   return 0;
+}
+
 void FDMessageRequest::anscb( void * data, struct msg ** pmsg )
 {
    // set the "this" pointer
    FDMessageRequest *pthis = (FDMessageRequest*)data;
 
+   if ( pthis->m_peer )
+      pthis->m_peer->decOutstanding();
+
+   if ( pthis->m_stats[0] || pthis->m_stats[1] || pthis->m_stats[2] )
+   {
+      uint64_t us = (uint64_t)pthis->m_timer.MicroSeconds();
+      uint32_t rc = getResultCode( *pmsg );
+
+      for ( int i = 0; i < 3; i++ )
+         if ( pthis->m_stats[i] )
+            pthis->m_stats[i]->answered( us, rc );
+   }
+
    // construct the FDMessageAnswer object
    FDDictionaryEntryCommand anscmd( *pthis->getCommand() );
    FDMessageAnswer ans( &anscmd, *pmsg );
@@ -1448,90 +1717,486 @@ void FDMessageRequest::anscb( void * data, struct msg ** pmsg )
    *pmsg = NULL;
 }
 
+void FDMessageRequest::expirecb( void * data, DiamId_t sentto, size_t senttolen, struct msg ** pmsg )
+{
+   // set the "this" pointer
+   FDMessageRequest *pthis = (FDMessageRequest*)data;
+
+   if ( pthis->m_peer )
+      pthis->m_peer->decOutstanding();
+
+   for ( int i = 0; i < 3; i++ )
+      if ( pthis->m_stats[i] )
+         pthis->m_stats[i]->timedOut();
+
+   pthis->processTimeout();
+
+   // freeDiameter frees the request message and discards a late answer
+   delete pthis;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-FDCommand::FDCommand( FDDictionaryEntryCommand &de )
-   : m_de( de )
+FDMessageTemplate::FDMessageTemplate()
 {
 }
 
-FDCommandRequest::FDCommandRequest( FDDictionaryEntryCommand &de )
-   : FDCommand( de )
+FDMessageTemplate::~FDMessageTemplate()
 {
 }
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-
-FDApplication::FDApplication( FDDictionaryEntryApplication *de )
-   : m_de( de )
+int FDMessageTemplate::addNode( FDDictionaryEntryAVP &de, int parent, int slot )
 {
+   if ( parent < -1 || parent >= (int)m_nodes.size() || ( parent != -1 && m_nodes[parent].de->getDataType() != DDTGrouped ) )
+      throw FDException(
+         EUtility::string_format("%s:%d - ERROR - FDMessageTemplate invalid parent [%d] for [%s]",
+         __FILE__, __LINE__, parent, de.getName() )
+      );
+
+   int idx = (int)m_nodes.size();
+
+   m_nodes.push_back( Node() );
+
+   Node &n = m_nodes.back();
+   n.de = &de;
+   n.parent = parent;
+   n.slot = slot;
+   n.octets = false;
+   memset( &n.value, 0, sizeof( n.value ) );
+
+   if ( parent == -1 )
+      m_roots.push_back( idx );
+   else
+      m_nodes[parent].children.push_back( idx );
+
+   return idx;
 }
 
-FDApplication::~FDApplication()
+int FDMessageTemplate::addConstantNode( FDDictionaryEntryAVP &de, int parent, const union avp_value &v )
 {
+   int idx = addNode( de, parent, -1 );
+   m_nodes[idx].value = v;
+   return idx;
 }
 
-FDApplication &FDApplication::registerHandler( FDCommandRequest &cmd )
+int FDMessageTemplate::addConstantNode( FDDictionaryEntryAVP &de, int parent, const uint8_t *data, size_t len )
 {
-   for ( std::list<FDCommandRequest*>::const_iterator it = m_cmds.begin();
-         it != m_cmds.end();
-         ++it )
-   {
-      if ( (*it)->getDictionaryEntry().getCommandCode() == cmd.getDictionaryEntry().getCommandCode() )
-         throw FDException(
-            EUtility::string_format("%s:%d - ERROR - a matching command object is already registered",
-            __FILE__, __LINE__ )
-         );
-   }
-
-   struct disp_when when = {
-      .app     = m_de->getEntry(),
-      .command = cmd.getDictionaryEntry().getEntry(),
-      .avp     = NULL,
-      .value   = NULL
-   };
+   int idx = addNode( de, parent, -1 );
+   m_nodes[idx].octets = true;
+   m_nodes[idx].data.assign( (const char *)data, len );
+   return idx;
+}
 
-   int ret = fd_disp_register( commandcb, DISP_HOW_CC, &when, &cmd, NULL );
-   if ( ret != 0 )
+int FDMessageTemplate::addGroup( FDDictionaryEntryAVP &de, int parent )
+{
+   if ( de.getDataType() != DDTGrouped )
       throw FDException(
-         EUtility::string_format("%s:%d - ERROR - fd_disp_register failed ret=%d",
-         __FILE__, __LINE__, ret )
+         EUtility::string_format("%s:%d - ERROR - FDMessageTemplate [%s] is not a grouped AVP",
+         __FILE__, __LINE__, de.getName() )
       );
-   
-   m_cmds.push_back( &cmd );
 
-   return *this;
+   return addNode( de, parent, -1 );
 }
 
-int FDApplication::commandcb( struct msg **m, struct avp *avp, struct session *session, void *data, enum disp_action *action )
+int FDMessageTemplate::addSlot( FDDictionaryEntryAVP &de, int parent )
 {
-   FDCommandRequest *cmd = (FDCommandRequest*)data;
-   struct msg_hdr *hdr = NULL;
+   int slot = (int)m_slots.size();
+   m_slots.push_back( addNode( de, parent, slot ) );
+   return slot;
+}
 
-   int ret = fd_msg_hdr( *m, &hdr );
-   if ( ret != 0 )
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, int32_t v, int parent )
+{
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, int64_t v, int parent )
+{
+   if ( de.getDataType() == DDTTime )
    {
-      // unable to retrieve message header
-      return EINVAL;
+      uint8_t buf[ sizeof(uint32_t) ];
+      return addConstantNode( de, parent, buf, encodeTime( (uint32_t)v + 2208988800UL, buf ) );
    }
 
-   bool isRequest = (hdr->msg_flags & CMD_FLAG_REQUEST) == CMD_FLAG_REQUEST;
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
 
-   if ( FDISANSWER(hdr) )
-   {
-      // the answer message should have been processed in the fd_msg_send callback
-      return EINVAL;
-   }
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, uint32_t v, int parent )
+{
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
 
-   if ( cmd->isAnswer() )
-   {
-      // this callback should only handle incoming requests
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, uint64_t v, int parent )
+{
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, float v, int parent )
+{
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, double v, int parent )
+{
+   union avp_value val;
+   toValue( de, v, val );
+   return addConstantNode( de, parent, val );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, const char *v, int parent )
+{
+   if ( de.getDataType() == DDTAddress )
+   {
+      uint8_t buf[18];
+      size_t len = encodeAddress( v, buf );
+      if ( len )
+         return addConstantNode( de, parent, buf, len );
+   }
+
+   return addConstantNode( de, parent, (const uint8_t *)v, strlen( v ) );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, const uint8_t *v, size_t len, int parent )
+{
+   return addConstantNode( de, parent, v, len );
+}
+
+int FDMessageTemplate::addConstant( FDDictionaryEntryAVP &de, const ETime &v, int parent )
+{
+   if ( de.getDataType() != DDTTime )
+      throw FDException(
+         EUtility::string_format( "%s:%d - INFO - Unable to assign ETime value to [%s]",
+         __FILE__, __LINE__, de.getName() )
+      );
+
+   ntp_time_t ntp;
+   uint8_t buf[ sizeof(uint32_t) ];
+
+   v.getNTPTime( ntp );
+
+   return addConstantNode( de, parent, buf, encodeTime( ntp.second, buf ) );
+}
+
+FDMessage &FDMessageTemplate::build( FDMessage &msg )
+{
+   return build( msg, NULL );
+}
+
+FDMessage &FDMessageTemplate::build( FDMessage &msg, FDMessageTemplateValues &values )
+{
+   if ( &values.m_tmpl != this )
+      throw FDException(
+         EUtility::string_format("%s:%d - ERROR - FDMessageTemplate values belong to a different template",
+         __FILE__, __LINE__ )
+      );
+
+   return build( msg, &values );
+}
+
+FDMessage &FDMessageTemplate::build( FDMessage &msg, FDMessageTemplateValues *values )
+{
+   for ( std::vector<int>::iterator it = m_roots.begin(); it != m_roots.end(); ++it )
+   {
+      struct avp *a = buildNode( *it, values );
+
+      if ( a )
+      {
+         int ret = fd_msg_avp_add( msg.getMsg(), MSG_BRW_LAST_CHILD, a );
+         if ( ret != 0 )
+         {
+            fd_msg_free( a );
+            throw FDException(
+               EUtility::string_format("%s:%d - ERROR - Error [%d] adding [%s] AVP",
+               __FILE__, __LINE__, ret, m_nodes[*it].de->getName() )
+            );
+         }
+      }
+   }
+
+   return msg;
+}
+
+struct avp *FDMessageTemplate::buildNode( int idx, FDMessageTemplateValues *values )
+{
+   Node &n = m_nodes[idx];
+   union avp_value v;
+
+   if ( n.slot != -1 )
+   {
+      // a slot added after the values were created has no value
+      if ( !values || n.slot >= (int)values->m_values.size() || !values->m_values[n.slot].set )
+         return NULL;
+
+      FDMessageTemplateValues::Value &val = values->m_values[n.slot];
+      v = val.value;
+      if ( val.buflen )
+         v.os.data = val.buf;
+   }
+   else if ( n.octets )
+   {
+      v.os.data = (uint8_t *)n.data.data();
+      v.os.len = n.data.size();
+   }
+   else
+   {
+      v = n.value;
+   }
+
+   struct avp *a;
+   int ret = fd_msg_avp_new( n.de->getEntry(), 0, &a );
+   if ( ret != 0 )
+      throw FDException(
+         EUtility::string_format("%s:%d - ERROR - Error [%d] creating [%s] AVP",
+         __FILE__, __LINE__, ret, n.de->getName() )
+      );
+
+   try
+   {
+      if ( n.de->getDataType() == DDTGrouped )
+      {
+         bool empty = true;
+
+         for ( std::vector<int>::iterator it = n.children.begin(); it != n.children.end(); ++it )
+         {
+            struct avp *child = buildNode( *it, values );
+
+            if ( child )
+            {
+               if ( ( ret = fd_msg_avp_add( a, MSG_BRW_LAST_CHILD, child ) ) != 0 )
+               {
+                  fd_msg_free( child );
+                  throw FDException(
+                     EUtility::string_format("%s:%d - ERROR - Error [%d] adding [%s] AVP",
+                     __FILE__, __LINE__, ret, m_nodes[*it].de->getName() )
+                  );
+               }
+               empty = false;
+            }
+         }
+
+         if ( empty )
+         {
+            fd_msg_free( a );
+            return NULL;
+         }
+      }
+      else if ( ( ret = fd_msg_avp_setvalue( a, &v ) ) != 0 )
+      {
+         throw FDException(
+            EUtility::string_format("%s:%d - ERROR - Error [%d] setting AVP value for [%s]",
+            __FILE__, __LINE__, ret, n.de->getName() )
+         );
+      }
+   }
+   catch (...)
+   {
+      fd_msg_free( a );
+      throw;
+   }
+
+   return a;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+FDMessageTemplateValues::FDMessageTemplateValues( FDMessageTemplate &tmpl )
+   : m_tmpl( tmpl ),
+     m_values( tmpl.m_slots.size() )
+{
+   clear();
+}
+
+FDMessageTemplateValues::~FDMessageTemplateValues()
+{
+}
+
+void FDMessageTemplateValues::clear()
+{
+   for ( std::vector<Value>::iterator it = m_values.begin(); it != m_values.end(); ++it )
+   {
+      memset( &it->value, 0, sizeof( it->value ) );
+      it->buflen = 0;
+      it->set = false;
+   }
+}
+
+union avp_value &FDMessageTemplateValues::value( int slot )
+{
+   if ( slot < 0 || slot >= (int)m_tmpl.m_slots.size() )
+      throw FDException(
+         EUtility::string_format("%s:%d - ERROR - FDMessageTemplateValues invalid slot [%d]",
+         __FILE__, __LINE__, slot )
+      );
+
+   // the slot was added to the template after the values were created
+   if ( slot >= (int)m_values.size() )
+      m_values.resize( m_tmpl.m_slots.size() );
+
+   Value &val = m_values[slot];
+   val.buflen = 0;
+   val.set = true;
+
+   return val.value;
+}
+
+FDMessageTemplateValues &FDMessageTemplateValues::set( int slot, const uint8_t *v, size_t len )
+{
+   union avp_value &val = value( slot );
+   val.os.data = (uint8_t *)v;
+   val.os.len = len;
+   return *this;
+}
+
+FDMessageTemplateValues &FDMessageTemplateValues::set( int slot, const char *v, size_t len )
+{
+   set( slot, (const uint8_t *)v, len );
+
+   if ( m_tmpl.m_nodes[ m_tmpl.m_slots[slot] ].de->getDataType() == DDTAddress )
+   {
+      Value &val = m_values[slot];
+      if ( ( val.buflen = encodeAddress( v, val.buf ) ) != 0 )
+         val.value.os.len = val.buflen;
+   }
+
+   return *this;
+}
+
+FDMessageTemplateValues &FDMessageTemplateValues::set( int slot, int64_t v )
+{
+   union avp_value &val = value( slot );
+
+   if ( m_tmpl.m_nodes[ m_tmpl.m_slots[slot] ].de->getDataType() == DDTTime )
+   {
+      Value &tv = m_values[slot];
+      tv.buflen = val.os.len = encodeTime( (uint32_t)v + 2208988800UL, tv.buf );
+   }
+   else
+   {
+      return setNumber( slot, v );
+   }
+
+   return *this;
+}
+
+FDMessageTemplateValues &FDMessageTemplateValues::set( int slot, const ETime &v )
+{
+   union avp_value &val = value( slot );
+
+   if ( m_tmpl.m_nodes[ m_tmpl.m_slots[slot] ].de->getDataType() != DDTTime )
+   {
+      m_values[slot].set = false;
+      throw FDException(
+         EUtility::string_format( "%s:%d - INFO - Unable to assign ETime value to [%s]",
+         __FILE__, __LINE__, m_tmpl.m_nodes[ m_tmpl.m_slots[slot] ].de->getName() )
+      );
+   }
+
+   ntp_time_t ntp;
+   Value &tv = m_values[slot];
+
+   v.getNTPTime( ntp );
+
+   tv.buflen = val.os.len = encodeTime( ntp.second, tv.buf );
+
+   return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+FDCommand::FDCommand( FDDictionaryEntryCommand &de )
+   : m_de( de )
+{
+}
+
+FDCommandRequest::FDCommandRequest( FDDictionaryEntryCommand &de )
+   : FDCommand( de )
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+FDApplication::FDApplication( FDDictionaryEntryApplication *de )
+   : m_de( de )
+{
+}
+
+FDApplication::~FDApplication()
+{
+}
+
+FDApplication &FDApplication::registerHandler( FDCommandRequest &cmd )
+{
+   for ( std::list<FDCommandRequest*>::const_iterator it = m_cmds.begin();
+         it != m_cmds.end();
+         ++it )
+   {
+      if ( (*it)->getDictionaryEntry().getCommandCode() == cmd.getDictionaryEntry().getCommandCode() )
+         throw FDException(
+            EUtility::string_format("%s:%d - ERROR - a matching command object is already registered",
+            __FILE__, __LINE__ )
+         );
+   }
+
+   struct disp_when when = {
+      .app     = m_de->getEntry(),
+      .command = cmd.getDictionaryEntry().getEntry(),
+      .avp     = NULL,
+      .value   = NULL
+   };
+
+   int ret = fd_disp_register( commandcb, DISP_HOW_CC, &when, &cmd, NULL );
+   if ( ret != 0 )
+      throw FDException(
+         EUtility::string_format("%s:%d - ERROR - fd_disp_register failed ret=%d",
+         __FILE__, __LINE__, ret )
+      );
+   
+   m_cmds.push_back( &cmd );
+
+   return *this;
+}
+
+int FDApplication::commandcb( struct msg **m, struct avp *avp, struct session *session, void *data, enum disp_action *action )
+{
+   FDCommandRequest *cmd = (FDCommandRequest*)data;
+   struct msg_hdr *hdr = NULL;
+
+   int ret = fd_msg_hdr( *m, &hdr );
+   if ( ret != 0 )
+   {
+      // unable to retrieve message header
+      return EINVAL;
+   }
+
+   bool isRequest = (hdr->msg_flags & CMD_FLAG_REQUEST) == CMD_FLAG_REQUEST;
+
+   if ( FDISANSWER(hdr) )
+   {
+      // the answer message should have been processed in the fd_msg_send callback
+      return EINVAL;
+   }
+
+   if ( cmd->isAnswer() )
+   {
+      // this callback should only handle incoming requests
       // incoming answers should be handled in the fd_msg_send callback
       return EINVAL;
    }
 
+   // the request wrapper comes from the FDPool free list of this worker thread
    FDMessageRequest *req = new FDMessageRequest( &cmd->getDictionaryEntry(), *m );
 
    ret = cmd->process( req );
@@ -1775,6 +2440,18 @@ void FDPeer::init()
 {
    m_port = 3868;
    m_peer = NULL;
+   m_weight = 1;
+   m_outstanding = 0;
+   m_list = NULL;
+   m_stats = NULL;
+}
+
+FDRequestStatsEntry *FDPeer::getStats()
+{
+   if ( !m_stats )
+      m_stats = FDRequestStats::getPeer( m_diamid );
+
+   return m_stats;
 }
 
 void FDPeer::peercb( struct peer_info *pi, void *data )
@@ -1786,9 +2463,18 @@ void FDPeer::peercb( struct peer_info *pi, void *data )
    {
       ths->m_destrealm = ths->m_peer->info.runtime.pir_realm;
    }
+
+   if ( ths->m_list )
+      ths->m_list->peerStateChanged( ths );
 }
 
-FDPeerList::FDPeerList()
+FDPeerList::FDPeerList( FDPeerBalance balance )
+   : m_balance( balance ),
+     m_next( 0 ),
+     m_total( 0 ),
+     m_refreshms( 1000 ),
+     m_refreshed( 0 ),
+     m_dirty( true )
 {
 }
 
@@ -1802,39 +2488,453 @@ FDPeerList::~FDPeerList()
    }
 }
 
+FDPeerList &FDPeerList::add( FDPeer *peer )
+{
+   peer->m_list = this;
+   push_back( peer );
+   m_dirty = true;
+   return *this;
+}
+
 bool FDPeerList::isPeerOpen()
 {
-   for ( FDPeerList::const_iterator it = begin();
-         it != end();
-         ++it )
+   return getOpenCount() > 0;
+}
+
+size_t FDPeerList::getOpenCount()
+{
+   if ( refreshDue() )
+      refresh();
+
    {
-      if ( (*it)->isOpen() )
-         return true;
+      ERDLock l( m_rwlock );
+      if ( !m_open.empty() )
+         return m_open.size();
    }
 
-   return false;
+   // a peer that reconnected since the last refresh is only seen by
+   // checking the state of each peer
+   refresh();
+
+   ERDLock l( m_rwlock );
+   return m_open.size();
 }
 
 FDPeer *FDPeerList::getOpenPeer()
 {
-   for ( FDPeerList::iterator it = begin();
-         it != end();
-         ++it )
-   {
-      if ( (*it)->isOpen() )
-         return *it;
-   }
+   if ( refreshDue() )
+      refresh();
 
-   return NULL;
-}
+   // a peer that closed or reconnected since the last refresh invalidates
+   // the index
+   FDPeer *peer = select();
+   if ( peer && peer->isOpen() )
+      return peer;
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
+   refresh();
+
+   return select();
+}
+
+void FDPeerList::refresh()
+{
+   EWRLock l( m_rwlock );
+
+   m_dirty = false;
+   m_refreshed = (epctime_t)ETimer();
+
+   m_open.clear();
+   m_weights.clear();
+   m_total = 0;
+
+   for ( FDPeerList::iterator it = begin(); it != end(); ++it )
+   {
+      if ( (*it)->isOpen() )
+      {
+         m_open.push_back( *it );
+         m_weights.push_back( (*it)->getWeight() );
+         m_total += (*it)->getWeight();
+      }
+   }
+
+   m_current.assign( m_open.size(), 0 );
+}
+
+FDPeer *FDPeerList::select()
+{
+   ERDLock l( m_rwlock );
+
+   size_t cnt = m_open.size();
+
+   if ( cnt == 0 )
+      return NULL;
+
+   if ( cnt == 1 || m_balance == PBFirstOpen )
+      return m_open.front();
+
+   if ( m_balance == PBWeighted && m_total > 0 )
+   {
+      // smooth weighted round robin, each peer is selected weight times
+      // out of every total selections and the selections are spread out
+      EMutexLock ml( m_swrr );
+      size_t best = 0;
+
+      for ( size_t i = 0; i < cnt; i++ )
+      {
+         m_current[i] += m_weights[i];
+         if ( m_current[i] > m_current[best] )
+            best = i;
+      }
+
+      m_current[best] -= m_total;
+      return m_open[best];
+   }
+
+   unsigned long n = atomic_inc_fetch( m_next );
+
+   if ( m_balance == PBLeastOutstanding )
+   {
+      // compare two candidates (power of two choices) instead of
+      // scanning all of the open peers
+      FDPeer *a = m_open[ n % cnt ];
+      FDPeer *b = m_open[ ( n + 1 + ( n / cnt ) % ( cnt - 1 ) ) % cnt ];
+      return b->getOutstanding() < a->getOutstanding() ? b : a;
+   }
+
+   return m_open[ n % cnt ];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+void FDLatencyHistogram::reset()
+{
+   for ( int i = 0; i < Buckets; i++ )
+      atomic_swap( m_counts[i], 0 );
+   atomic_swap( m_count, 0 );
+   atomic_swap( m_sum, 0 );
+   atomic_swap( m_min, UINT64_MAX );
+   atomic_swap( m_max, 0 );
+}
+
+int FDLatencyHistogram::bucket( uint64_t us )
+{
+   if ( us < SubBuckets )
+      return (int)us;
+
+   int m = 63 - __builtin_clzll( us );
+   int idx = ( m - 3 ) * SubBuckets + (int)( ( us >> ( m - 4 ) ) - SubBuckets );
+
+   return idx < Buckets ? idx : Buckets - 1;
+}
+
+uint64_t FDLatencyHistogram::bucketHigh( int idx )
+{
+   if ( idx < SubBuckets )
+      return idx;
+
+   int m = idx / SubBuckets + 3;
+   uint64_t low = (uint64_t)( SubBuckets + idx % SubBuckets ) << ( m - 4 );
+
+   return low + ( (uint64_t)1 << ( m - 4 ) ) - 1;
+}
+
+void FDLatencyHistogram::record( uint64_t us )
+{
+   uint64_t v;
+
+   atomic_inc( m_counts[ bucket( us ) ] );
+   atomic_inc( m_count );
+   atomic_add( m_sum, us );
+
+   while ( us < ( v = m_min ) && atomic_cas( m_min, v, us ) != v );
+   while ( us > ( v = m_max ) && atomic_cas( m_max, v, us ) != v );
+}
+
+uint64_t FDLatencyHistogram::getPercentile( double pct ) const
+{
+   uint64_t count = m_count;
+
+   if ( count == 0 )
+      return 0;
+
+   uint64_t target = (uint64_t)std::ceil( pct / 100.0 * count );
+   uint64_t total = 0;
+
+   if ( target == 0 )
+      target = 1;
+
+   for ( int i = 0; i < Buckets; i++ )
+   {
+      total += m_counts[i];
+      if ( total >= target )
+         return std::min( bucketHigh( i ), m_max );
+   }
+
+   return m_max;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+FDRequestStatsEntry::FDRequestStatsEntry( FDRequestStatsType type, application_id_t app, command_code_t cmd, const std::string &peer )
+   : m_type( type ),
+     m_app( app ),
+     m_cmd( cmd ),
+     m_peer( peer ),
+     m_inflight( 0 )
+{
+   reset();
+}
+
+void FDRequestStatsEntry::reset()
+{
+   // the in flight count is a gauge and is not reset
+   atomic_swap( m_sent, 0 );
+   atomic_swap( m_answered, 0 );
+   atomic_swap( m_timeouts, 0 );
+   atomic_swap( m_senderrors, 0 );
+   m_latency.reset();
+   for ( int i = 0; i < ResultCodes; i++ )
+   {
+      atomic_swap( m_codes[i].code, 0 );
+      atomic_swap( m_codes[i].count, 0 );
+   }
+   atomic_swap( m_othercodes, 0 );
+   atomic_swap( m_nocode, 0 );
+}
+
+int FDRequestStatsEntry::getResultCodeCount() const
+{
+   int cnt = 0;
+
+   while ( cnt < ResultCodes && m_codes[cnt].code != 0 )
+      cnt++;
+
+   return cnt;
+}
+
+void FDRequestStatsEntry::sending()
+{
+   // counted before the request is sent since the answer can arrive first
+   atomic_inc( m_inflight );
+}
+
+void FDRequestStatsEntry::sent()
+{
+   atomic_inc( m_sent );
+}
+
+void FDRequestStatsEntry::sendFailed()
+{
+   atomic_dec( m_inflight );
+   atomic_inc( m_senderrors );
+}
+
+void FDRequestStatsEntry::answered( uint64_t us, uint32_t resultcode )
+{
+   atomic_dec( m_inflight );
+   atomic_inc( m_answered );
+   m_latency.record( us );
+
+   if ( resultcode == 0 )
+   {
+      atomic_inc( m_nocode );
+      return;
+   }
+
+   // slots are claimed with a compare and swap in the order the result
+   // codes are first seen and are never released
+   for ( int i = 0; i < ResultCodes; i++ )
+   {
+      uint32_t code = m_codes[i].code;
+
+      if ( code == 0 )
+      {
+         code = atomic_cas( m_codes[i].code, 0, resultcode );
+         if ( code == 0 )
+            code = resultcode;
+      }
+
+      if ( code == resultcode )
+      {
+         atomic_inc( m_codes[i].count );
+         return;
+      }
+   }
+
+   atomic_inc( m_othercodes );
+}
+
+void FDRequestStatsEntry::timedOut()
+{
+   atomic_dec( m_inflight );
+   atomic_inc( m_timeouts );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool FDRequestStats::m_enabled = true;
+ERWLock FDRequestStats::m_rwlock;
+std::unordered_map<uint64_t,FDRequestStatsEntry*> FDRequestStats::m_applications;
+std::unordered_map<uint64_t,FDRequestStatsEntry*> FDRequestStats::m_commands;
+std::unordered_map<std::string,FDRequestStatsEntry*> FDRequestStats::m_peers;
+
+template<class K>
+static FDRequestStatsEntry *getStatsEntry( ERWLock &rwlock, std::unordered_map<K,FDRequestStatsEntry*> &entries, const K &key,
+   FDRequestStatsType type, application_id_t app, command_code_t cmd, const std::string &peer )
+{
+   {
+      ERDLock l( rwlock );
+      typename std::unordered_map<K,FDRequestStatsEntry*>::iterator it = entries.find( key );
+      if ( it != entries.end() )
+         return it->second;
+   }
+
+   EWRLock l( rwlock );
+   typename std::unordered_map<K,FDRequestStatsEntry*>::iterator it = entries.find( key );
+   if ( it == entries.end() )
+      it = entries.insert( std::make_pair( key, new FDRequestStatsEntry( type, app, cmd, peer ) ) ).first;
+
+   return it->second;
+}
+
+FDRequestStatsEntry *FDRequestStats::getApplication( application_id_t app )
+{
+   return getStatsEntry( m_rwlock, m_applications, (uint64_t)app, RSTApplication, app, 0, std::string() );
+}
+
+FDRequestStatsEntry *FDRequestStats::getCommand( application_id_t app, command_code_t cmd )
+{
+   return getStatsEntry( m_rwlock, m_commands, ( (uint64_t)app << 32 ) | cmd, RSTCommand, app, cmd, std::string() );
+}
+
+FDRequestStatsEntry *FDRequestStats::getPeer( const std::string &peer )
+{
+   return getStatsEntry( m_rwlock, m_peers, peer, RSTPeer, 0, 0, peer );
+}
+
+void FDRequestStats::snapshot( std::vector<FDRequestStatsEntry> &entries )
+{
+   ERDLock l( m_rwlock );
+
+   entries.clear();
+   entries.reserve( m_applications.size() + m_commands.size() + m_peers.size() );
+
+   for ( std::unordered_map<uint64_t,FDRequestStatsEntry*>::iterator it = m_applications.begin(); it != m_applications.end(); ++it )
+      entries.push_back( *it->second );
+   for ( std::unordered_map<uint64_t,FDRequestStatsEntry*>::iterator it = m_commands.begin(); it != m_commands.end(); ++it )
+      entries.push_back( *it->second );
+   for ( std::unordered_map<std::string,FDRequestStatsEntry*>::iterator it = m_peers.begin(); it != m_peers.end(); ++it )
+      entries.push_back( *it->second );
+}
+
+void FDRequestStats::reset()
+{
+   ERDLock l( m_rwlock );
+
+   for ( std::unordered_map<uint64_t,FDRequestStatsEntry*>::iterator it = m_applications.begin(); it != m_applications.end(); ++it )
+      it->second->reset();
+   for ( std::unordered_map<uint64_t,FDRequestStatsEntry*>::iterator it = m_commands.begin(); it != m_commands.end(); ++it )
+      it->second->reset();
+   for ( std::unordered_map<std::string,FDRequestStatsEntry*>::iterator it = m_peers.begin(); it != m_peers.end(); ++it )
+      it->second->reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+ERWLock FDExtractorSchema::m_rwlock;
+std::unordered_map<std::type_index,FDExtractorSchema*> FDExtractorSchema::m_schemas;
+
+FDExtractorSchema::FDExtractorSchema( FDExtractorBase *head, int count )
+{
+   std::vector< std::pair<uint64_t,int> > sorted;
+
+   m_order.reserve( count );
+   sorted.reserve( count );
+
+   for ( FDExtractorBase *e = head; e; e = e->m_next )
+   {
+      sorted.push_back( std::make_pair( makeKey( e ), (int)m_order.size() ) );
+      m_order.push_back( sorted.back().first );
+   }
+
+   std::sort( sorted.begin(), sorted.end() );
+
+   // when the same AVP has been added more than once, the last entry added wins
+   for ( size_t i = 0; i < sorted.size(); i++ )
+   {
+      if ( !m_keys.empty() && m_keys.back() == sorted[i].first )
+      {
+         m_slots.back() = sorted[i].second;
+      }
+      else
+      {
+         m_keys.push_back( sorted[i].first );
+         m_slots.push_back( sorted[i].second );
+      }
+   }
+}
+
+uint64_t FDExtractorSchema::makeKey( FDExtractorBase *base )
+{
+   return makeKey( base->getDictionaryEntry()->getVendorId(), base->getDictionaryEntry()->getAvpCode() );
+}
+
+bool FDExtractorSchema::matches( FDExtractorBase *head, int count ) const
+{
+   if ( count != getCount() )
+      return false;
+
+   int idx = 0;
+   for ( FDExtractorBase *e = head; e; e = e->m_next )
+   {
+      if ( m_order[idx++] != makeKey( e ) )
+         return false;
+   }
+
+   return true;
+}
+
+const FDExtractorSchema *FDExtractorSchema::getSchema( const std::type_info &ti, FDExtractorBase *head, int count )
+{
+   std::type_index key( ti );
+   FDExtractorSchema *schema = NULL;
+
+   {
+      ERDLock l( m_rwlock );
+      std::unordered_map<std::type_index,FDExtractorSchema*>::iterator it = m_schemas.find( key );
+      if ( it != m_schemas.end() )
+         schema = it->second;
+   }
+
+   if ( !schema )
+   {
+      EWRLock l( m_rwlock );
+      std::unordered_map<std::type_index,FDExtractorSchema*>::iterator it = m_schemas.find( key );
+      if ( it == m_schemas.end() )
+         it = m_schemas.insert( std::make_pair( key, new FDExtractorSchema( head, count ) ) ).first;
+      schema = it->second;
+   }
+
+   // the entries of this instance may differ from the other instances of
+   // the same class, in which case the caller compiles a private schema
+   return schema->matches( head, count ) ? schema : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
 FDExtractor::FDExtractor()
    : FDExtractorBase( NULL ),
      m_parent( NULL ),
      m_reference( NULL ),
+     m_head( NULL ),
+     m_tail( NULL ),
+     m_count( 0 ),
+     m_schema( NULL ),
+     m_private( NULL ),
+     m_cursor( NULL ),
+     m_started( false ),
      m_index( 1 )
 {
 }
@@ -1843,6 +2943,13 @@ FDExtractor::FDExtractor( FDMessage &msg )
    : FDExtractorBase( NULL ),
      m_parent( NULL ),
      m_reference( msg.getMsg() ),
+     m_head( NULL ),
+     m_tail( NULL ),
+     m_count( 0 ),
+     m_schema( NULL ),
+     m_private( NULL ),
+     m_cursor( NULL ),
+     m_started( false ),
      m_index( 1 )
 {
 }
@@ -1851,41 +2958,93 @@ FDExtractor::FDExtractor( FDExtractor &parent, FDDictionaryEntryAVP &de )
    : FDExtractorBase( &de ),
      m_parent( &parent ),
      m_reference( NULL ),
+     m_head( NULL ),
+     m_tail( NULL ),
+     m_count( 0 ),
+     m_schema( NULL ),
+     m_private( NULL ),
+     m_cursor( NULL ),
+     m_started( false ),
      m_index( 1 )
 {
 }
 
 FDExtractor::~FDExtractor()
 {
+   if ( m_private )
+      delete m_private;
 }
 
 void FDExtractor::add( FDExtractorBase &base )
 {
-   FDExtractorKey k( base.getDictionaryEntry()->getVendorId(), base.getDictionaryEntry()->getAvpCode() );
-   m_entries[k] = &base;
+   // the schema is recompiled if an entry is added after the first resolve
+   if ( m_schema )
+   {
+      if ( m_private )
+         delete m_private;
+      m_private = NULL;
+      m_schema = NULL;
+      m_entries.clear();
+   }
+
+   base.m_next = NULL;
+   if ( m_tail )
+      m_tail->m_next = &base;
+   else
+      m_head = &base;
+   m_tail = &base;
+   m_count++;
+}
+
+const FDExtractorSchema &FDExtractor::getSchema()
+{
+   if ( !m_schema )
+   {
+      m_schema = FDExtractorSchema::getSchema( typeid(*this), m_head, m_count );
+      if ( !m_schema )
+         m_schema = m_private = new FDExtractorSchema( m_head, m_count );
+
+      m_entries.reserve( m_count );
+      for ( FDExtractorBase *e = m_head; e; e = e->m_next )
+         m_entries.push_back( e );
+   }
+
+   return *m_schema;
+}
+
+void FDExtractor::reset()
+{
+   FDExtractorBase::reset();
+
+   // a child extractor locates its grouped AVP in the parent
+   if ( m_parent )
+      m_reference = NULL;
+   m_cursor = NULL;
+   m_started = false;
+   m_index = 1;
+
+   for ( FDExtractorBase *e = m_head; e; e = e->m_next )
+      e->reset();
 }
 
 bool FDExtractor::exists( bool skipResolve )
 {
-   if ( !getResolved() && !skipResolve )
-      resolve();
+   if ( !skipResolve )
+      locate();
 
    return FDExtractorBase::exists();
 }
 
 msg_or_avp *FDExtractor::getReference()
 {
-   if ( !getResolved() )
-      resolve();
+   if ( !m_reference )
+      locate();
 
    return m_reference;
 }
 
-void FDExtractor::resolve()
+bool FDExtractor::locate()
 {
-   if ( getResolved() )
-      return;
-
    // if the reference is not set, then this means that the grouped AVP
    // that this extractor refers to has not been resolved.  We need to 
    // locate the grouped AVP in the parent AVP collection (msg or avp).
@@ -1899,10 +3058,11 @@ void FDExtractor::resolve()
                __FILE__, __LINE__ )
             );
 
-         m_parent->resolve();
+         // only browse the parent until this grouped AVP has been found
+         m_parent->resolve( this );
 
          if ( !exists( true ) )
-            return;
+            return false;
       }
       else
       {
@@ -1913,98 +3073,114 @@ void FDExtractor::resolve()
       }
    }
 
-   bool needToResolve = !getResolved();
+   return true;
+}
+
+void FDExtractor::resolve()
+{
+   resolve( NULL );
+}
 
-   setResolved();
+void FDExtractor::resolve( FDExtractorBase *target )
+{
+   if ( getResolved() || !locate() )
+      return;
 
-   // check to see if the parent AVP (reference) exists
-   //if ( m_reference && !getResolved() )
-   if ( m_reference && needToResolve )
-   {
-      msg_or_avp *loopavp;
+   const FDExtractorSchema &schema = getSchema();
+   struct avp_hdr *ah;
+   int slot;
+   int ret;
 
-      // get the first child AVP
-      int ret = fd_msg_browse_internal( m_reference, MSG_BRW_FIRST_CHILD, (msg_or_avp**)&loopavp, NULL);
+   // get the first child AVP
+   if ( !m_started )
+   {
+      ret = fd_msg_browse_internal( m_reference, MSG_BRW_FIRST_CHILD, (msg_or_avp**)&m_cursor, NULL);
       if ( ret != 0 )
          throw FDException(
             EUtility::string_format("%s:%d - ERROR - FDExtractor browse returned %d direction MSG_BRW_FIRST_CHILD",
             __FILE__, __LINE__, ret )
          );
+      m_started = true;
+   }
+
+   // continue from where the previous call stopped until the target has
+   // been found, a list target always requires browsing to the last AVP
+   while ( m_cursor )
+   {
+      msg_or_avp *loopavp = m_cursor;
+
+      // get a pointer to the avp header to access the vendor id and avp code
+      ret = fd_msg_avp_hdr( (struct avp *)loopavp, &ah );
+      if ( ret != 0 )
+         throw FDException(
+            EUtility::string_format("%s:%d - ERROR - FDExtractor fd_msg_avp_hdr returned %d",
+            __FILE__, __LINE__, ret )
+         );
 
-      struct avp_hdr *ah;
-      FDExtractorKey key;
-      std::map<FDExtractorKey,FDExtractorBase*>::iterator it;
+      // get the next AVP
+      ret = fd_msg_browse_internal( loopavp, MSG_BRW_NEXT, (msg_or_avp**)&m_cursor, NULL );
+      if ( ret != 0 )
+         throw FDException(
+            EUtility::string_format("%s:%d - ERROR - FDExtractor browse returned %d direction MSG_BRW_NEXT",
+            __FILE__, __LINE__, ret )
+         );
 
-      while ( loopavp )
+      // lookup up the entry
+      if ( (slot = schema.find( ah->avp_vendor, ah->avp_code )) != -1 )
       {
-         // get a pointer to the avp header to access the vendor id and avp code
-         ret = fd_msg_avp_hdr( (struct avp *)loopavp, &ah );
-         if ( ret != 0 )
-            throw FDException(
-               EUtility::string_format("%s:%d - ERROR - FDExtractor fd_msg_avp_hdr returned %d",
-               __FILE__, __LINE__, ret )
-            );
-   
-         // set the vendor id and avp code in the key
-         key.setVendor( ah->avp_vendor );
-         key.setAvpCode( ah->avp_code );
-      
-         // lookup up the entry
-         if ( (it = m_entries.find(key)) != m_entries.end() )
-         {
+         FDExtractorBase *entry = m_entries[slot];
 
-            switch ( it->second->getExtractorType() )
+         switch ( entry->getExtractorType() )
+         {
+            case etAvp:
             {
-               case etAvp:
-               {
-                  FDExtractorAvp *a = (FDExtractorAvp*)it->second;
-                  a->setIndex( m_index++ );
-                  a->setResolved();
-                  a->setAvp( (struct avp *)loopavp );
-                  break;
-               }
-               case etAvpList:
+               // the first occurrence of a single AVP is the one extracted
+               FDExtractorAvp *a = (FDExtractorAvp*)entry;
+               if ( a->getIndex() == -1 )
                {
-                  FDExtractorAvpList *al = (FDExtractorAvpList*)it->second;
-                  FDExtractorAvp *a = new FDExtractorAvp( *this, *al->getDictionaryEntry() );
                   a->setIndex( m_index++ );
                   a->setResolved();
                   a->setAvp( (struct avp *)loopavp );
-                  al->getList().push_back( a );
-                  al->setResolved();
-                  break;
                }
-               case etExtractor:
-               {
-                  FDExtractor *e = (FDExtractor*)it->second;
-                  e->setIndex( m_index++ );
-                  e->setReference( loopavp );
-                  break;
-               }
-               case etExtractorList:
+               break;
+            }
+            case etAvpList:
+            {
+               FDExtractorAvpList *al = (FDExtractorAvpList*)entry;
+               FDExtractorAvp *a = al->nextAvp();
+               a->setIndex( m_index++ );
+               a->setResolved();
+               a->setAvp( (struct avp *)loopavp );
+               al->setResolved();
+               break;
+            }
+            case etExtractor:
+            {
+               FDExtractor *e = (FDExtractor*)entry;
+               if ( e->getIndex() == -1 )
                {
-                  FDExtractorList *el = (FDExtractorList*)it->second;
-                  FDExtractor *e = el->createExtractor();
                   e->setIndex( m_index++ );
                   e->setReference( loopavp );
-                  el->getList().push_back( e );
-                  el->setResolved();
-                  break;
                }
+               break;
+            }
+            case etExtractorList:
+            {
+               FDExtractorList *el = (FDExtractorList*)entry;
+               FDExtractor *e = el->nextExtractor();
+               e->setIndex( m_index++ );
+               e->setReference( loopavp );
+               el->setResolved();
+               break;
             }
          }
 
-         // get the next AVP
-         ret = fd_msg_browse_internal( loopavp, MSG_BRW_NEXT, (msg_or_avp**)&loopavp, NULL );
-         if ( ret != 0 )
-            throw FDException(
-               EUtility::string_format("%s:%d - ERROR - FDExtractor browse returned %d direction MSG_BRW_NEXT",
-               __FILE__, __LINE__, ret )
-            );
+         if ( target && target->getIndex() != -1 )
+            return;
       }
    }
 
-//   setResolved();
+   setResolved();
 }
 
 void FDExtractor::dump()
@@ -2054,6 +3230,8 @@ FDExtractorList::~FDExtractorList()
 {
    std::list<FDExtractor*>::iterator it;
 
+   m_list.splice( m_list.end(), m_spare );
+
    while ( (it = m_list.begin()) != m_list.end() )
    {
       delete *it;
@@ -2061,6 +3239,29 @@ FDExtractorList::~FDExtractorList()
    }
 }
 
+void FDExtractorList::reset()
+{
+   FDExtractorBase::reset();
+
+   // keep the extractors (and their list nodes) for the next message
+   m_spare.splice( m_spare.end(), m_list );
+}
+
+FDExtractor *FDExtractorList::nextExtractor()
+{
+   if ( m_spare.empty() )
+   {
+      m_list.push_back( createExtractor() );
+   }
+   else
+   {
+      m_list.splice( m_list.end(), m_spare, m_spare.begin() );
+      m_list.back()->reset();
+   }
+
+   return m_list.back();
+}
+
 void FDExtractorList::addExtractor( FDExtractor *e )
 {
    m_list.push_back( e );
@@ -2073,7 +3274,8 @@ bool FDExtractorList::exists()
 
 std::list<FDExtractor*> &FDExtractorList::getList()
 {
-   if ( !getResolved() && m_parent )
+   // more elements may follow the ones found by a partial resolve
+   if ( m_parent )
       m_parent->resolve();
 
    return m_list;
@@ -2095,15 +3297,15 @@ FDExtractorAvp::~FDExtractorAvp()
 bool FDExtractorAvp::exists()
 {
    if ( !getResolved() )
-      m_extractor.resolve();
+      m_extractor.resolve( this );
 
    return FDExtractorBase::exists();
 }
 
 void FDExtractorAvp::dump()
 {
-   if ( m_extractor.getResolved() )
-      m_extractor.resolve();
+   if ( !getResolved() )
+      m_extractor.resolve( this );
 
    m_avp.dump();
 }
@@ -2128,6 +3330,8 @@ FDExtractorAvpList::~FDExtractorAvpList()
 {
    std::list<FDExtractorAvp*>::iterator it;
 
+   m_list.splice( m_list.end(), m_spare );
+
    while ( (it = m_list.begin()) != m_list.end() )
    {
       delete *it;
@@ -2135,6 +3339,24 @@ FDExtractorAvpList::~FDExtractorAvpList()
    }
 }
 
+void FDExtractorAvpList::reset()
+{
+   FDExtractorBase::reset();
+
+   // keep the extractor avps (and their list nodes) for the next message
+   m_spare.splice( m_spare.end(), m_list );
+}
+
+FDExtractorAvp *FDExtractorAvpList::nextAvp()
+{
+   if ( m_spare.empty() )
+      m_list.push_back( new FDExtractorAvp( *m_parent, *getDictionaryEntry() ) );
+   else
+      m_list.splice( m_list.end(), m_spare, m_spare.begin() );
+
+   return m_list.back();
+}
+
 bool FDExtractorAvpList::exists()
 {
    return !getList().empty();
@@ -2142,7 +3364,8 @@ bool FDExtractorAvpList::exists()
 
 std::list<FDExtractorAvp*> &FDExtractorAvpList::getList()
 {
-   if ( !getResolved() && m_parent )
+   // more elements may follow the ones found by a partial resolve
+   if ( m_parent )
       m_parent->resolve();
 
    return m_list;
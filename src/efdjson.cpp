@@ -48,6 +48,7 @@
 #include <iostream>
 #include <iomanip>
 #include <unordered_map>
+#include <vector>
 
 #include "freeDiameter/freeDiameter-host.h"
 #include "freeDiameter/libfdcore.h"
@@ -55,6 +56,7 @@
 
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/stringbuffer.h"
@@ -151,6 +153,7 @@ public:
       m_baseentry = NULL;
       memset(&m_basedata, 0, sizeof(m_basedata));
       m_type = ADTUnknown;
+      m_derived = false;
    }
    ~AvpDictionaryEntry()
    {
@@ -159,25 +162,35 @@ public:
    void init(const char *avp_name)
    {
       int ret = 0;
-
-      m_avp_name = avp_name;
+      struct dict_object *entry = NULL;
 
       /* get the dictionary entry for the AVP */
-      ret = fd_dict_search( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_ALL_VENDORS, avp_name, &m_baseentry, ENOENT );
+      ret = fd_dict_search( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_ALL_VENDORS, avp_name, &entry, ENOENT );
       if (ret != 0)
          throw runtimeInfo(
             string_format("%s:%d - INFO - Unable to find AVP dictionary entry  for [%s]",
             __FILE__, __LINE__, avp_name)
          );
 
+      init(entry);
+   }
+
+   void init(struct dict_object *entry)
+   {
+      int ret = 0;
+
+      m_baseentry = entry;
+
       /* get the dictionary data for the AVP's dictionary entry */
       ret = fd_dict_getval( m_baseentry, &m_basedata );
       if (ret != 0)
          throw runtimeInfo(
-            string_format("%s:%d - INFO - Unable to retrieve the dictionary data for the [%s] dictionary entry",
-            __FILE__, __LINE__, avp_name)
+            string_format("%s:%d - INFO - Unable to retrieve the dictionary data for the dictionary entry",
+            __FILE__, __LINE__)
          );
 
+      m_avp_name = m_basedata.avp_name;
+
       struct dictionary *dict = NULL;
       struct dict_object *derivedtype = NULL;
 
@@ -186,19 +199,32 @@ public:
       if (ret != 0)
          throw runtimeInfo(
             string_format("%s:%d - INFO - Unable to retrieve the dictionary for the [%s] dictionary entry",
-            __FILE__, __LINE__, avp_name)
+            __FILE__, __LINE__, m_avp_name.c_str())
          );
 
+      switch ( m_basedata.avp_basetype )
+      {
+         case AVP_TYPE_GROUPED:     { m_type = ADTGrouped; break; }
+         case AVP_TYPE_INTEGER32:   { m_type = ADTI32; break; }
+         case AVP_TYPE_INTEGER64:   { m_type = ADTI64; break; }
+         case AVP_TYPE_UNSIGNED32:  { m_type = ADTU32; break; }
+         case AVP_TYPE_UNSIGNED64:  { m_type = ADTU64; break; }
+         case AVP_TYPE_FLOAT32:     { m_type = ADTF32; break; }
+         case AVP_TYPE_FLOAT64:     { m_type = ADTF64; break; }
+         case AVP_TYPE_OCTETSTRING: { m_type = ADTOctetString; break; }
+         default:                   { m_type = ADTUnknown; break; }
+      }
+
       /* get the dictionary entry associated with the derived type */
       ret = fd_dict_search( dict, DICT_TYPE, TYPE_OF_AVP, m_baseentry, &derivedtype, EINVAL );
       if (ret == 0) /* if found, then derived */
       {
          struct dict_type_data derived_type_data;
 
-         ret = fd_dict_getval( derivedtype, &derived_type_data );
-
-         if (ret == 0)
+         if (fd_dict_getval( derivedtype, &derived_type_data ) == 0)
          {
+            m_derived = true;
+
             if      ( !strcmp( derived_type_data.type_name, "Enumerated" ) )        m_type = ADTEnumerated;
             else if ( !strcmp( derived_type_data.type_name, "Time" ) )              m_type = ADTTime;
             else if ( !strcmp( derived_type_data.type_name, "Address" ) )           m_type = ADTAddress;
@@ -206,70 +232,115 @@ public:
             else if ( !strcmp( derived_type_data.type_name, "DiameterIdentity" ) )  m_type = ADTDiameterIdentity;
             else if ( !strcmp( derived_type_data.type_name, "DiameterURI" ) )       m_type = ADTDiameterURI;
             else if ( !strcmp( derived_type_data.type_name, "IPFilterRule" ) )      m_type = ADTIPFilterRule;
-            else
-            {
-               switch ( m_basedata.avp_basetype )
-               {
-                  case AVP_TYPE_GROUPED:     { m_type = ADTGrouped; break; }
-                  case AVP_TYPE_INTEGER32:   { m_type = ADTI32; break; }
-                  case AVP_TYPE_INTEGER64:   { m_type = ADTI64; break; }
-                  case AVP_TYPE_UNSIGNED32:  { m_type = ADTU32; break; }
-                  case AVP_TYPE_UNSIGNED64:  { m_type = ADTU64; break; }
-                  case AVP_TYPE_FLOAT32:     { m_type = ADTF32; break; }
-                  case AVP_TYPE_FLOAT64:     { m_type = ADTF64; break; }
-                  case AVP_TYPE_OCTETSTRING: { m_type = ADTOctetString; break; }
-                  default:                   { m_type = ADTUnknown; break; }
-               }
-            }
-         }
-         else
-         {
-            switch ( m_basedata.avp_basetype )
-            {
-               case AVP_TYPE_GROUPED:     { m_type = ADTGrouped; break; }
-               case AVP_TYPE_INTEGER32:   { m_type = ADTI32; break; }
-               case AVP_TYPE_INTEGER64:   { m_type = ADTI64; break; }
-               case AVP_TYPE_UNSIGNED32:  { m_type = ADTU32; break; }
-               case AVP_TYPE_UNSIGNED64:  { m_type = ADTU64; break; }
-               case AVP_TYPE_FLOAT32:     { m_type = ADTF32; break; }
-               case AVP_TYPE_FLOAT64:     { m_type = ADTF64; break; }
-               case AVP_TYPE_OCTETSTRING: { m_type = ADTOctetString; break; }
-               default:                   { m_type = ADTUnknown; break; }
-            }
          }
       }
-      else
-      {
-         switch ( m_basedata.avp_basetype )
-         {
-            case AVP_TYPE_GROUPED:     { m_type = ADTGrouped; break; }
-            case AVP_TYPE_INTEGER32:   { m_type = ADTI32; break; }
-            case AVP_TYPE_INTEGER64:   { m_type = ADTI64; break; }
-            case AVP_TYPE_UNSIGNED32:  { m_type = ADTU32; break; }
-            case AVP_TYPE_UNSIGNED64:  { m_type = ADTU64; break; }
-            case AVP_TYPE_FLOAT32:     { m_type = ADTF32; break; }
-            case AVP_TYPE_FLOAT64:     { m_type = ADTF64; break; }
-            case AVP_TYPE_OCTETSTRING: { m_type = ADTOctetString; break; }
-            default:                   { m_type = ADTUnknown; break; }
-         }
-      }
-
    }
 
    const std::string &getAvpName() { return m_avp_name; }
    struct dict_object *getBaseEntry() { return m_baseentry; }
    struct dict_avp_data &getBaseData() { return m_basedata; }
    AvpDataType getType() { return m_type; }
+   bool isDerived() { return m_derived; }
 
 private:
    std::string m_avp_name;
    struct dict_object *m_baseentry;
    struct dict_avp_data m_basedata;
    AvpDataType m_type;
+   bool m_derived;
 };
 
-static EMutexPrivate dictEntriesMutex;
-static std::unordered_map<std::string,AvpDictionaryEntry*> dictEntries;
+/*
+ * Process wide cache of the resolved AVP dictionary information indexed by
+ * AVP name (JSON to AVP) and by dictionary object (AVP to JSON).  Entries
+ * are never removed since freeDiameter does not release dictionary objects.
+ */
+class AvpDictionaryCache
+{
+public:
+   static AvpDictionaryEntry *find( const char *avp_name )
+   {
+      {
+         ERDLock l( m_rwlock );
+         auto it = m_byname.find( avp_name );
+         if ( it != m_byname.end() )
+            return it->second;
+      }
+
+      EWRLock l( m_rwlock );
+
+      auto it = m_byname.find( avp_name );
+      if ( it != m_byname.end() )
+         return it->second;
+
+      AvpDictionaryEntry *ade = new AvpDictionaryEntry();
+      try
+      {
+         ade->init( avp_name );
+      }
+      catch (...)
+      {
+         delete ade;
+         throw;
+      }
+
+      return insert( avp_name, ade );
+   }
+
+   static AvpDictionaryEntry *find( struct dict_object *entry )
+   {
+      {
+         ERDLock l( m_rwlock );
+         auto it = m_byentry.find( entry );
+         if ( it != m_byentry.end() )
+            return it->second;
+      }
+
+      EWRLock l( m_rwlock );
+
+      auto it = m_byentry.find( entry );
+      if ( it != m_byentry.end() )
+         return it->second;
+
+      AvpDictionaryEntry *ade = new AvpDictionaryEntry();
+      try
+      {
+         ade->init( entry );
+      }
+      catch (...)
+      {
+         delete ade;
+         throw;
+      }
+
+      return insert( ade->getAvpName().c_str(), ade );
+   }
+
+private:
+   /* called with the write lock held, an entry is shared by both indexes */
+   static AvpDictionaryEntry *insert( const char *avp_name, AvpDictionaryEntry *ade )
+   {
+      auto byentry = m_byentry.insert( std::make_pair( ade->getBaseEntry(), ade ) );
+      if ( !byentry.second )
+      {
+         /* the same AVP was cached under a different name */
+         delete ade;
+         ade = byentry.first->second;
+      }
+
+      m_byname.insert( std::make_pair( std::string(avp_name), ade ) );
+
+      return ade;
+   }
+
+   static ERWLock m_rwlock;
+   static std::unordered_map<std::string,AvpDictionaryEntry*> m_byname;
+   static std::unordered_map<struct dict_object*,AvpDictionaryEntry*> m_byentry;
+};
+
+ERWLock AvpDictionaryCache::m_rwlock;
+std::unordered_map<std::string,AvpDictionaryEntry*> AvpDictionaryCache::m_byname;
+std::unordered_map<struct dict_object*,AvpDictionaryEntry*> AvpDictionaryCache::m_byentry;
 
 class AVP
 {
@@ -328,36 +399,11 @@ private:
       mAvp = NULL;
       memset( &mValue, 0, sizeof(mValue) );
 
-      /* check if an entry exists in dictEntries */
-      std::string an = avp_name;
-      auto it = dictEntries.find(an);
-      if (it == dictEntries.end())
-      {
-         EMutexLock l(dictEntriesMutex);
-
-         it = dictEntries.find(an);
-         if (it == dictEntries.end())
-         {
-            AvpDictionaryEntry *ade = new AvpDictionaryEntry();
-            ade->init(avp_name);
-            std::pair<std::string,AvpDictionaryEntry*> data(ade->getAvpName(), ade);
-            auto result = dictEntries.insert(data);
-            if (result.second == false)
-            {
-               delete ade;
-               throw runtimeInfo(
-                  string_format("%s:%d - WARN - Unable to insert AvpDictionaryEntry for [%s]",
-                  __FILE__, __LINE__, avp_name)
-               );
-            }
+      AvpDictionaryEntry *ade = AvpDictionaryCache::find( avp_name );
 
-            it = result.first;
-         }
-      }
-
-      mBaseEntry = it->second->getBaseEntry();
-      memcpy( &mBaseData, &it->second->getBaseData(), sizeof(mBaseData));
-      mType = it->second->getType();
+      mBaseEntry = ade->getBaseEntry();
+      memcpy( &mBaseData, &ade->getBaseData(), sizeof(mBaseData));
+      mType = ade->getType();
    }
 
    void _addTo( msg_or_avp *reference )
@@ -404,7 +450,7 @@ private:
    union avp_value mValue;
 };
 
-#define THROW_DATATYPE_MISMATCH() \
+#define THROW_DATATYPE_MISMATCH(jsontype) \
 { \
    throw runtimeInfo( string_format("%s:%d - INFO - Datatype mismatch for [%s] - expected datatype compatible with %s, JSON data type was %s", \
       __FILE__, __LINE__, name, \
@@ -424,13 +470,7 @@ private:
       avp.getType() == ADTDiameterURI ? "ADTDiameterURI" : \
       avp.getType() == ADTEnumerated ? "ADTEnumerated" : \
       avp.getType() == ADTIPFilterRule ? "ADTIPFilterRule" : "UNKNOWN", \
-      value.GetType() == RAPIDJSON_NAMESPACE::kNullType ? "kNullType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kFalseType ? "kFalseType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kTrueType ? "kTrueType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kObjectType ? "kObjectType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kArrayType ? "kArrayType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kStringType ? "kStringType" : \
-      value.GetType() == RAPIDJSON_NAMESPACE::kNumberType ? "kNumber" : "Unknown") ); \
+      jsontype) ); \
 }
 
 static bool isHexString( const char *s, int len )
@@ -483,269 +523,522 @@ static bool isHexString( const char *s, int len )
    return true;
 }
 
-static void fdJsonAddAvps( AVP &avp, const RAPIDJSON_NAMESPACE::Value &element, void (*errfunc)(const char*) );
-static void fdJsonAddAvps( msg_or_avp *reference, const RAPIDJSON_NAMESPACE::Value &element, void (*errfunc)(const char*) );
+/*
+ * A JSON number as reported by the SAX reader along with the rapidjson
+ * DOM type checks that are used to validate it against the AVP type.
+ */
+class fdJsonNumber
+{
+public:
+   fdJsonNumber( int64_t v )
+      : m_int( v >= INT32_MIN && v <= INT32_MAX ),
+        m_uint( v >= 0 && v <= UINT32_MAX ),
+        m_int64( true ),
+        m_uint64( v >= 0 ),
+        m_double( false )
+   {
+      m_v.i64 = v;
+   }
+
+   fdJsonNumber( uint64_t v )
+      : m_int( v <= INT32_MAX ),
+        m_uint( v <= UINT32_MAX ),
+        m_int64( v <= INT64_MAX ),
+        m_uint64( true ),
+        m_double( false )
+   {
+      m_v.u64 = v;
+   }
+
+   fdJsonNumber( double v )
+      : m_int( false ),
+        m_uint( false ),
+        m_int64( false ),
+        m_uint64( false ),
+        m_double( true )
+   {
+      m_v.d = v;
+   }
+
+   bool IsInt() const { return m_int; }
+   bool IsInt64() const { return m_int64; }
+   bool IsUint() const { return m_uint; }
+   bool IsUint64() const { return m_uint64; }
+   bool IsFloat() const { return m_double && m_v.d >= -3.4028234e38 && m_v.d <= 3.4028234e38; }
+   bool IsDouble() const { return m_double; }
 
-static void fdJsonAddAvp( msg_or_avp *reference, const char *name, const RAPIDJSON_NAMESPACE::Value &value, void (*errfunc)(const char*) )
+   int32_t GetInt() const { return (int32_t)m_v.i64; }
+   int64_t GetInt64() const { return m_v.i64; }
+   uint32_t GetUint() const { return (uint32_t)m_v.u64; }
+   uint64_t GetUint64() const { return m_v.u64; }
+   float GetFloat() const { return (float)m_v.d; }
+   double GetDouble() const { return m_v.d; }
+
+private:
+   bool m_int;
+   bool m_uint;
+   bool m_int64;
+   bool m_uint64;
+   bool m_double;
+   union
+   {
+      int64_t i64;
+      uint64_t u64;
+      double d;
+   } m_v;
+};
+
+static void fdJsonAddNumber( msg_or_avp *reference, const char *name, const fdJsonNumber &value )
 {
-   int ret;
    AVP avp( name );
 
-   switch (value.GetType())
+   switch ( avp.getBaseType() )
    {
-      case RAPIDJSON_NAMESPACE::kFalseType:
-      case RAPIDJSON_NAMESPACE::kTrueType:
-      {
-         throw runtimeInfo( string_format("%s:%d - INFO - Invalid format (true/false) for [%s] in JSON block, ignoring", __FILE__, __LINE__, name) );
+      case AVP_TYPE_INTEGER32: {
+         if (!value.IsInt()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( (int32_t)value.GetInt() );
          break;
       }
-      case RAPIDJSON_NAMESPACE::kNullType:
-      {
-         throw runtimeInfo( string_format("%s:%d - INFO - Invalid NULL for [%s] in JSON block, ignoring", __FILE__, __LINE__, name) );
+      case AVP_TYPE_INTEGER64: {
+         if (!value.IsInt64()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( value.GetInt64() );
+         break;
+      }
+      case AVP_TYPE_UNSIGNED32: {
+         if (!value.IsUint()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( (uint32_t)value.GetUint() );
+         break;
+      }
+      case AVP_TYPE_UNSIGNED64: {
+         if (!value.IsUint64()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( value.GetUint64() );
+         break;
+      }
+      case AVP_TYPE_FLOAT32: {
+         if (!value.IsFloat()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( value.GetFloat() );
          break;
       }
-      case RAPIDJSON_NAMESPACE::kNumberType:
+      case AVP_TYPE_FLOAT64: {
+         if (!value.IsDouble()) THROW_DATATYPE_MISMATCH("kNumber");
+         avp.set( value.GetDouble() );
+         break;
+      }
+      default:
       {
-         switch ( avp.getBaseType() )
-         {
-            case AVP_TYPE_INTEGER32: {
-               if (!value.IsInt()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetInt() );
-               break;
-            }
-            case AVP_TYPE_INTEGER64: {
-               if (!value.IsInt64()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetInt64() );
-               break;
-            }
-            case AVP_TYPE_UNSIGNED32: {
-               if (!value.IsUint()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetUint() );
-               break;
-            }
-            case AVP_TYPE_UNSIGNED64: {
-               if (!value.IsUint64()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetUint64() );
-               break;
-            }
-            case AVP_TYPE_FLOAT32: {
-               if (!value.IsFloat()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetFloat() );
-               break;
-            }
-            case AVP_TYPE_FLOAT64: {
-               if (!value.IsDouble()) THROW_DATATYPE_MISMATCH();
-               avp.set( value.GetDouble() );
-               break;
-            }
-            default:
-            {
-               THROW_DATATYPE_MISMATCH();
-            }
-         }
+         THROW_DATATYPE_MISMATCH("kNumber");
+      }
+   }
 
-         avp.addTo( reference );
+   avp.addTo( reference );
+}
 
-         break;
+static void fdJsonAddString( msg_or_avp *reference, const char *name, const char *str, size_t rawlen )
+{
+   AVP avp( name );
+
+   if ( avp.getBaseType() != AVP_TYPE_OCTETSTRING )
+      THROW_DATATYPE_MISMATCH("kStringType");
+
+   if ( avp.getType() == ADTAddress )
+   {
+      sSS ss;
+      char abuf[18];
+
+      if (inet_pton(AF_INET,str,&((sSA4*)&ss)->sin_addr) == 1)
+      {
+         *(uint16_t *)abuf = htons(1);
+         memcpy(abuf + 2, &((sSA4*)&ss)->sin_addr.s_addr, 4);
+         avp.set( (uint8_t*)abuf, 6 );
+      }
+      else if (inet_pton(AF_INET6,str,&((sSA6*)&ss)->sin6_addr) == 1)
+      {
+         *(uint16_t *)abuf = htons(2);
+         memcpy(abuf + 2, &((sSA6*)&ss)->sin6_addr.s6_addr, 16);
+         avp.set( (uint8_t*)abuf, 18 );
       }
-      case RAPIDJSON_NAMESPACE::kStringType:
+      else
       {
-         if ( avp.getBaseType() != AVP_TYPE_OCTETSTRING )
-            THROW_DATATYPE_MISMATCH();
-         
-         size_t rawlen = strlen( value.GetString() );
+         avp.set( (uint8_t*)str, rawlen );
+      }
 
-         if ( avp.getType() == ADTAddress )
-         {
-            sSS ss;
-            char abuf[18];
+      /* abuf goes out of scope */
+      avp.addTo( reference );
+      return;
+   }
+   else if ( avp.getType() == ADTTime )
+   {
+      union {
+         uint32_t u;
+         uint8_t u8[ sizeof( uint32_t ) ];
+      } val;
+      ETime t;
+      ntp_time_t ntp;
 
-            if (inet_pton(AF_INET,value.GetString(),&((sSA4*)&ss)->sin_addr) == 1)
-            {
-               *(uint16_t *)abuf = htons(1);
-               memcpy(abuf + 2, &((sSA4*)&ss)->sin_addr.s_addr, 4);
-               avp.set( (uint8_t*)abuf, 6 );
-            }
-            else if (inet_pton(AF_INET6,value.GetString(),&((sSA6*)&ss)->sin6_addr) == 1)
-            {
-               *(uint16_t *)abuf = htons(2);
-               memcpy(abuf + 2, &((sSA6*)&ss)->sin6_addr.s6_addr, 16);
-               avp.set( (uint8_t*)abuf, 18 );
-            }
-            else
-            {
-               avp.set( (uint8_t*)value.GetString(), rawlen );
-            }
-         }
-         else if ( avp.getType() == ADTTime )
-         {
-            union {
-               uint32_t u;
-               uint8_t u8[ sizeof( uint32_t ) ];
-            } val;
-            ETime t;
-            ntp_time_t ntp;
+      t.ParseDateTime( str, false );
 
-            t.ParseDateTime( value.GetString(), false );
+      t.getNTPTime( ntp );
 
-            t.getNTPTime( ntp );
+      val.u = ntp.second;
 
-            val.u = ntp.second;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      uint8_t u8;
+      u8 = val.u8[0]; val.u8[0] = val.u8[3]; val.u8[3] = u8;
+      u8 = val.u8[1]; val.u8[1] = val.u8[2]; val.u8[2] = u8;
+#endif
 
-      #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-            uint8_t u8;
-            u8 = val.u8[0]; val.u8[0] = val.u8[3]; val.u8[3] = u8;
-            u8 = val.u8[1]; val.u8[1] = val.u8[2]; val.u8[2] = u8;
-      #endif
+      avp.set( val.u8, sizeof(uint32_t) );
 
-            avp.set( val.u8, sizeof(uint32_t) );
-         }
-         else if ( avp.getType() == ADTOctetString )
-         {
-            if ( isHexString( (const char *)value.GetString(), rawlen ) )
-            {
-               /*
-                * hex string format is "0x" or "0X" followed by an even number of hex characters
-                * binlen is equal to the final length + 1
-                */
-               size_t binlen = rawlen / 2;
-
-               /*
-                * allocate space for the binary string
-                */
-               avp.allocBuffer( binlen - 1 );
-
-               /*
-                * grab a pointer to the hex character buffer
-                */
-               const uint8_t *p = (const uint8_t*)value.GetString();
-
-               /*
-                * create the binary string from the hex digit string
-                * start index at 1 (first hex digit divided by number of digits per byte, 2 / 2 = 1)
-                * to start at the first hex digit
-                */
-               for (int i = 1; i < binlen; i++)
-                  avp.getBuffer().get()[i-1] = (HEX2BIN(p[i * 2] ) << 4) + HEX2BIN(p[i * 2 + 1]);
-
-               /*
-                * assign the string to the avp
-                */
-               avp.set( avp.getBuffer().get(), binlen - 1 );
-            }
-            else
-            {
-               avp.set( (uint8_t*)value.GetString(), rawlen );
-            }
-         }
-         else // some variant of a standard string
-         {
-            avp.set( (uint8_t*)value.GetString(), rawlen );
-         }
+      /* val goes out of scope */
+      avp.addTo( reference );
+      return;
+   }
+   else if ( avp.getType() == ADTOctetString )
+   {
+      if ( isHexString( str, rawlen ) )
+      {
+         /*
+          * hex string format is "0x" or "0X" followed by an even number of hex characters
+          * binlen is equal to the final length + 1
+          */
+         size_t binlen = rawlen / 2;
 
-         /* add to the message/grouped avp */
-         avp.addTo( reference );
+         /*
+          * allocate space for the binary string
+          */
+         avp.allocBuffer( binlen - 1 );
 
-         break;
-      }
-      case RAPIDJSON_NAMESPACE::kArrayType:
-      {
-         /* iterate through array elements adding them to reference */
-         for (RAPIDJSON_NAMESPACE::Value::ConstValueIterator it = value.Begin();
-              it != value.End();
-              ++it)
-         {
-            fdJsonAddAvp( reference, name, *it, errfunc );
-         }
-         break;
-      }
-      case RAPIDJSON_NAMESPACE::kObjectType:
-      {
-         avp.addTo( reference );
-         fdJsonAddAvps( avp, value, errfunc );
-         break;
+         /*
+          * grab a pointer to the hex character buffer
+          */
+         const uint8_t *p = (const uint8_t*)str;
+
+         /*
+          * create the binary string from the hex digit string
+          * start index at 1 (first hex digit divided by number of digits per byte, 2 / 2 = 1)
+          * to start at the first hex digit
+          */
+         for (size_t i = 1; i < binlen; i++)
+            avp.getBuffer().get()[i-1] = (HEX2BIN(p[i * 2] ) << 4) + HEX2BIN(p[i * 2 + 1]);
+
+         /*
+          * assign the string to the avp
+          */
+         avp.set( avp.getBuffer().get(), binlen - 1 );
       }
-      default:
+      else
       {
-         throw runtimeInfo(
-            string_format("%s:%d - INFO - invalid JSON data type encountered in element [%s]",
-            __FILE__, __LINE__, name)
-         );
-         break;
+         avp.set( (uint8_t*)str, rawlen );
       }
    }
+   else // some variant of a standard string
+   {
+      avp.set( (uint8_t*)str, rawlen );
+   }
+
+   /* add to the message/grouped avp */
+   avp.addTo( reference );
 }
 
-static void fdJsonAddAvps( AVP &avp, const RAPIDJSON_NAMESPACE::Value &element, void (*errfunc)(const char*) )
+static struct avp *fdJsonAddGrouped( msg_or_avp *reference, const char *name )
 {
-   fdJsonAddAvps( avp.getAvp(), element, errfunc );
+   AVP avp( name );
+
+   avp.addTo( reference );
+
+   return avp.getAvp();
 }
 
-static void fdJsonAddAvps( msg_or_avp *reference, const RAPIDJSON_NAMESPACE::Value &element, void (*errfunc)(const char*) )
+/*
+ * rapidjson SAX handler that adds the AVPs to the message as the tokens are
+ * parsed.  Each member of an object is an AVP, an array repeats the AVP of
+ * the member and an object value is a grouped AVP.  An AVP that cannot be
+ * added is reported to errfunc and the remainder of the member is skipped.
+ */
+class fdJsonAvpHandler
 {
-   /* iterate through each of the child elements adding them to the reference */
-   for (RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it = element.MemberBegin();
-        it != element.MemberEnd();
-        ++it)
+public:
+   fdJsonAvpHandler( msg_or_avp *msg, void (*errfunc)(const char*) )
+      : m_msg( msg ),
+        m_errfunc( errfunc ),
+        m_key( NULL ),
+        m_skip( 0 ),
+        m_root( false ),
+        m_invalid( false ),
+        m_exception( false )
    {
+   }
+
+   bool Null() { return scalar( "%s:%d - INFO - Invalid NULL for [%s] in JSON block, ignoring" ); }
+   bool Bool( bool b ) { return scalar( "%s:%d - INFO - Invalid format (true/false) for [%s] in JSON block, ignoring" ); }
+   bool Int( int i ) { return number( fdJsonNumber( (int64_t)i ) ); }
+   bool Uint( unsigned u ) { return number( fdJsonNumber( (uint64_t)u ) ); }
+   bool Int64( int64_t i ) { return number( fdJsonNumber( i ) ); }
+   bool Uint64( uint64_t u ) { return number( fdJsonNumber( u ) ); }
+   bool Double( double d ) { return number( fdJsonNumber( d ) ); }
+   bool RawNumber( const char *str, RAPIDJSON_NAMESPACE::SizeType length, bool copy ) { return false; }
+
+   bool String( const char *str, RAPIDJSON_NAMESPACE::SizeType length, bool copy )
+   {
+      if ( !value() )
+         return !m_invalid;
+
       try
       {
-         fdJsonAddAvp( reference, it->name.GetString(), it->value, errfunc );
+         fdJsonAddString( reference(), name(), str, length );
       }
       catch (runtimeInfo &exi)
       {
-         errfunc( exi.what() );
+         skip( exi, false );
       }
+      catch (runtimeError &ex)
+      {
+         return exception( ex );
+      }
+
+      return true;
    }
-}
 
-int fdJsonAddAvps( const char *json, msg_or_avp *msg, void (*errfunc)(const char*) )
-{
-   int ret = FDJSON_SUCCESS;
-   RAPIDJSON_NAMESPACE::Document doc;
+   bool Key( const char *str, RAPIDJSON_NAMESPACE::SizeType length, bool copy )
+   {
+      /* in-situ parsing leaves the key in the input buffer */
+      if ( m_skip == 0 )
+         m_key = str;
+      return true;
+   }
 
-   if (!json) {
-      errfunc( string_format("%s:%d - ERROR - Error parsing JSON string", __FILE__, __LINE__).c_str() );
-      return FDJSON_JSON_PARSING_ERROR;
+   bool StartObject()
+   {
+      if ( !m_root )
+      {
+         /* the document is an object whose members are added to the message */
+         m_root = true;
+         m_stack.push_back( Frame( m_msg ) );
+         return true;
+      }
+
+      if ( !value() )
+      {
+         m_skip++;
+         return !m_invalid;
+      }
+
+      try
+      {
+         m_stack.push_back( Frame( fdJsonAddGrouped( reference(), name() ) ) );
+      }
+      catch (runtimeInfo &exi)
+      {
+         skip( exi, true );
+      }
+      catch (runtimeError &ex)
+      {
+         return exception( ex );
+      }
+
+      return true;
    }
 
-   if (doc.Parse<RAPIDJSON_NAMESPACE::kParseNoFlags>(json).HasParseError()) {
-      errfunc( string_format("%s:%d - ERROR - Error parsing JSON string", __FILE__, __LINE__).c_str() );
-      return FDJSON_JSON_PARSING_ERROR;
+   bool EndObject( RAPIDJSON_NAMESPACE::SizeType memberCount )
+   {
+      if ( m_skip > 0 )
+         m_skip--;
+      else
+         m_stack.pop_back();
+      return true;
    }
 
-   try
+   bool StartArray()
    {
-      for (RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it = doc.MemberBegin();
-           it != doc.MemberEnd();
-           ++it)
+      if ( !value() )
       {
-         fdJsonAddAvp( msg, it->name.GetString(), it->value, errfunc );
+         m_skip++;
+         return !m_invalid;
       }
+
+      /* each element of the array is added as the member's AVP */
+      m_stack.push_back( Frame( name() ) );
+      return true;
    }
-   catch (runtimeError &ex)
+
+   bool EndArray( RAPIDJSON_NAMESPACE::SizeType elementCount )
+   {
+      if ( m_skip > 0 )
+         m_skip--;
+      else
+         m_stack.pop_back();
+      return true;
+   }
+
+   /* the document was not a JSON object */
+   bool isInvalid() { return m_invalid; }
+
+   /* an AVP could not be added */
+   bool isException() { return m_exception; }
+
+private:
+   struct Frame
+   {
+      Frame( msg_or_avp *r ) : ref( r ), name( NULL ) {}
+      Frame( const char *n ) : ref( NULL ), name( n ) {}
+
+      /* the message or grouped avp for an object, NULL for an array */
+      msg_or_avp *ref;
+      /* the member name for the elements of an array */
+      const char *name;
+   };
+
+   /* returns true if the value should be added */
+   bool value()
+   {
+      if ( !m_root )
+      {
+         m_invalid = true;
+         return false;
+      }
+      return m_skip == 0;
+   }
+
+   msg_or_avp *reference()
    {
-      errfunc( ex.what() );
-      ret = FDJSON_EXCEPTION;
+      std::vector<Frame>::reverse_iterator it = m_stack.rbegin();
+      while ( !it->ref )
+         ++it;
+      return it->ref;
+   }
+
+   const char *name()
+   {
+      return m_stack.back().ref ? m_key : m_stack.back().name;
+   }
+
+   bool scalar( const char *fmt )
+   {
+      if ( !value() )
+         return !m_invalid;
+
+      runtimeInfo exi( string_format( fmt, __FILE__, __LINE__, name() ) );
+      skip( exi, false );
+
+      return true;
+   }
+
+   bool number( const fdJsonNumber &n )
+   {
+      if ( !value() )
+         return !m_invalid;
+
+      try
+      {
+         fdJsonAddNumber( reference(), name(), n );
+      }
+      catch (runtimeInfo &exi)
+      {
+         skip( exi, false );
+      }
+      catch (runtimeError &ex)
+      {
+         return exception( ex );
+      }
+
+      return true;
+   }
+
+   /*
+    * reports the error and skips the rest of the member, including any
+    * arrays the value is in and the object that was being started
+    */
+   void skip( runtimeInfo &exi, bool started )
+   {
+      m_errfunc( exi.what() );
+
+      m_skip = started ? 1 : 0;
+      while ( !m_stack.back().ref )
+      {
+         m_stack.pop_back();
+         m_skip++;
+      }
+   }
+
+   bool exception( runtimeError &ex )
+   {
+      m_errfunc( ex.what() );
+      m_exception = true;
+      return false;
+   }
+
+   msg_or_avp *m_msg;
+   void (*m_errfunc)(const char*);
+   std::vector<Frame> m_stack;
+   const char *m_key;
+   int m_skip;
+   bool m_root;
+   bool m_invalid;
+   bool m_exception;
+};
+
+int fdJsonAddAvpsInsitu( char *json, msg_or_avp *msg, void (*errfunc)(const char*) )
+{
+   if (!json) {
+      errfunc( string_format("%s:%d - ERROR - Error parsing JSON string", __FILE__, __LINE__).c_str() );
+      return FDJSON_JSON_PARSING_ERROR;
    }
 
-   return ret;
+   fdJsonAvpHandler handler( msg, errfunc );
+   RAPIDJSON_NAMESPACE::Reader reader;
+   RAPIDJSON_NAMESPACE::InsituStringStream is( json );
+
+   reader.Parse<RAPIDJSON_NAMESPACE::kParseInsituFlag>( is, handler );
+
+   if ( handler.isException() )
+      return FDJSON_EXCEPTION;
+
+   if ( reader.HasParseError() || handler.isInvalid() ) {
+      errfunc( string_format("%s:%d - ERROR - Error parsing JSON string", __FILE__, __LINE__).c_str() );
+      return FDJSON_JSON_PARSING_ERROR;
+   }
+
+   return FDJSON_SUCCESS;
 }
 
-std::string fdJsonBinaryToHex( const unsigned char *buffer, size_t len )
+int fdJsonAddAvps( const char *json, msg_or_avp *msg, void (*errfunc)(const char*) )
+{
+   if (!json) {
+      errfunc( string_format("%s:%d - ERROR - Error parsing JSON string", __FILE__, __LINE__).c_str() );
+      return FDJSON_JSON_PARSING_ERROR;
+   }
+
+   /* in-situ parsing modifies the buffer */
+   std::vector<char> buf( json, json + strlen( json ) + 1 );
+
+   return fdJsonAddAvpsInsitu( buf.data(), msg, errfunc );
+}
+
+static void fdJsonBinaryToHex( const unsigned char *buffer, size_t len, std::string &hex )
 {
    static const char *hexDigits = "0123456789ABCDEF";
-   std::stringstream ss;
 
    // add the 0x prefix
-   ss << "0x";
+   hex.resize( len * 2 + 2 );
+   hex[0] = '0';
+   hex[1] = 'x';
 
    // loop through the buffer
    for ( size_t i = 0; i < len; i++ )
-      ss << hexDigits[UPPERNIBBLE(buffer[i])] << hexDigits[LOWERNIBBLE(buffer[i])];
+   {
+      hex[i * 2 + 2] = hexDigits[UPPERNIBBLE(buffer[i])];
+      hex[i * 2 + 3] = hexDigits[LOWERNIBBLE(buffer[i])];
+   }
+}
+
+std::string fdJsonBinaryToHex( const unsigned char *buffer, size_t len )
+{
+   std::string hex;
+
+   fdJsonBinaryToHex( buffer, len, hex );
 
    // return the hex string
-   return ss.str();
+   return hex;
 }
 
 static std::string fdJsonTimeToStr( struct dict_avp_data *dictData, const unsigned char *buffer, size_t len )
@@ -774,10 +1067,9 @@ static std::string fdJsonTimeToStr( struct dict_avp_data *dictData, const unsign
    return ts;
 }
 
-static std::string fdJsonAddressToStr( struct dict_avp_data *dictData, const unsigned char *buffer, size_t len )
+static const char *fdJsonAddressToStr( struct dict_avp_data *dictData, const unsigned char *buffer, size_t len, char *str, size_t strsize )
 {
    sSS ss;
-   char str[INET6_ADDRSTRLEN];
 
    // populate the sSS structure
    memset( &ss, 0, sizeof(ss) );
@@ -826,12 +1118,12 @@ static std::string fdJsonAddressToStr( struct dict_avp_data *dictData, const uns
    {
       case AF_INET:
       {
-         inet_ntop( AF_INET, &((sSA4*)&ss)->sin_addr, str, sizeof( str ) );
+         inet_ntop( AF_INET, &((sSA4*)&ss)->sin_addr, str, strsize );
          break;
       }
       case AF_INET6:
       {
-         inet_ntop( AF_INET6, &((sSA6*)&ss)->sin6_addr, str, sizeof( str ) );
+         inet_ntop( AF_INET6, &((sSA6*)&ss)->sin6_addr, str, strsize );
          break;
       }
       default:
@@ -841,242 +1133,300 @@ static std::string fdJsonAddressToStr( struct dict_avp_data *dictData, const uns
    }
 
    // return the value
-   return std::string( str );
+   return str;
 }
 
-static void fdJsonAddMembers( msg_or_avp *ref, RAPIDJSON_NAMESPACE::Value &object, RAPIDJSON_NAMESPACE::Document::AllocatorType &allocator )
+static std::string fdJsonGetName( msg_or_avp * ref )
 {
    int ret;
-   struct avp *a;
-   struct avp_hdr *hdr;
-   struct dict_object *dictEntry;
-   struct dict_avp_data dictData;
-   struct dict_avp_data derivedData;
-   bool isDerived = false;
-
-   if ( fd_msg_browse_internal( ref, MSG_BRW_FIRST_CHILD, (msg_or_avp**)&a, NULL ) != 0 )
-      return;
+   msg_or_avp *parent;
+   struct dict_object *model;
+
+   // determine if avp or msg
+   bool isAvp = fd_msg_browse_internal( ref, MSG_BRW_PARENT, (msg_or_avp**)&parent, NULL ) == 0;
 
-   do
+   ret = fd_msg_model( ref, &model );
+   if ( ret != 0 )
+      throw runtimeError(
+         string_format("%s:%d - ERROR - error fd_msg_model() returned %d",
+            __FILE__, __LINE__, ret )
+      );
+
+   if ( isAvp )
    {
-      if ( !a )
-         break;
+      struct dict_avp_data ad;
 
-      // get the avp dictionary entry
-      ret = fd_msg_model( a, &dictEntry );
+      ret = fd_dict_getval( model, &ad );
       if ( ret != 0 )
          throw runtimeError(
-            string_format("%s:%d - INFO - error fd_msg_model() returned %d",
+            string_format("%s:%d - ERROR - error fd_dict_getval() returned %d",
                __FILE__, __LINE__, ret )
          );
 
-      // get the avp data
-      ret = fd_dict_getval( dictEntry, &dictData );
+      return std::string( ad.avp_name );
+   }
+   else
+   {
+      struct dict_cmd_data cd;
+
+      ret = fd_dict_getval( model, &cd );
       if ( ret != 0 )
          throw runtimeError(
-            string_format("%s:%d - INFO - error fd_dict_getval() returned %d",
+            string_format("%s:%d - ERROR - error fd_dict_getval() returned %d",
                __FILE__, __LINE__, ret )
          );
 
-      // the the derived type if applicable
-      if ( dictData.avp_basetype == AVP_TYPE_OCTETSTRING )
+      return std::string( cd.cmd_name );
+   }
+}
+
+/*
+ * Output streams for the rapidjson Writer that append directly to the
+ * caller's buffer, retaining any previously allocated capacity.
+ */
+class fdJsonStringStream
+{
+public:
+   typedef char Ch;
+
+   fdJsonStringStream( std::string &s ) : m_s( s ) { m_s.clear(); }
+
+   void Put( Ch c ) { m_s.push_back( c ); }
+   void Flush() {}
+
+private:
+   std::string &m_s;
+};
+
+class fdJsonMallocStream
+{
+public:
+   typedef char Ch;
+
+   fdJsonMallocStream() : m_buf( NULL ), m_len( 0 ), m_size( 0 ) {}
+   ~fdJsonMallocStream() { if (m_buf) free( m_buf ); }
+
+   void Put( Ch c )
+   {
+      if ( m_len + 1 >= m_size )
       {
-         struct dictionary *dict = NULL;
-         struct dict_object *derivedtype = NULL;
+         size_t size = m_size ? m_size * 2 : 1024;
+         char *buf = (char*)realloc( m_buf, size );
+         if ( !buf )
+            throw runtimeError(
+               string_format("%s:%d - ERROR - Unable to allocate %zu bytes for the JSON string",
+               __FILE__, __LINE__, size)
+            );
+         m_buf = buf;
+         m_size = size;
+      }
+      m_buf[m_len++] = c;
+   }
+   void Flush() {}
+
+   /* transfers ownership of the NULL terminated buffer to the caller */
+   char *release()
+   {
+      Put( '\0' );
+      char *buf = m_buf;
+      m_buf = NULL;
+      m_len = m_size = 0;
+      return buf;
+   }
+
+private:
+   char *m_buf;
+   size_t m_len;
+   size_t m_size;
+};
+
+/*
+ * Walks the AVP tree once writing each AVP to the output stream without
+ * building an intermediate document.
+ */
+template<class OutputStream>
+class fdJsonEncoder
+{
+public:
+   fdJsonEncoder( OutputStream &os ) : m_writer( os ) {}
 
-         /* get the dictionary associated with the AVP dictionary entry */
-         ret = fd_dict_getdict( dictEntry, &dict );
+   void encode( msg_or_avp *ref )
+   {
+      std::string name = fdJsonGetName( ref );
+
+      m_writer.StartObject();
+      m_writer.Key( name.c_str(), name.length() );
+      m_writer.StartObject();
+      encodeMembers( ref );
+      m_writer.EndObject();
+      m_writer.EndObject();
+   }
+
+private:
+   void encodeMembers( msg_or_avp *ref )
+   {
+      int ret;
+      struct avp *a;
+      struct avp_hdr *hdr;
+      struct dict_object *dictEntry;
+      AvpDictionaryEntry *ade;
+
+      if ( fd_msg_browse_internal( ref, MSG_BRW_FIRST_CHILD, (msg_or_avp**)&a, NULL ) != 0 )
+         return;
+
+      do
+      {
+         if ( !a )
+            break;
+
+         // get the avp dictionary entry
+         ret = fd_msg_model( a, &dictEntry );
          if ( ret != 0 )
-            throw runtimeInfo(
-               string_format("%s:%d - INFO - Unable to retrieve the dictionary for the [%s] dictionary entry",
-               __FILE__, __LINE__, dictData.avp_name)
+            throw runtimeError(
+               string_format("%s:%d - INFO - error fd_msg_model() returned %d",
+                  __FILE__, __LINE__, ret )
             );
 
-         /* get the dictionary entry associated with the derived type */
-         ret = fd_dict_search( dict, DICT_TYPE, TYPE_OF_AVP, dictEntry, &derivedtype, EINVAL );
-         if ( ret == 0 ) /* if found, then derived */
-            isDerived = fd_dict_getval( derivedtype, &derivedData ) == 0;
-      }
+         // get the cached avp dictionary information
+         try
+         {
+            ade = AvpDictionaryCache::find( dictEntry );
+         }
+         catch (runtimeInfo &ex)
+         {
+            throw runtimeError( ex.what() );
+         }
+         struct dict_avp_data &dictData = ade->getBaseData();
 
-      if ( fd_msg_avp_hdr ( a, &hdr ) == 0 )
-      {
-         RAPIDJSON_NAMESPACE::Value avp_name;
-         avp_name.SetString( dictData.avp_name, allocator );
+         if ( fd_msg_avp_hdr ( a, &hdr ) != 0 )
+            throw runtimeInfo(
+               string_format("%s:%d - INFO - Unable to retrieve the AVP header for [%s]",
+               __FILE__, __LINE__, dictData.avp_name)
+            );
 
          switch ( dictData.avp_basetype )
          {
             case AVP_TYPE_OCTETSTRING:
             {
-               if ( isDerived )
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               if ( ade->isDerived() )
                {
-                  if ( !strcmp(derivedData.avp_name,"Address") )
+                  if ( ade->getType() == ADTAddress )
                   {
-                     std::string address = fdJsonAddressToStr( &dictData, hdr->avp_value->os.data, hdr->avp_value->os.len );
-                     RAPIDJSON_NAMESPACE::Value v;
-                     v.SetString( address.c_str(), address.length(), allocator );
-                     object.AddMember( avp_name, v, allocator );
+                     char str[INET6_ADDRSTRLEN];
+                     fdJsonAddressToStr( &dictData, hdr->avp_value->os.data, hdr->avp_value->os.len, str, sizeof(str) );
+                     m_writer.String( str );
                   }
-                  else if ( !strcmp(derivedData.avp_name,"Time") )
+                  else if ( ade->getType() == ADTTime )
                   {
                      std::string tm = fdJsonTimeToStr( &dictData, hdr->avp_value->os.data, hdr->avp_value->os.len );
-                     RAPIDJSON_NAMESPACE::Value v;
-                     v.SetString( tm.c_str(), tm.length(), allocator );
-                     object.AddMember( avp_name, v, allocator );
+                     m_writer.String( tm.c_str(), tm.length() );
                   }
                   else
                   {
-                     std::string str( (const char *)hdr->avp_value->os.data, hdr->avp_value->os.len );
-                     RAPIDJSON_NAMESPACE::Value v;
-                     v.SetString( str.c_str(), str.length(), allocator );
-                     object.AddMember( avp_name, v, allocator );
+                     m_writer.String( (const char *)hdr->avp_value->os.data, hdr->avp_value->os.len );
                   }
                }
                else
                {
                   // convert each byte to 2 hex digits
-                  std::string hex = fdJsonBinaryToHex( hdr->avp_value->os.data, hdr->avp_value->os.len );
-                  RAPIDJSON_NAMESPACE::Value v;
-                  v.SetString( hex.c_str(), hex.length(), allocator );
-                  object.AddMember( avp_name, v, allocator );
+                  fdJsonBinaryToHex( hdr->avp_value->os.data, hdr->avp_value->os.len, m_hex );
+                  m_writer.String( m_hex.c_str(), m_hex.length() );
                }
                break;
             }
             case AVP_TYPE_INTEGER32:
             {
-               object.AddMember( avp_name, hdr->avp_value->i32, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Int( hdr->avp_value->i32 );
                break;
             }
             case AVP_TYPE_INTEGER64:
             {
-               object.AddMember( avp_name, hdr->avp_value->i64, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Int64( hdr->avp_value->i64 );
                break;
             }
             case AVP_TYPE_UNSIGNED32:
             {
-               object.AddMember( avp_name, hdr->avp_value->u32, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Uint( hdr->avp_value->u32 );
                break;
             }
             case AVP_TYPE_UNSIGNED64:
             {
-               object.AddMember( avp_name, hdr->avp_value->u64, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Uint64( hdr->avp_value->u64 );
                break;
             }
             case AVP_TYPE_FLOAT32:
             {
-               object.AddMember( avp_name, hdr->avp_value->f32, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Double( hdr->avp_value->f32 );
                break;
             }
             case AVP_TYPE_FLOAT64:
             {
-               object.AddMember( avp_name, hdr->avp_value->f64, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.Double( hdr->avp_value->f64 );
                break;
             }
             case AVP_TYPE_GROUPED:
             {
-               RAPIDJSON_NAMESPACE::Value grouped( RAPIDJSON_NAMESPACE::kObjectType );
-               fdJsonAddMembers( a, grouped, allocator );
-               object.AddMember( avp_name, grouped, allocator );
+               m_writer.Key( ade->getAvpName().c_str(), ade->getAvpName().length() );
+               m_writer.StartObject();
+               encodeMembers( a );
+               m_writer.EndObject();
                break;
             }
             default:
             {
             }
          }
-      }
-      else
-      {
-         throw runtimeInfo(
-            string_format("%s:%d - INFO - Unable to retrieve the AVP header for [%s]",
-            __FILE__, __LINE__, dictData.avp_name)
-         );
-      }
-   } while ( fd_msg_browse_internal( a, MSG_BRW_NEXT, (msg_or_avp**)&a, NULL ) == 0 );
-}
-
-static std::string fdJsonGetName( msg_or_avp * ref )
-{
-   int ret;
-   msg_or_avp *parent;
-   struct dict_object *model;
-
-   // determine if avp or msg
-   bool isAvp = fd_msg_browse_internal( ref, MSG_BRW_PARENT, (msg_or_avp**)&parent, NULL ) == 0;
-
-   ret = fd_msg_model( ref, &model );
-   if ( ret != 0 )
-      throw runtimeError(
-         string_format("%s:%d - ERROR - error fd_msg_model() returned %d",
-            __FILE__, __LINE__, ret )
-      );
-
-   if ( isAvp )
-   {
-      struct dict_avp_data ad;
-
-      ret = fd_dict_getval( model, &ad );
-      if ( ret != 0 )
-         throw runtimeError(
-            string_format("%s:%d - ERROR - error fd_dict_getval() returned %d",
-               __FILE__, __LINE__, ret )
-         );
-
-      return std::string( ad.avp_name );
+      } while ( fd_msg_browse_internal( a, MSG_BRW_NEXT, (msg_or_avp**)&a, NULL ) == 0 );
    }
-   else
-   {
-      struct dict_cmd_data cd;
 
-      ret = fd_dict_getval( model, &cd );
-      if ( ret != 0 )
-         throw runtimeError(
-            string_format("%s:%d - ERROR - error fd_dict_getval() returned %d",
-               __FILE__, __LINE__, ret )
-         );
-
-      return std::string( cd.cmd_name );
-   }
-}
+   RAPIDJSON_NAMESPACE::Writer<OutputStream> m_writer;
+   std::string m_hex;
+};
 
 void fdJsonGetJSON( msg_or_avp *ref, std::string &json, void (*errfunc)(const char *) )
 {
-   RAPIDJSON_NAMESPACE::Document doc;
-   RAPIDJSON_NAMESPACE::Document::AllocatorType& allocator = doc.GetAllocator();
-
-   // define the document as an object
-   doc.SetObject();
-
    try
    {
-      RAPIDJSON_NAMESPACE::Value object( RAPIDJSON_NAMESPACE::kObjectType );
-
-      fdJsonAddMembers( ref, object, allocator );
-
-      std::string name = fdJsonGetName( ref );
-      RAPIDJSON_NAMESPACE::Value vname;
-      vname.SetString( name.c_str(), name.length(), allocator );
-
-      doc.AddMember( vname, object, allocator );
+      // json is reused as the output buffer
+      fdJsonStringStream os( json );
+      fdJsonEncoder<fdJsonStringStream> encoder( os );
 
-      RAPIDJSON_NAMESPACE::StringBuffer sb;
-      RAPIDJSON_NAMESPACE::Writer<RAPIDJSON_NAMESPACE::StringBuffer> writer(sb);
-      doc.Accept(writer);
-
-      json = sb.GetString();
+      encoder.encode( ref );
    }
    catch (runtimeError &ex)
    {
-      errfunc( ex.what() );
+      json.clear();
+      if ( errfunc )
+         errfunc( ex.what() );
       return;
    }
 }
 
 const char *fdJsonGetJSON( msg_or_avp *ref, void (*errfunc)(const char *) )
 {
-   std::string json;
+   try
+   {
+      // the buffer is returned to the caller without being copied
+      fdJsonMallocStream os;
+      fdJsonEncoder<fdJsonMallocStream> encoder( os );
 
-   fdJsonGetJSON( ref, json, errfunc );
+      encoder.encode( ref );
 
-   return strdup( json.c_str() );
+      return os.release();
+   }
+   catch (runtimeError &ex)
+   {
+      if ( errfunc )
+         errfunc( ex.what() );
+      return strdup( "" );
+   }
 }
 
 bool fdJsonGetValueOfMember( std::string json, std::string member, std::string &value )
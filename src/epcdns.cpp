@@ -15,12 +15,55 @@
 */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <iostream>
 
 #include "epcdns.h"
 
 using namespace EPCDNS;
 
+PlmnSuffix::PlmnSuffix( const unsigned char *plmnid )
+{
+   PARSE_PLMNID( plmnid );
+
+   m_home.APPEND_MNC( mnc ).APPEND_MCC( mcc ).APPEND_3GPPNETWORK;
+   m_gprs.APPEND_MNC( mnc ).APPEND_MCC( mcc ).append( "gprs" );
+   m_pub.APPEND_MNC( mnc ).APPEND_MCC( mcc ).append( "pub." ).APPEND_3GPPNETWORK;
+   m_visited.APPEND_MCC( mcc ).append( "visited-country.pub." ).APPEND_3GPPNETWORK;
+}
+
+PlmnSuffixCache &PlmnSuffixCache::getInstance()
+{
+   static PlmnSuffixCache instance;
+   return instance;
+}
+
+const PlmnSuffix &PlmnSuffixCache::getSuffix( const unsigned char *plmnid )
+{
+   uint32_t key = (plmnid[0] << 16) | (plmnid[1] << 8) | plmnid[2];
+
+   {
+      ERDLock l( m_rwlock );
+      std::unordered_map<uint32_t,PlmnSuffix*>::const_iterator it = m_suffixes.find( key );
+      if ( it != m_suffixes.end() )
+         return *it->second;
+   }
+
+   PlmnSuffix *ps = new PlmnSuffix( plmnid );
+
+   EWRLock l( m_rwlock );
+
+   // another thread may have added the suffix
+   std::pair<std::unordered_map<uint32_t,PlmnSuffix*>::iterator,bool> res = m_suffixes.insert( std::make_pair( key, ps ) );
+   if ( !res.second )
+      delete ps;
+
+   return *res.first->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 EString Utility::home_network( const char *mnc, const char *mcc )
 {
    EString s;
@@ -35,8 +78,16 @@ EString Utility::home_network( const char *mnc, const char *mcc )
 
 EString Utility::home_network( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return home_network( mnc, mcc );
+   FQDN fqdn;
+   return home_network( fqdn, plmnid );
+}
+
+FQDN &Utility::home_network( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::home_network_gprs( const char *mnc, const char *mcc )
@@ -53,8 +104,16 @@ EString Utility::home_network_gprs( const char *mnc, const char *mcc )
 
 EString Utility::home_network_gprs( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return home_network_gprs( mnc, mcc );
+   FQDN fqdn;
+   return home_network_gprs( fqdn, plmnid );
+}
+
+FQDN &Utility::home_network_gprs( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( ps.getGprs() );
 }
 
 EString Utility::tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc )
@@ -76,8 +135,21 @@ EString Utility::tai_fqdn( const char *lb, const char *hb, const char *mnc, cons
 
 EString Utility::tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return tai_fqdn( lb, hb, mnc, mcc );
+   FQDN fqdn;
+   return tai_fqdn( fqdn, lb, hb, plmnid );
+}
+
+FQDN &Utility::tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "tac-lb" )
+      .append( lb )
+      .append( ".tac-hb" )
+      .append( hb )
+      .append( ".tac.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::mme_fqdn( const char *mmec, const char *mmegi, const char *mnc, const char *mcc )
@@ -99,8 +171,21 @@ EString Utility::mme_fqdn( const char *mmec, const char *mmegi, const char *mnc,
 
 EString Utility::mme_fqdn( const char *mmec, const char *mmegi, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return mme_fqdn( mmec, mmegi, mnc, mcc );
+   FQDN fqdn;
+   return mme_fqdn( fqdn, mmec, mmegi, plmnid );
+}
+
+FQDN &Utility::mme_fqdn( FQDN &fqdn, const char *mmec, const char *mmegi, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "mmec" )
+      .append( mmec )
+      .append( ".mmegi" )
+      .append( mmegi )
+      .append( ".mme.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::mme_pool_fqdn( const char *mmegi, const char *mnc, const char *mcc )
@@ -120,8 +205,19 @@ EString Utility::mme_pool_fqdn( const char *mmegi, const char *mnc, const char *
 
 EString Utility::mme_pool_fqdn( const char *mmegi, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return mme_pool_fqdn( mmegi, mnc, mcc );
+   FQDN fqdn;
+   return mme_pool_fqdn( fqdn, mmegi, plmnid );
+}
+
+FQDN &Utility::mme_pool_fqdn( FQDN &fqdn, const char *mmegi, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "mmegi" )
+      .append( mmegi )
+      .append( ".mme.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::rai_fqdn( const char *rac, const char *lac, const char *mnc, const char *mcc )
@@ -143,8 +239,21 @@ EString Utility::rai_fqdn( const char *rac, const char *lac, const char *mnc, co
 
 EString Utility::rai_fqdn( const char *rac, const char *lac, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return rai_fqdn( rac, lac, mnc, mcc );
+   FQDN fqdn;
+   return rai_fqdn( fqdn, rac, lac, plmnid );
+}
+
+FQDN &Utility::rai_fqdn( FQDN &fqdn, const char *rac, const char *lac, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "rac" )
+      .append( rac )
+      .append( ".lac" )
+      .append( lac )
+      .append( ".rac.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::rnc_fqdn( const char *rnc, const char *mnc, const char *mcc )
@@ -164,8 +273,19 @@ EString Utility::rnc_fqdn( const char *rnc, const char *mnc, const char *mcc )
 
 EString Utility::rnc_fqdn( const char *rnc, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return rnc_fqdn( rnc, mnc, mcc );
+   FQDN fqdn;
+   return rnc_fqdn( fqdn, rnc, plmnid );
+}
+
+FQDN &Utility::rnc_fqdn( FQDN &fqdn, const char *rnc, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "rnc" )
+      .append( rnc )
+      .append( ".rnc.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::sgsn_fqdn( const char *nri, const char *rac, const char *lac, const char *mnc, const char *mcc )
@@ -189,8 +309,23 @@ EString Utility::sgsn_fqdn( const char *nri, const char *rac, const char *lac, c
 
 EString Utility::sgsn_fqdn( const char *nri, const char *rac, const char *lac, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return sgsn_fqdn( nri, rac, lac, mnc, mcc );
+   FQDN fqdn;
+   return sgsn_fqdn( fqdn, nri, rac, lac, plmnid );
+}
+
+FQDN &Utility::sgsn_fqdn( FQDN &fqdn, const char *nri, const char *rac, const char *lac, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "nri" )
+      .append( nri )
+      .append( ".rac" )
+      .append( rac )
+      .append( ".lac" )
+      .append( lac )
+      .append( ".rac.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::epc_nodes_domain_fqdn( const char *mnc, const char *mcc )
@@ -208,8 +343,17 @@ EString Utility::epc_nodes_domain_fqdn( const char *mnc, const char *mcc )
 
 EString Utility::epc_nodes_domain_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return epc_nodes_domain_fqdn( mnc, mcc );
+   FQDN fqdn;
+   return epc_nodes_domain_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::epc_nodes_domain_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "node.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::epc_node_fqdn( const char *node, const char *mnc, const char *mcc )
@@ -228,8 +372,18 @@ EString Utility::epc_node_fqdn( const char *node, const char *mnc, const char *m
 
 EString Utility::epc_node_fqdn( const char *node, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return epc_node_fqdn( node, mnc, mcc );
+   FQDN fqdn;
+   return epc_node_fqdn( fqdn, node, plmnid );
+}
+
+FQDN &Utility::epc_node_fqdn( FQDN &fqdn, const char *node, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( node )
+      .append( ".node.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::nonemergency_epdg_oi_fqdn( const char *mnc, const char *mcc )
@@ -248,8 +402,17 @@ EString Utility::nonemergency_epdg_oi_fqdn( const char *mnc, const char *mcc )
 
 EString Utility::nonemergency_epdg_oi_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return nonemergency_epdg_oi_fqdn( mnc, mcc );
+   FQDN fqdn;
+   return nonemergency_epdg_oi_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::nonemergency_epdg_oi_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "epdg.epc." )
+      .append( ps.getPublic() );
 }
 
 EString Utility::nonemergency_epdg_tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc )
@@ -271,8 +434,21 @@ EString Utility::nonemergency_epdg_tai_fqdn( const char *lb, const char *hb, con
 
 EString Utility::nonemergency_epdg_tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return nonemergency_epdg_tai_fqdn( lb, hb, mnc, mcc );
+   FQDN fqdn;
+   return nonemergency_epdg_tai_fqdn( fqdn, lb, hb, plmnid );
+}
+
+FQDN &Utility::nonemergency_epdg_tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "tac-lb" )
+      .append( lb )
+      .append( ".tac-hb" )
+      .append( hb )
+      .append( ".tac.epdg.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::nonemergency_epdg_lac_fqdn( const char *lac, const char *mnc, const char *mcc )
@@ -293,8 +469,19 @@ EString Utility::nonemergency_epdg_lac_fqdn( const char *lac, const char *mnc, c
 
 EString Utility::nonemergency_epdg_lac_fqdn( const char *lac, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return nonemergency_epdg_lac_fqdn( lac, mnc, mcc );
+   FQDN fqdn;
+   return nonemergency_epdg_lac_fqdn( fqdn, lac, plmnid );
+}
+
+FQDN &Utility::nonemergency_epdg_lac_fqdn( FQDN &fqdn, const char *lac, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "lac" )
+      .append( lac )
+      .append( ".epdg.epc." )
+      .append( ps.getPublic() );
 }
 
 EString Utility::nonemergency_epdg_visitedcountry_fqdn( const char *mcc )
@@ -312,8 +499,17 @@ EString Utility::nonemergency_epdg_visitedcountry_fqdn( const char *mcc )
 
 EString Utility::nonemergency_epdg_visitedcountry_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return nonemergency_epdg_visitedcountry_fqdn( mcc );
+   FQDN fqdn;
+   return nonemergency_epdg_visitedcountry_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::nonemergency_epdg_visitedcountry_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "epdg.epc." )
+      .append( ps.getVisitedCountry() );
 }
 
 EString Utility::emergency_epdg_oi_fqdn( const char *mnc, const char *mcc )
@@ -332,8 +528,17 @@ EString Utility::emergency_epdg_oi_fqdn( const char *mnc, const char *mcc )
 
 EString Utility::emergency_epdg_oi_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return emergency_epdg_oi_fqdn( mnc, mcc );
+   FQDN fqdn;
+   return emergency_epdg_oi_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::emergency_epdg_oi_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "sos.epdg.epc." )
+      .append( ps.getPublic() );
 }
 
 EString Utility::emergency_epdg_tai_fqdn( const char *lb, const char *hb, const char *mnc, const char *mcc )
@@ -356,8 +561,21 @@ EString Utility::emergency_epdg_tai_fqdn( const char *lb, const char *hb, const
 
 EString Utility::emergency_epdg_tai_fqdn( const char *lb, const char *hb, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return emergency_epdg_tai_fqdn( lb, hb, mnc, mcc );
+   FQDN fqdn;
+   return emergency_epdg_tai_fqdn( fqdn, lb, hb, plmnid );
+}
+
+FQDN &Utility::emergency_epdg_tai_fqdn( FQDN &fqdn, const char *lb, const char *hb, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "tac-lb" )
+      .append( lb )
+      .append( ".tac-hb" )
+      .append( hb )
+      .append( ".tac.sos.epdg.epc." )
+      .append( ps.getPublic() );
 }
 
 EString Utility::emergency_epdg_lac_fqdn( const char *lac, const char *mnc, const char *mcc )
@@ -378,8 +596,19 @@ EString Utility::emergency_epdg_lac_fqdn( const char *lac, const char *mnc, cons
 
 EString Utility::emergency_epdg_lac_fqdn( const char *lac, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return emergency_epdg_lac_fqdn( lac, mnc, mcc );
+   FQDN fqdn;
+   return emergency_epdg_lac_fqdn( fqdn, lac, plmnid );
+}
+
+FQDN &Utility::emergency_epdg_lac_fqdn( FQDN &fqdn, const char *lac, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "lac" )
+      .append( lac )
+      .append( ".sos.epdg.epc." )
+      .append( ps.getPublic() );
 }
 
 EString Utility::emergency_epdg_visitedcountry_fqdn( const char *mcc )
@@ -397,8 +626,17 @@ EString Utility::emergency_epdg_visitedcountry_fqdn( const char *mcc )
 
 EString Utility::emergency_epdg_visitedcountry_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return emergency_epdg_visitedcountry_fqdn( mcc );
+   FQDN fqdn;
+   return emergency_epdg_visitedcountry_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::emergency_epdg_visitedcountry_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "sos.epdg.epc." )
+      .append( ps.getVisitedCountry() );
 }
 
 EString Utility::global_enodeb_id_fqdn( const char *enb, const char *mnc, const char *mcc )
@@ -418,8 +656,19 @@ EString Utility::global_enodeb_id_fqdn( const char *enb, const char *mnc, const
 
 EString Utility::global_enodeb_id_fqdn( const char *enb, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return global_enodeb_id_fqdn( enb, mnc, mcc );
+   FQDN fqdn;
+   return global_enodeb_id_fqdn( fqdn, enb, plmnid );
+}
+
+FQDN &Utility::global_enodeb_id_fqdn( FQDN &fqdn, const char *enb, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "enb" )
+      .append( enb )
+      .append( ".enb.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::local_homenetwork_fqdn( const char *lhn, const char *mcc )
@@ -439,8 +688,19 @@ EString Utility::local_homenetwork_fqdn( const char *lhn, const char *mcc )
 
 EString Utility::local_homenetwork_fqdn( const char *lhn, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return local_homenetwork_fqdn( lhn, mcc );
+   FQDN fqdn;
+   return local_homenetwork_fqdn( fqdn, lhn, plmnid );
+}
+
+FQDN &Utility::local_homenetwork_fqdn( FQDN &fqdn, const char *lhn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "lhn" )
+      .append( lhn )
+      .append( ".lhn.epc." )
+      .append( ps.getVisitedCountry() );
 }
 
 EString Utility::epc( const char *mnc, const char *mcc )
@@ -458,8 +718,17 @@ EString Utility::epc( const char *mnc, const char *mcc )
 
 EString Utility::epc( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return epc( mnc, mcc );
+   FQDN fqdn;
+   return epc( fqdn, plmnid );
+}
+
+FQDN &Utility::epc( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::apn_fqdn( const char *apnoi, const char *mnc, const char *mcc )
@@ -478,8 +747,18 @@ EString Utility::apn_fqdn( const char *apnoi, const char *mnc, const char *mcc )
 
 EString Utility::apn_fqdn( const char *apnoi, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return apn_fqdn( apnoi, mnc, mcc );
+   FQDN fqdn;
+   return apn_fqdn( fqdn, apnoi, plmnid );
+}
+
+FQDN &Utility::apn_fqdn( FQDN &fqdn, const char *apnoi, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( apnoi )
+      .append( ".apn.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::apn( const char *apnoi, const char *mnc, const char *mcc )
@@ -498,8 +777,18 @@ EString Utility::apn( const char *apnoi, const char *mnc, const char *mcc )
 
 EString Utility::apn( const char *apnoi, const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return apn( apnoi, mnc, mcc );
+   FQDN fqdn;
+   return apn( fqdn, apnoi, plmnid );
+}
+
+FQDN &Utility::apn( FQDN &fqdn, const char *apnoi, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( apnoi )
+      .append( ".apn." )
+      .append( ps.getGprs() );
 }
 
 AppServiceEnum Utility::getAppService( const std::string &s )
@@ -694,8 +983,17 @@ EString Utility::diameter_fqdn( const char *mnc, const char *mcc )
 
 EString Utility::diameter_fqdn( const unsigned char *plmnid )
 {
-   PARSE_PLMNID( plmnid );
-   return diameter_fqdn( mnc, mcc );
+   FQDN fqdn;
+   return diameter_fqdn( fqdn, plmnid );
+}
+
+FQDN &Utility::diameter_fqdn( FQDN &fqdn, const unsigned char *plmnid )
+{
+   const PlmnSuffix &ps = PlmnSuffixCache::getInstance().getSuffix( plmnid );
+
+   return fqdn.clear()
+      .append( "diameter.epc." )
+      .append( ps.getHomeNetwork() );
 }
 
 EString Utility::getDiameterService( DiameterApplicationEnum app, DiameterProtocolEnum protocol )
@@ -802,6 +1100,48 @@ const char *Utility::getDiameterProtocol( DiameterProtocolEnum protocol )
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+LabelTable &LabelTable::getInstance()
+{
+   static LabelTable instance;
+   return instance;
+}
+
+LabelId LabelTable::intern( const char *label, size_t len )
+{
+   Key k = { label, len };
+
+   {
+      ERDLock l( m_rwlock );
+      std::unordered_map<Key,LabelId,KeyHash,KeyEqual>::const_iterator it = m_ids.find( k );
+      if ( it != m_ids.end() )
+         return it->second;
+   }
+
+   EWRLock l( m_rwlock );
+
+   // another thread may have added the label
+   std::unordered_map<Key,LabelId,KeyHash,KeyEqual>::const_iterator it = m_ids.find( k );
+   if ( it != m_ids.end() )
+      return it->second;
+
+   // the key refers to the saved label, deque elements are never relocated
+   LabelId id = (LabelId)m_labels.size();
+   m_labels.push_back( std::string( label, len ) );
+   k.m_label = m_labels.back().c_str();
+   m_ids[k] = id;
+
+   return id;
+}
+
+const std::string &LabelTable::getLabel( LabelId id )
+{
+   ERDLock l( m_rwlock );
+   return m_labels[id];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 CanonicalNodeName::CanonicalNodeName()
    : m_topon( false )
 {
@@ -819,19 +1159,16 @@ void CanonicalNodeName::setName( const std::string &n )
    clear();
    m_topon = false;
    m_name = "";
-   
-   // parse the name into labels
-   std::string arg;
-   std::istringstream ss( n );
 
    // get the first label
-   std::getline( ss, arg, '.' );
+   size_t pos = n.find( '.' );
+   size_t len = pos == std::string::npos ? n.size() : pos;
 
    // check for "topon"
-   m_topon = arg == "topon";
+   m_topon = n.compare( 0, len, "topon" ) == 0;
 
    // check for not "topoff"
-   if ( !m_topon && arg != "topoff" )
+   if ( !m_topon && n.compare( 0, len, "topoff" ) != 0 )
    {
       // set the name to what was passed in and stop processing
       m_name = n;
@@ -839,45 +1176,46 @@ void CanonicalNodeName::setName( const std::string &n )
    }
 
    // skip the interface
-   std::getline( ss, arg, '.' );
+   if ( pos != std::string::npos )
+      pos = n.find( '.', pos + 1 );
 
    // save the canonical name
-   if ( !std::getline( ss, arg ) )
+   if ( pos == std::string::npos || pos + 1 >= n.size() )
       return;  // no need to continue if there is no more data
-   m_name = arg;
+   m_name.assign( n, pos + 1, std::string::npos );
 
    // only get the labels of topon is specified
    if ( m_topon )
    {
-      // set ss to the conanical name to split
-      ss.str( m_name );
-      ss.clear();
-
-      // add the labels to the list
-      while ( std::getline( ss, arg, '.' ) )
-         push_back( arg );
-
-      // reverse the list for use in topological matching
-      reverse();
+      const char *name = m_name.c_str();
+      const char *nameend = name + m_name.size();
+      size_t cnt = std::count( name, nameend, '.' ) + (nameend[-1] == '.' ? 0 : 1);
+      LabelTable &lt = LabelTable::getInstance();
+
+      // add the label ids in reverse order for use in topological matching
+      resize( cnt );
+      for (size_t i = cnt; i > 0; i--)
+      {
+         const char *dot = (const char *)memchr( name, '.', nameend - name );
+         if ( !dot )
+            dot = nameend;
+         (*this)[i - 1] = lt.intern( name, dot - name );
+         name = dot + 1;
+      }
    }
 }
 
 int CanonicalNodeName::topologicalCompare( const CanonicalNodeName &right )
 {
-   int matchingLabels = 0;
-   CanonicalNodeName::const_iterator itl = begin();
-   CanonicalNodeName::const_iterator itr = right.begin();
-   
-   while ( itl != end() && itr != right.end() )
-   {
-      if ( *itl != *itr )
-         break;
+   size_t cnt = std::min( size(), right.size() );
+   const LabelId *l = data();
+   const LabelId *r = right.data();
+   size_t matchingLabels = 0;
+
+   while ( matchingLabels < cnt && l[matchingLabels] == r[matchingLabels] )
       ++matchingLabels;
-      ++itl;
-      ++itr;
-   }
 
-   return matchingLabels;
+   return (int)matchingLabels;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -885,23 +1223,136 @@ int CanonicalNodeName::topologicalCompare( const CanonicalNodeName &right )
 
 NodeSelectorResultList &NodeSelector::process()
 {
-   std::list<AppProtocolEnum> supportedProtocols;
-
    // perform dns query
    bool cacheHit = false;
    m_query = DNS::Cache::getInstance(m_nsid).query( ns_t_naptr, m_domain, cacheHit );
 
-   // evaluate each answer to see if it matches the service/protocol requirements
-   for (std::list<DNS::ResourceRecord*>::const_iterator rrit = m_query->getAnswers().begin();
-        rrit != m_query->getAnswers().end();
-        ++rrit )
+   return evaluate();
+}
+
+namespace
+{
+   // delivers the selector completions that could not be queued without
+   // waiting, the wait happens on this thread instead of the resolver thread
+   // or the thread that started the selection
+   class SelectorNotifier : public EThreadBasic
    {
-      DNS::RRecordNAPTR* naptr = (DNS::RRecordNAPTR*)*rrit;
+   public:
+      static SelectorNotifier &getInstance()
+      {
+         static SelectorNotifier *notifier = create();
+         return *notifier;
+      }
+
+      void post( EThreadBase *thread, UInt message, pVoid data )
+      {
+         {
+            EMutexLock l( m_mutex );
+            m_pending.push_back( Notification( thread, message, data ) );
+         }
+         m_sem.Increment();
+      }
+
+      virtual Dword threadProc( pVoid arg )
+      {
+         while ( true )
+         {
+            m_sem.Decrement();
+
+            Notification n;
+            {
+               EMutexLock l( m_mutex );
+               n = m_pending.front();
+               m_pending.pop_front();
+            }
+
+            n.thread->sendMessage( n.message, n.data, True );
+         }
+
+         return 0;
+      }
+
+   private:
+      struct Notification
+      {
+         Notification( EThreadBase *t = NULL, UInt m = 0, pVoid d = NULL ) : thread( t ), message( m ), data( d ) {}
 
-      // parse the service field
-      AppService service;
+         EThreadBase *thread;
+         UInt message;
+         pVoid data;
+      };
 
-      service.parse( naptr->getService() );
+      SelectorNotifier() {}
+
+      static SelectorNotifier *create()
+      {
+         SelectorNotifier *notifier = new SelectorNotifier();
+         notifier->init( NULL );
+         return notifier;
+      }
+
+      EMutexPrivate m_mutex;
+      ESemaphorePrivate m_sem;
+      std::list<Notification> m_pending;
+   };
+
+   // never blocks the calling thread, a completion that does not fit in the
+   // message queue of thread is handed to the notifier thread
+   void notifySelector( EThreadBase *thread, UInt message, pVoid data, long &deferred )
+   {
+      if ( !thread->sendMessage( message, data, False ) )
+      {
+         atomic_inc( deferred );
+         SelectorNotifier::getInstance().post( thread, message, data );
+      }
+   }
+}
+
+void NodeSelector::process( EThreadBase *thread, UInt message )
+{
+   m_thread = thread;
+   m_message = message;
+
+   // the callback is called immediately for a cache hit
+   DNS::Cache::getInstance(m_nsid).query( ns_t_naptr, m_domain, NodeSelector::async_callback, this );
+}
+
+void NodeSelector::async_callback( DNS::QueryPtr q, bool cacheHit, const void *data )
+{
+   NodeSelector *ns = (NodeSelector*)data;
+
+   ns->m_query = q;
+   ns->evaluate();
+
+   // this is either the resolver thread or, for a cache hit, the calling
+   // thread, neither of which can wait on the user's message queue
+   notifySelector( ns->m_thread, ns->m_message, (pVoid)ns, m_deferred );
+}
+
+NodeSelectorResultList &NodeSelector::evaluate()
+{
+   // check for results from a previous selection with the same criteria
+   std::shared_ptr<NodeSelectorCache> nsc = NodeSelectorCache::getInstance( m_query );
+   EString key( getSelectionKey() );
+   bool memoize = m_results.empty();
+
+   if ( memoize )
+   {
+      std::shared_ptr<const NodeSelectorResultList> saved = nsc->findResults( key );
+      if ( saved )
+      {
+         copyResults( *saved );
+         return m_results;
+      }
+   }
+
+   // evaluate each answer to see if it matches the service/protocol requirements
+   for (NodeSelectorCache::NaptrServiceVector::const_iterator nsit = nsc->getServices().begin();
+        nsit != nsc->getServices().end();
+        ++nsit )
+   {
+      DNS::RRecordNAPTR* naptr = nsit->first;
+      AppService &service = *nsit->second;
 
       // check for service match
       if ( service.getService() == m_desiredService )
@@ -984,25 +1435,25 @@ NodeSelectorResultList &NodeSelector::process()
 
          if ( !nsr->getSupportedProtocols().empty() )
          {
-            // iterate through the dns query additonal records adding the ip addresses for the host to the result
-            for ( DNS::ResourceRecordList::const_iterator it = m_query->getAdditional().begin();
-                  it != m_query->getAdditional().end();
-                  ++it )
+            // add the ip addresses for the host from the dns query records to the result
+            const DNS::ResourceRecordVector &rrs = m_query->findRecords( nsr->getHostname() );
+            for ( DNS::ResourceRecordVector::const_iterator it = rrs.begin(); it != rrs.end(); ++it )
             {
-               if ( nsr->getHostname() == (*it)->getName() )
+               switch ( (*it)->getType() )
                {
-                  switch ( (*it)->getType() )
+                  case ns_t_a:
                   {
-                     case ns_t_a:
-                     {
-                        nsr->addIPv4Host( ((DNS::RRecordA*)*it)->getAddressString() );
-                        break;
-                     }
-                     case ns_t_aaaa:
-                     {
-                        nsr->addIPv6Host( ((DNS::RRecordAAAA*)*it)->getAddressString() );
-                        break;
-                     }
+                     nsr->addIPv4Host( ((DNS::RRecordA*)*it)->getAddressString() );
+                     break;
+                  }
+                  case ns_t_aaaa:
+                  {
+                     nsr->addIPv6Host( ((DNS::RRecordAAAA*)*it)->getAddressString() );
+                     break;
+                  }
+                  default:
+                  {
+                     break;
                   }
                }
             }
@@ -1024,14 +1475,63 @@ NodeSelectorResultList &NodeSelector::process()
 
    // sort the naptr list
    m_results.sort( NodeSelectorResultList::sort_compare );
+
+   // save the results for subsequent selections
+   if ( memoize && !m_results.empty() )
+   {
+      NodeSelectorResultList *saved = new NodeSelectorResultList();
+      for (NodeSelectorResultList::const_iterator it = m_results.begin(); it != m_results.end(); ++it)
+         saved->push_back( new NodeSelectorResult( **it ) );
+      nsc->saveResults( key, saved );
+   }
       
    return m_results;
 }
 
+void NodeSelector::copyResults( const NodeSelectorResultList &saved )
+{
+   // the saved results are shared by all selections, each selection gets
+   // its own copies so that the ip addresses are shuffled for every call
+   for (NodeSelectorResultList::const_iterator it = saved.begin(); it != saved.end(); ++it)
+   {
+      NodeSelectorResult *nsr = new NodeSelectorResult( **it );
+
+      nsr->getIPv4Hosts().shuffle();
+      nsr->getIPv6Hosts().shuffle();
+
+      m_results.push_back( nsr );
+   }
+}
+
+EString NodeSelector::getSelectionKey()
+{
+   EString key;
+
+   key.append( std::to_string(m_desiredService) );
+
+   key.append( "|" );
+   for (AppProtocolList::const_iterator it = m_desiredProtocols.begin(); it != m_desiredProtocols.end(); ++it)
+      key.append( std::to_string((*it)->getProtocol()) ).append( "," );
+
+   key.append( "|" );
+   for (UsageTypeList::const_iterator it = m_desiredUsageTypes.begin(); it != m_desiredUsageTypes.end(); ++it)
+      key.append( std::to_string(*it) ).append( "," );
+
+   key.append( "|" );
+   for (NetworkCapabilityList::const_iterator it = m_desiredNetworkCapabilities.begin(); it != m_desiredNetworkCapabilities.end(); ++it)
+      key.append( *it ).append( "," );
+
+   return key;
+}
+
+long NodeSelector::m_deferred = 0;
+
 NodeSelector::NodeSelector()
 {
    m_nsid = DNS::NS_DEFAULT;
    m_query = NULL;
+   m_thread = NULL;
+   m_message = 0;
 }
 
 NodeSelector::~NodeSelector()
@@ -1061,6 +1561,72 @@ bool NodeSelectorResultList::sort_compare( NodeSelectorResult*& first, NodeSelec
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+NodeSelectorCache::NodeSelectorCache( DNS::QueryPtr &q )
+{
+   // parse the service field of each NAPTR answer
+   for (DNS::ResourceRecordList::const_iterator rrit = q->getAnswers().begin();
+        rrit != q->getAnswers().end();
+        ++rrit )
+   {
+      if ( (*rrit)->getType() != ns_t_naptr )
+         continue;
+
+      DNS::RRecordNAPTR* naptr = (DNS::RRecordNAPTR*)*rrit;
+      m_services.push_back( NaptrService( naptr, new AppService( naptr->getService() ) ) );
+   }
+}
+
+NodeSelectorCache::~NodeSelectorCache()
+{
+   for (NaptrServiceVector::iterator it = m_services.begin(); it != m_services.end(); ++it)
+      delete it->second;
+}
+
+std::shared_ptr<NodeSelectorCache> NodeSelectorCache::getInstance( DNS::QueryPtr &q )
+{
+   std::shared_ptr<NodeSelectorCache> nsc = std::dynamic_pointer_cast<NodeSelectorCache>( q->getExtension() );
+
+   if ( !nsc )
+   {
+      nsc.reset( new NodeSelectorCache( q ) );
+
+      // another thread may have attached an extension first
+      std::shared_ptr<NodeSelectorCache> current =
+         std::dynamic_pointer_cast<NodeSelectorCache>( q->setExtension( nsc ) );
+      if ( current )
+         nsc = current;
+   }
+
+   return nsc;
+}
+
+std::shared_ptr<const NodeSelectorResultList> NodeSelectorCache::findResults( const std::string &key )
+{
+   ERDLock l( m_rwlock );
+
+   std::unordered_map<std::string,std::shared_ptr<const NodeSelectorResultList> >::const_iterator it = m_results.find( key );
+
+   return it == m_results.end() ? std::shared_ptr<const NodeSelectorResultList>() : it->second;
+}
+
+std::shared_ptr<const NodeSelectorResultList> NodeSelectorCache::saveResults( const std::string &key, NodeSelectorResultList *results )
+{
+   std::shared_ptr<const NodeSelectorResultList> saved( results );
+
+   EWRLock l( m_rwlock );
+
+   std::unordered_map<std::string,std::shared_ptr<const NodeSelectorResultList> >::iterator it = m_results.find( key );
+   if ( it == m_results.end() )
+      m_results[key] = saved;
+   else
+      saved = it->second;
+
+   return saved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 void AppService::parse( const std::string &rs )
 {
    m_rawService = rs;
@@ -1121,38 +1687,94 @@ void AppProtocol::parse( const std::string &rp )
 
 ColocatedCandidate::ColocatedCandidate( NodeSelectorResult &candidate1, NodeSelectorResult &candidate2 )
    : m_candidate1( candidate1 ),
-     m_candidate2( candidate2 )
+     m_candidate2( candidate2 ),
+     m_cnn1( new CanonicalNodeName( candidate1.getHostname() ) ),
+     m_cnn2( new CanonicalNodeName( candidate2.getHostname() ) )
 {
-   m_cnn1.setName( m_candidate1.getHostname() );
-   m_cnn2.setName( m_candidate2.getHostname() );
-
    m_pairtype =
-      m_cnn1.getName() == m_cnn2.getName() ? ptColocated :
-      m_cnn1.getTopon() && m_cnn2.getTopon() ? ptTopologicalDistance : ptDNSPriority;
+      m_cnn1->getName() == m_cnn2->getName() ? ptColocated :
+      m_cnn1->getTopon() && m_cnn2->getTopon() ? ptTopologicalDistance : ptDNSPriority;
 
    m_topologicalMatches =
-      m_pairtype == ptTopologicalDistance ?  m_cnn1.topologicalCompare( m_cnn2 ) : 0;
+      m_pairtype == ptTopologicalDistance ?  m_cnn1->topologicalCompare( *m_cnn2 ) : 0;
 }
 
-ColocatedCandidateList::ColocatedCandidateList( NodeSelectorResultList &nodelist1, NodeSelectorResultList &nodelist2 )
-   : m_nodelist1( nodelist1 ),
-     m_nodelist2( nodelist2 )
+ColocatedCandidate::ColocatedCandidate( NodeSelectorResult &candidate1, NodeSelectorResult &candidate2,
+   std::shared_ptr<CanonicalNodeName> &cnn1, std::shared_ptr<CanonicalNodeName> &cnn2,
+   PairType pairtype, int topologicalMatches )
+   : m_candidate1( candidate1 ),
+     m_candidate2( candidate2 ),
+     m_cnn1( cnn1 ),
+     m_cnn2( cnn2 ),
+     m_pairtype( pairtype ),
+     m_topologicalMatches( topologicalMatches )
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
 {
-   // create all of the colocated candidate pairs (which also classifies them)
-   for ( NodeSelectorResultList::const_iterator it1 = m_nodelist1.begin();
-         it1 != m_nodelist1.end();
-         ++it1 )
+   // trie of the reversed canonical name labels of the nodelist2 topon nodes
+   class LabelTrie
    {
-      for( NodeSelectorResultList::const_iterator it2 = m_nodelist2.begin();
-           it2 != m_nodelist2.end();
-           it2++ )
+   public:
+      LabelTrie() {}
+      ~LabelTrie()
       {
-         ColocatedCandidate *cc = new ColocatedCandidate( *(*it1), *(*it2) );
-         push_back( cc );
+         for (std::unordered_map<LabelId,LabelTrie*>::iterator it = m_children.begin(); it != m_children.end(); ++it)
+            delete it->second;
       }
-   }
 
-   sort( ColocatedCandidateList::sort_compare );
+      void insert( const CanonicalNodeName &cnn, int idx )
+      {
+         LabelTrie *node = this;
+         for (CanonicalNodeName::const_iterator it = cnn.begin(); it != cnn.end(); ++it)
+         {
+            LabelTrie *&child = node->m_children[*it];
+            if ( !child )
+               child = new LabelTrie();
+            node = child;
+         }
+         node->m_terminal.push_back( idx );
+      }
+
+      LabelTrie *find( LabelId label )
+      {
+         std::unordered_map<LabelId,LabelTrie*>::iterator it = m_children.find( label );
+         return it == m_children.end() ? NULL : it->second;
+      }
+
+      // adds all of the indexes in this node, excluding the subtree of skip
+      void collect( std::vector<int> &idxs, LabelTrie *skip )
+      {
+         idxs.insert( idxs.end(), m_terminal.begin(), m_terminal.end() );
+         for (std::unordered_map<LabelId,LabelTrie*>::iterator it = m_children.begin(); it != m_children.end(); ++it)
+         {
+            if ( it->second != skip )
+               it->second->collect( idxs, NULL );
+         }
+      }
+
+   private:
+      std::unordered_map<LabelId,LabelTrie*> m_children;
+      std::vector<int> m_terminal;
+   };
+}
+
+ColocatedCandidateList::ColocatedCandidateList( NodeSelectorResultList &nodelist1, NodeSelectorResultList &nodelist2 )
+   : m_nodelist1( nodelist1 ),
+     m_nodelist2( nodelist2 )
+{
+   build( SIZE_MAX );
+}
+
+ColocatedCandidateList::ColocatedCandidateList( NodeSelectorResultList &nodelist1, NodeSelectorResultList &nodelist2, size_t maxCandidates )
+   : m_nodelist1( nodelist1 ),
+     m_nodelist2( nodelist2 )
+{
+   build( maxCandidates );
 }
 
 ColocatedCandidateList::~ColocatedCandidateList()
@@ -1165,56 +1787,254 @@ ColocatedCandidateList::~ColocatedCandidateList()
    }
 }
 
-bool ColocatedCandidateList::sort_compare( ColocatedCandidate*& first, ColocatedCandidate*& second )
+void ColocatedCandidateList::build( size_t maxCandidates )
 {
-   // sort by pairtype ascending
-   if ( (int)first->getPairType() < (int)second->getPairType() )
-      return true;
-   if ( (int)first->getPairType() > (int)second->getPairType() )
-      return false;
+   std::vector<NodeSelectorResult*> nodes1( m_nodelist1.begin(), m_nodelist1.end() );
+   std::vector<NodeSelectorResult*> nodes2( m_nodelist2.begin(), m_nodelist2.end() );
+   std::vector<std::shared_ptr<CanonicalNodeName> > cnns1;
+   std::vector<std::shared_ptr<CanonicalNodeName> > cnns2;
+   std::unordered_map<std::string,std::vector<int> > names2;
+   std::vector<int> nontopon2;
+   LabelTrie trie;
+   size_t maxdepth = 0;
 
-   // sort by the candidate1 order
-   if ( first->getCandidate1().getOrder() < second->getCandidate1().getOrder() )
-      return true;
-   if ( first->getCandidate1().getOrder() > second->getCandidate1().getOrder() )
-      return false;
+   if ( maxCandidates == 0 )
+      return;
 
-   // sort by the candidate1 preference
-   return first->getCandidate1().getPreference() < second->getCandidate1().getPreference();
+   // parse each canonical node name once
+   for (size_t i = 0; i < nodes1.size(); i++)
+   {
+      cnns1.push_back( std::shared_ptr<CanonicalNodeName>( new CanonicalNodeName( nodes1[i]->getHostname() ) ) );
+      maxdepth = std::max( maxdepth, cnns1.back()->size() );
+   }
+
+   for (size_t j = 0; j < nodes2.size(); j++)
+   {
+      cnns2.push_back( std::shared_ptr<CanonicalNodeName>( new CanonicalNodeName( nodes2[j]->getHostname() ) ) );
+      names2[ cnns2[j]->getName() ].push_back( j );
+      if ( cnns2[j]->getTopon() )
+         trie.insert( *cnns2[j], j );
+      else
+         nontopon2.push_back( j );
+   }
+
+   // the candidate 1 processing order
+   std::vector<int> order1;
+   for (size_t i = 0; i < nodes1.size(); i++)
+      order1.push_back( i );
+   std::stable_sort( order1.begin(), order1.end(),
+      [&nodes1]( int l, int r )
+      {
+         if ( nodes1[l]->getOrder() != nodes1[r]->getOrder() )
+            return nodes1[l]->getOrder() < nodes1[r]->getOrder();
+         return nodes1[l]->getPreference() < nodes1[r]->getPreference();
+      } );
+
+   auto add = [&]( int i, int j, ColocatedCandidate::PairType pt, int matches ) -> bool
+   {
+      push_back( new ColocatedCandidate( *nodes1[i], *nodes2[j], cnns1[i], cnns2[j], pt, matches ) );
+      return size() < maxCandidates;
+   };
+
+   auto colocated = [&]( int i, int j ) -> bool
+   {
+      return cnns1[i]->getName() == cnns2[j]->getName();
+   };
+
+   // colocated pairs
+   for (std::vector<int>::const_iterator it = order1.begin(); it != order1.end(); ++it)
+   {
+      std::unordered_map<std::string,std::vector<int> >::const_iterator nit = names2.find( cnns1[*it]->getName() );
+      if ( nit == names2.end() )
+         continue;
+      for (std::vector<int>::const_iterator j = nit->second.begin(); j != nit->second.end(); ++j)
+      {
+         if ( !add( *it, *j, ColocatedCandidate::ptColocated, 0 ) )
+            return;
+      }
+   }
+
+   // topological pairs, most matching labels first
+   std::vector<std::vector<LabelTrie*> > paths( nodes1.size() );
+   for (std::vector<int>::const_iterator it = order1.begin(); it != order1.end(); ++it)
+   {
+      if ( !cnns1[*it]->getTopon() )
+         continue;
+      LabelTrie *node = &trie;
+      paths[*it].push_back( node );
+      for (CanonicalNodeName::const_iterator lit = cnns1[*it]->begin(); lit != cnns1[*it]->end(); ++lit)
+      {
+         if ( !(node = node->find( *lit )) )
+            break;
+         paths[*it].push_back( node );
+      }
+   }
+
+   for (int depth = (int)maxdepth; depth >= 0; depth--)
+   {
+      for (std::vector<int>::const_iterator it = order1.begin(); it != order1.end(); ++it)
+      {
+         std::vector<LabelTrie*> &path = paths[*it];
+         if ( (int)path.size() <= depth )
+            continue;
+
+         // the nodes that match exactly depth labels
+         std::vector<int> idxs;
+         path[depth]->collect( idxs, depth + 1 < (int)path.size() ? path[depth + 1] : NULL );
+         std::sort( idxs.begin(), idxs.end() );
+
+         for (std::vector<int>::const_iterator j = idxs.begin(); j != idxs.end(); ++j)
+         {
+            if ( colocated( *it, *j ) )
+               continue;
+            if ( !add( *it, *j, ColocatedCandidate::ptTopologicalDistance, depth ) )
+               return;
+         }
+      }
+   }
+
+   // the remaining pairs are ordered by DNS priority
+   for (std::vector<int>::const_iterator it = order1.begin(); it != order1.end(); ++it)
+   {
+      bool topon = cnns1[*it]->getTopon();
+      size_t cnt = topon ? nontopon2.size() : nodes2.size();
+
+      for (size_t k = 0; k < cnt; k++)
+      {
+         int j = topon ? nontopon2[k] : k;
+         if ( colocated( *it, j ) )
+            continue;
+         if ( !add( *it, j, ColocatedCandidate::ptDNSPriority, 0 ) )
+            return;
+      }
+   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+long DiameterSelector::m_deferred = 0;
+
 DiameterSelector::DiameterSelector()
    : m_application( dia_app_unknown ),
-     m_protocol( dia_protocol_unknown )
+     m_protocol( dia_protocol_unknown ),
+     m_resolve( false ),
+     m_family( AF_UNSPEC ),
+     m_thread( NULL ),
+     m_message( 0 )
 {
 }
 
-DiameterNaptrList &DiameterSelector::process()
+bool DiameterSelector::validate()
 {
    // validate m_applciation
    if ( m_application == dia_app_unknown )
-      return m_results;
+      return false;
 
    // validate m_protocol
    if ( m_protocol == dia_protocol_unknown )
-      return m_results;
+      return false;
 
    // validate realm
    if ( m_realm.empty() )
-      return m_results;
+      return false;
 
-   // construct the service string
-   EString service( Utility::getDiameterService( m_application, m_protocol ) );
+   return true;
+}
+
+DiameterNaptrList &DiameterSelector::process()
+{
+   if ( !validate() )
+      return m_results;
 
    // perform dns query
    bool cacheHit = false;
    m_query = DNS::Cache::getInstance().query( ns_t_naptr, m_realm, cacheHit );
 
+   return evaluate( m_resolve );
+}
+
+void DiameterSelector::process( EThreadBase *thread, UInt message )
+{
+   m_thread = thread;
+   m_message = message;
+
+   if ( !validate() )
+   {
+      notifySelector( m_thread, m_message, (pVoid)this, m_deferred );
+      return;
+   }
+
+   // the callback is called immediately for a cache hit
+   DNS::Cache::getInstance().query( ns_t_naptr, m_realm, DiameterSelector::async_callback, this );
+}
+
+void DiameterSelector::async_callback( DNS::QueryPtr q, bool cacheHit, const void *data )
+{
+   DiameterSelector *ds = (DiameterSelector*)data;
+
+   // resolving here would block the resolver thread
+   ds->m_query = q;
+   ds->evaluate( false );
+
+   // this is either the resolver thread or, for a cache hit, the calling
+   // thread, neither of which can wait on the user's message queue
+   notifySelector( ds->m_thread, ds->m_message, (pVoid)ds, m_deferred );
+}
+
+void DiameterSelector::resolveHosts( std::vector<DiameterHost*> &hosts )
+{
+   std::vector<std::string> names;
+   for ( std::vector<DiameterHost*>::const_iterator it = hosts.begin(); it != hosts.end(); ++it )
+      names.push_back( (*it)->getName() );
+
+   // all of the hosts are resolved in parallel
+   DNS::AddressResultList results;
+   DNS::Cache::getInstance().resolveAddresses( names, results, m_family );
+
+   for ( size_t i = 0; i < hosts.size(); i++ )
+   {
+      DiameterHost &host = *hosts[i];
+      DNS::AddressResult &ar = results[i];
+
+      if ( ar.getIPv4() )
+      {
+         for ( DNS::ResourceRecordList::const_iterator it = ar.getIPv4()->getAnswers().begin();
+               it != ar.getIPv4()->getAnswers().end();
+               ++it )
+         {
+            if ( (*it)->getType() == ns_t_a )
+               host.addIPv4Address( ((DNS::RRecordA*)*it)->getAddressString() );
+         }
+      }
+
+      if ( ar.getIPv6() )
+      {
+         for ( DNS::ResourceRecordList::const_iterator it = ar.getIPv6()->getAnswers().begin();
+               it != ar.getIPv6()->getAnswers().end();
+               ++it )
+         {
+            if ( (*it)->getType() == ns_t_aaaa )
+               host.addIPv6Address( ((DNS::RRecordAAAA*)*it)->getAddressString() );
+         }
+      }
+
+      // randomize the ip addresses
+      host.getIPv4Addresses().shuffle();
+      host.getIPv6Addresses().shuffle();
+   }
+}
+
+DiameterNaptrList &DiameterSelector::evaluate( bool resolve )
+{
+   // construct the service string
+   EString service( Utility::getDiameterService( m_application, m_protocol ) );
+
+   // the hosts missing from the additional section
+   std::vector<DiameterHost*> unresolved;
+
    // evaluate each answer to see if it matches the service/protocol requirements
-   for ( std::list<DNS::ResourceRecord*>::const_iterator rrit = m_query->getAnswers().begin();
+   for ( DNS::ResourceRecordList::const_iterator rrit = m_query->getAnswers().begin();
          rrit != m_query->getAnswers().end();
          ++rrit )
    {
@@ -1247,28 +2067,32 @@ DiameterNaptrList &DiameterSelector::process()
             a->getHost().setName( n->getReplacement() );
 
             // add all of the A/AAAA records for the host
-            for ( DNS::ResourceRecordList::const_iterator rr = m_query->getAdditional().begin();
-                  rr != m_query->getAdditional().end();
-                  ++rr)
+            const DNS::ResourceRecordVector &rrs = m_query->findRecords( a->getHost().getName() );
+            for ( DNS::ResourceRecordVector::const_iterator rr = rrs.begin(); rr != rrs.end(); ++rr )
             {
-               if ( (*rr)->getName() == a->getHost().getName() )
+               switch ( (*rr)->getType() )
                {
-                  switch ( (*rr)->getType() )
+                  case ns_t_a:
                   {
-                     case ns_t_a:
-                     {
-                        a->getHost().addIPv4Address( ((DNS::RRecordA*)*rr)->getAddressString() );
-                        break;
-                     }
-                     case ns_t_aaaa:
-                     {
-                        a->getHost().addIPv6Address( ((DNS::RRecordAAAA*)*rr)->getAddressString() );
-                        break;
-                     }
+                     a->getHost().addIPv4Address( ((DNS::RRecordA*)*rr)->getAddressString() );
+                     break;
+                  }
+                  case ns_t_aaaa:
+                  {
+                     a->getHost().addIPv6Address( ((DNS::RRecordAAAA*)*rr)->getAddressString() );
+                     break;
+                  }
+                  default:
+                  {
+                     break;
                   }
                }
             }
 
+            // the additional section did not include the host addresses
+            if ( resolve && a->getHost().getIPv4Addresses().empty() && a->getHost().getIPv6Addresses().empty() )
+               unresolved.push_back( &a->getHost() );
+
             // randomize the ip addresses
             a->getHost().getIPv4Addresses().shuffle();
             a->getHost().getIPv6Addresses().shuffle();
@@ -1278,11 +2102,10 @@ DiameterNaptrList &DiameterSelector::process()
             DiameterNaptrS *s = (DiameterNaptrS*)n;
 
             // add all of the matching SRV records
-            for ( DNS::ResourceRecordList::const_iterator rr = m_query->getAdditional().begin();
-                  rr != m_query->getAdditional().end();
-                  ++rr)
+            const DNS::ResourceRecordVector &srvs = m_query->findRecords( s->getReplacement() );
+            for ( DNS::ResourceRecordVector::const_iterator rr = srvs.begin(); rr != srvs.end(); ++rr )
             {
-               if ( (*rr)->getType() == ns_t_srv &&  (*rr)->getName() == s->getReplacement() )
+               if ( (*rr)->getType() == ns_t_srv )
                {
                   DNS::RRecordSRV *rrs = (DNS::RRecordSRV*)*rr;
 
@@ -1293,30 +2116,37 @@ DiameterNaptrList &DiameterSelector::process()
                   ds->setWeight( rrs->getWeight() );
                   ds->setPort( rrs->getPort() );
 
-                  // loop through the additional records adding the hostname entries that match the SRV hostname
-                  for ( DNS::ResourceRecordList::const_iterator rr2 = m_query->getAdditional().begin();
-                        rr2 != m_query->getAdditional().end();
-                        ++rr2 )
+                  // add the hostname entries that match the SRV hostname
+                  const DNS::ResourceRecordVector &hosts = m_query->findRecords( rrs->getTarget() );
+                  for ( DNS::ResourceRecordVector::const_iterator rr2 = hosts.begin(); rr2 != hosts.end(); ++rr2 )
                   {
-                     if ( (*rr2)->getName() == rrs->getTarget() )
+                     ds->getHost().setName( (*rr2)->getName() );
+                     switch ( (*rr2)->getType() )
                      {
-                        ds->getHost().setName( (*rr2)->getName() );
-                        switch ( (*rr2)->getType() )
+                        case ns_t_a:
+                        {
+                           ds->getHost().addIPv4Address( ((DNS::RRecordA*)*rr2)->getAddressString() );
+                           break;
+                        }
+                        case ns_t_aaaa:
+                        {
+                           ds->getHost().addIPv6Address( ((DNS::RRecordAAAA*)*rr2)->getAddressString() );
+                           break;
+                        }
+                        default:
                         {
-                           case ns_t_a:
-                           {
-                              ds->getHost().addIPv4Address( ((DNS::RRecordA*)*rr2)->getAddressString() );
-                              break;
-                           }
-                           case ns_t_aaaa:
-                           {
-                              ds->getHost().addIPv6Address( ((DNS::RRecordAAAA*)*rr2)->getAddressString() );
-                              break;
-                           }
+                           break;
                         }
                      }
                   }
 
+                  // the additional section did not include the target addresses
+                  if ( resolve && hosts.empty() )
+                  {
+                     ds->getHost().setName( rrs->getTarget() );
+                     unresolved.push_back( &ds->getHost() );
+                  }
+
                   // randomize the ip addresses
                   ds->getHost().getIPv4Addresses().shuffle();
                   ds->getHost().getIPv6Addresses().shuffle();
@@ -1339,7 +2169,10 @@ DiameterNaptrList &DiameterSelector::process()
          m_results.push_back( n );
       }
    }
-   
+
+   if ( !unresolved.empty() )
+      resolveHosts( unresolved );
+
 
    return m_results;
 }
@@ -140,7 +140,7 @@ Bool EThreadQueueBase::push(UInt msgid, EThreadMessage::etmessage_data_t &d, Boo
    if (m_mode == ReadOnly)
       throw EThreadQueueBaseError_NotOpenForWriting();
 
-   if (semFree().Decrement(wait) < 0)
+   if (!semFree().Decrement(wait))
       return False;
 
    {